@@ -129,13 +129,13 @@ int kvs_disconnect(int server_fd, const char *req_pipe, const char *resp_pipe) {
   return 0;
 }
 
-int kvs_subscribe(const char *key) {
+int kvs_subscribe(const char *key, int latest) {
   char result_message[2];
   char send_message[MAX_STRING_SIZE + 2];
   size_t key_size = strlen(key);
   
-  /* Build the string with the message to send (Opcode 3 + key). */
-  send_message[0] = OP_CODE_SUBSCRIBE;
+  /* Build the string with the message to send (Opcode 3 or 5 + key). */
+  send_message[0] = latest ? OP_CODE_SUBSCRIBE_LATEST : OP_CODE_SUBSCRIBE;
   strcat(send_message, key);
   /** Add padding. */
   for(size_t i = key_size + 1; i < MAX_STRING_SIZE + 2; i++){
@@ -20,10 +20,12 @@ int kvs_disconnect(int server_fd, const char *req_pipe, const char * resp_pipe);
 
 /// Requests a subscription for a key
 /// @param key Key to be subscribed
+/// @param latest If set, changes not delivered yet are replaced by newer ones
+/// (only the latest value of the key is received).
 /// @return 1 if the key was subscribed successfully (key existing), 0
 /// otherwise.
 
-int kvs_subscribe(const char *key);
+int kvs_subscribe(const char *key, int latest);
 
 /// Remove a subscription for a key
 /// @param key Key to be unsubscribed
@@ -41,7 +41,8 @@ int main(int argc, char *argv[]) {
   }
 
   while (1) {
-    switch (get_next(STDIN_FILENO)) {
+    enum Command cmd = get_next(STDIN_FILENO);
+    switch (cmd) {
     case CMD_DISCONNECT:
       if ((res = kvs_disconnect(server_fd, req_pipe_path, resp_pipe_path)) == 1) {
         fprintf(stderr, "Failed to disconnect to the server.\n");
@@ -62,12 +63,13 @@ int main(int argc, char *argv[]) {
       return 0;
 
     case CMD_SUBSCRIBE:
+    case CMD_SUBSCRIBE_LATEST:
       num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
       if (num == 0) {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         continue;
       }
-      if ((res = kvs_subscribe(keys[0])) == 1) {
+      if ((res = kvs_subscribe(keys[0], cmd == CMD_SUBSCRIBE_LATEST)) == 1) {
         fprintf(stderr, "Command subscribe failed\n");
       }
       else if (res == 2){
@@ -100,7 +100,21 @@ enum Command get_next(int fd) {
 
   switch (buf[0]) {
   case 'S':
-    if (read(fd, buf + 1, 9) != 9 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
+    if (read(fd, buf + 1, 9) != 9 || strncmp(buf, "SUBSCRIBE", 9) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    if (buf[9] == '_') {
+      if (read(fd, buf + 10, 6) != 6 || strncmp(buf, "SUBSCRIBE_LATEST", 16) != 0 ||
+          read(fd, buf, 1) != 1 || buf[0] != ' ') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_SUBSCRIBE_LATEST;
+    }
+
+    if (buf[9] != ' ') {
       cleanup(fd);
       return CMD_INVALID;
     }
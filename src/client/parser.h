@@ -8,6 +8,7 @@
 enum Command {
   CMD_DISCONNECT,
   CMD_SUBSCRIBE,
+  CMD_SUBSCRIBE_LATEST,
   CMD_UNSUBSCRIBE,
   CMD_DELAY,
   CMD_EMPTY,
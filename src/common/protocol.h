@@ -9,7 +9,9 @@ enum {
   OP_CODE_CONNECT = '1',
   OP_CODE_DISCONNECT = '2',
   OP_CODE_SUBSCRIBE = '3',
-  OP_CODE_UNSUBSCRIBE = '4'
+  OP_CODE_UNSUBSCRIBE = '4',
+  /** Subscribe, but only the latest value of each key is delivered. */
+  OP_CODE_SUBSCRIBE_LATEST = '5'
 };
 
 #endif // COMMON_PROTOCOL_H
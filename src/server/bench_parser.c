@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "io.h"
+#include "parser.h"
+
+/** WRITE commands in the benchmark's job file. */
+#define BENCH_COMMANDS 20000
+/** Pairs of every WRITE. */
+#define BENCH_PAIRS 64
+/** Times each parser goes through the file. */
+#define BENCH_ROUNDS 5
+
+/// Reads a character, as the parser did before the tokenizer.
+/// @param in Input buffer.
+/// @param ch Set to the character read.
+/// @return 1 if a character was read, 0 at the end of the input.
+static int reference_char(Input_Buffer *in, char *ch){
+  if (in->position == in->length && input_fill(in) <= 0) return 0;
+  *ch = in->data[in->position++];
+  return 1;
+}
+
+/// Copies a key or value up to its delimiter a character at a time, as
+/// the parser did before the tokenizer.
+/// @param in Input buffer.
+/// @param buffer Buffer for the string.
+/// @param max maximum size for the string.
+/// @return 0 if it ends on ',', 1 on ')', 2 on ']', -1 otherwise.
+static int reference_string(Input_Buffer *in, char *buffer, size_t max){
+  size_t i = 0;
+  char ch;
+
+  while (i < max - 1){
+    if (reference_char(in, &ch) != 1 || ch == ' ') return -1;
+    if (ch == ',') { buffer[i] = '\0'; return 0; }
+    if (ch == ')') { buffer[i] = '\0'; return 1; }
+    if (ch == ']') { buffer[i] = '\0'; return 2; }
+    buffer[i++] = ch;
+  }
+  return -1;
+}
+
+/// Parses the arguments of a WRITE into fixed arrays, as the parser did
+/// before the tokenizer.
+/// @param in Input buffer, past "WRITE ".
+/// @param keys Filled with the keys.
+/// @param values Filled with the values.
+/// @return Number of pairs, 0 on failure.
+static size_t reference_write(Input_Buffer *in, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]){
+  size_t num_pairs = 0;
+  char ch;
+
+  if (reference_char(in, &ch) != 1 || ch != '[' || reference_char(in, &ch) != 1 || ch != '(') return 0;
+  while (num_pairs < MAX_WRITE_SIZE){
+    if (reference_string(in, keys[num_pairs], MAX_STRING_SIZE) != 0 ||
+        reference_string(in, values[num_pairs], MAX_STRING_SIZE) != 1)
+      return 0;
+    num_pairs++;
+    if (reference_char(in, &ch) != 1 || (ch != '(' && ch != ']')) return 0;
+    if (ch == ']') break;
+  }
+  if (reference_char(in, &ch) != 1 || ch != '\n') return 0;
+  return num_pairs;
+}
+
+/// Writes the job file of the benchmark.
+/// @param fd File descriptor of the file.
+/// @return Size of the file, 0 on failure.
+static size_t write_job(int fd){
+  Output_Buffer out;
+  size_t size = 0;
+  char line[BENCH_PAIRS * (2 * MAX_STRING_SIZE + 3) + 16];
+
+  output_init(&out, fd);
+  for (size_t i = 0; i < BENCH_COMMANDS; i++){
+    int length = snprintf(line, sizeof(line), "WRITE [");
+    for (size_t j = 0; j < BENCH_PAIRS; j++){
+      length += snprintf(line + length, sizeof(line) - (size_t)length, "(user:%06zu:%02zu,value-%zu)", i % 100000, j, i * j);
+    }
+    length += snprintf(line + length, sizeof(line) - (size_t)length, "]\n");
+    if (output_append(&out, line, (size_t)length) != 0) return 0;
+    size += (size_t)length;
+  }
+  return output_flush(&out) == 0 ? size : 0;
+}
+
+/// Parses the whole job file.
+/// @param fd File descriptor of the file.
+/// @param reference Whether the parser from before the tokenizer is used.
+/// @return Number of pairs parsed.
+static size_t parse_job(int fd, int reference){
+  static Input_Buffer in;
+  static char key_copies[MAX_WRITE_SIZE][MAX_STRING_SIZE], value_copies[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char *keys[MAX_WRITE_SIZE], *values[MAX_WRITE_SIZE];
+  size_t pairs = 0;
+
+  lseek(fd, 0, SEEK_SET);
+  input_init(&in, fd);
+  for (enum Command command; (command = get_next(&in)) != EOC;){
+    if (command != CMD_WRITE) continue;
+    pairs += reference ? reference_write(&in, key_copies, value_copies)
+                       : parse_write(&in, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  }
+  return pairs;
+}
+
+/// Seconds since some point, for timing.
+/// @return Seconds.
+static double now(){
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+int main(){
+  char path[] = "/tmp/bench_parser_XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd < 0){
+    fprintf(stderr, "Failed to create the job file\n");
+    return 1;
+  }
+  unlink(path);
+  size_t size = write_job(fd);
+  if (size == 0){
+    fprintf(stderr, "Failed to write the job file\n");
+    close(fd);
+    return 1;
+  }
+
+  printf("%d WRITE commands of %d pairs, %.1f MB\n", BENCH_COMMANDS, BENCH_PAIRS, (double)size / 1e6);
+  const char *names[] = {"byte at a time", "tokenizer"};
+  for (int reference = 1; reference >= 0; reference--){
+    double best = 0;
+    size_t pairs = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++){
+      double start = now();
+      pairs = parse_job(fd, reference);
+      double elapsed = now() - start;
+      if (round == 0 || elapsed < best) best = elapsed;
+    }
+    printf("%-15s %8.1f ms %8.1f MB/s (%zu pairs)\n", names[reference == 0], best * 1e3, (double)size / 1e6 / best, pairs);
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "snapshot_file.h"
+
+/// Pair read from a backup. value is NULL for a key deleted by a delta.
+typedef struct Record{
+  char *key;
+  char *value;
+  size_t order;
+}Record;
+
+typedef struct Records{
+  Record *records;
+  size_t count, capacity;
+}Records;
+
+/// Compares two records by key, and the ones of a key by the order they
+/// were read in.
+/// @param record1
+/// @param record2
+/// @return < 0 if record1 goes first, > 0 otherwise.
+static int compare_records(const void *record1, const void *record2){
+  const Record *first = (const Record *)record1, *second = (const Record *)record2;
+  int result = strcmp(first->key, second->key);
+
+  if (result != 0) return result;
+  return first->order < second->order ? -1 : 1;
+}
+
+/// Makes room for one more record.
+/// @param records
+/// @return The new record, NULL if there's no memory.
+static Record *new_record(Records *records){
+  if (records->count == records->capacity){
+    size_t capacity = records->capacity > 0 ? records->capacity * 2 : 1024;
+    Record *grown = realloc(records->records, capacity * sizeof(Record));
+    if (grown == NULL) return NULL;
+    records->records = grown;
+    records->capacity = capacity;
+  }
+  return &records->records[records->count];
+}
+
+/// Adds a line of a text backup to the records. Lines are (key, value) or,
+/// in deltas, (key) for a deleted key.
+/// @param records
+/// @param line Line without its '\n'.
+/// @param length Length of the line.
+/// @return 0 if successful, 1 if the line isn't valid or there's no memory.
+static int add_record(Records *records, char *line, size_t length){
+  if (length < 3 || line[0] != '(' || line[length - 1] != ')') return 1;
+  line[length - 1] = '\0';
+
+  Record *record = new_record(records);
+  if (record == NULL) return 1;
+  char *separator = strstr(line + 1, ", ");
+  if (separator != NULL) *separator = '\0';
+  if ((record->key = strdup(line + 1)) == NULL) return 1;
+  record->value = NULL;
+  if (separator != NULL && (record->value = strdup(separator + 2)) == NULL){
+    free(record->key);
+    return 1;
+  }
+  record->order = records->count++;
+  return 0;
+}
+
+/// Adds a record of a binary backup to the records.
+/// @param records
+/// @param snapshot_record Record, its value is NULL for a deleted key.
+/// @return 0 if successful, 1 if there's no memory.
+static int add_snapshot_record(Records *records, const Snapshot_Record *snapshot_record){
+  Record *record = new_record(records);
+  if (record == NULL) return 1;
+  if ((record->key = strndup(snapshot_record->key, snapshot_record->key_length)) == NULL) return 1;
+  record->value = NULL;
+  if (snapshot_record->value != NULL &&
+      (record->value = strndup(snapshot_record->value, snapshot_record->value_length)) == NULL){
+    free(record->key);
+    return 1;
+  }
+  record->order = records->count++;
+  return 0;
+}
+
+/// Reads every record of a binary backup (-b or -z), whose header and
+/// checksum are checked first.
+/// @param records
+/// @param path Path of the backup.
+/// @return 0 if successful, 1 otherwise.
+static int read_snapshot(Records *records, const char *path){
+  Snapshot_Map map;
+  Snapshot_Record record;
+  size_t offset = 0;
+  int error = 0;
+
+  if (snapshot_map_open(path, &map, 1) != 0) return 1;
+  for (uint64_t i = 0; !error && i < map.num_records; i++){
+    if ((offset = snapshot_map_record(&map, offset, &record)) == 0){
+      fprintf(stderr, "Invalid record on backup \"%s\"\n", path);
+      error = 1;
+    } else if (add_snapshot_record(records, &record) != 0){
+      fprintf(stderr, "Failed to allocate memory for backup \"%s\"\n", path);
+      error = 1;
+    }
+  }
+  if (!error && offset != map.records_size){
+    fprintf(stderr, "Invalid record on backup \"%s\"\n", path);
+    error = 1;
+  }
+  snapshot_map_close(&map);
+  return error;
+}
+
+/// Reads every pair of a backup file, text or binary. A backup written in
+/// segments is read segment by segment from its manifest.
+/// @param records
+/// @param path Path of the backup.
+/// @return 0 if successful, 1 otherwise.
+static int read_backup(Records *records, const char *path){
+  char segments[SNAPSHOT_MAX_SEGMENTS][SNAPSHOT_PATH_SIZE];
+  size_t count;
+  uint64_t flags, taken;
+
+  /** Segments don't share keys, so their order doesn't matter. */
+  if (snapshot_manifest_read(path, segments, &count) == 0){
+    for (size_t i = 0; i < count; i++){
+      if (read_backup(records, segments[i]) != 0) return 1;
+    }
+    return 0;
+  }
+  if (snapshot_file_probe(path, &flags, &taken) == 0) return read_snapshot(records, path);
+
+  FILE *file = fopen(path, "r");
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  int error = 0;
+
+  if (file == NULL){
+    fprintf(stderr, "Failed to open backup \"%s\"\n", path);
+    return 1;
+  }
+  while (!error && (length = getline(&line, &size, file)) != -1){
+    if (length > 0 && line[length - 1] == '\n') line[--length] = '\0';
+    if (length == 0) continue;
+    if (add_record(records, line, (size_t)length) != 0){
+      fprintf(stderr, "Invalid line on backup \"%s\": %s\n", path, line);
+      error = 1;
+    }
+  }
+  free(line);
+  fclose(file);
+  return error;
+}
+
+int main(int argc, char **argv){
+  Records records = {NULL, 0, 0};
+  int error = 0;
+
+  if (argc < 3){
+    fprintf(stderr, "Usage: %s <output> <base.bck> [delta.bck ...]\n"
+                    "Merges a full backup and the incremental ones that followed it, in order,\n"
+                    "into a full backup.\n", argv[0]);
+    return 1;
+  }
+  for (int i = 2; i < argc && !error; i++){
+    error = read_backup(&records, argv[i]);
+  }
+
+  FILE *output = NULL;
+  if (!error && (output = fopen(argv[1], "w")) == NULL){
+    fprintf(stderr, "Failed to open output \"%s\"\n", argv[1]);
+    error = 1;
+  }
+  if (!error){
+    /** Last record of each key wins, pairs come out in key order. */
+    qsort(records.records, records.count, sizeof(Record), compare_records);
+    for (size_t i = 0; i < records.count; i++){
+      Record *record = &records.records[i];
+      if (i + 1 < records.count && strcmp(record->key, records.records[i + 1].key) == 0) continue;
+      if (record->value != NULL && fprintf(output, "(%s, %s)\n", record->key, record->value) < 0){
+        fprintf(stderr, "Failed to write output \"%s\"\n", argv[1]);
+        error = 1;
+        break;
+      }
+    }
+    if (fclose(output) != 0) error = 1;
+  }
+
+  for (size_t i = 0; i < records.count; i++){
+    free(records.records[i].key);
+    free(records.records[i].value);
+  }
+  free(records.records);
+  return error;
+}
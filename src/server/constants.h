@@ -2,3 +2,4 @@
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
 #define MAX_REGISTER_MSG 121
+#define LOCKLESS_READ_ATTEMPTS 3
@@ -0,0 +1,211 @@
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/// Object waiting to be reclaimed.
+typedef struct Retired{
+  void *object;
+  Reclaim_Fn reclaim;
+  void *arg;
+}Retired;
+
+/// Objects retired before the global epoch was past epoch. They can be
+/// reclaimed once the global epoch reaches epoch + 2: by then every thread
+/// has left the reads that might have found them.
+typedef struct Retired_Batch{
+  struct Retired_Batch *next;
+  size_t epoch;
+  size_t count;
+  Retired objects[];
+}Retired_Batch;
+
+/// Registered thread. state is (epoch << 1) | 1 while it's reading, with
+/// the global epoch it saw when it started, and 0 otherwise.
+typedef struct Epoch_Thread{
+  _Alignas(64) _Atomic size_t state;
+  _Atomic int in_use;
+  size_t count;
+  Retired retired[EPOCH_BATCH_SIZE];
+}Epoch_Thread;
+
+typedef struct Epoch{
+  _Atomic size_t global;
+  pthread_mutex_t mutex;
+  Retired_Batch *limbo;
+  pthread_key_t key;
+  Epoch_Thread threads[MAX_EPOCH_THREADS];
+}Epoch;
+
+static Epoch epoch;
+static _Thread_local Epoch_Thread *self = NULL;
+
+/// Moves the global epoch forward if every reading thread already saw the
+/// current one. Caller must hold the mutex.
+/// @return Global epoch.
+static size_t try_advance(){
+  size_t current = atomic_load(&epoch.global);
+
+  for(size_t i = 0; i < MAX_EPOCH_THREADS; i++){
+    size_t state = atomic_load(&epoch.threads[i].state);
+    if((state & 1) && (state >> 1) != current) return current;
+  }
+  atomic_store(&epoch.global, current + 1);
+  return current + 1;
+}
+
+/// Reclaims a group of objects.
+/// @param objects
+/// @param count Number of objects.
+static void reclaim_objects(const Retired *objects, size_t count){
+  for(size_t i = 0; i < count; i++){
+    objects[i].reclaim(objects[i].object, objects[i].arg);
+  }
+}
+
+/// Reclaims every batch that is old enough. Caller must hold the mutex,
+/// which is released.
+/// @param current Global epoch.
+static void reclaim_batches(size_t current){
+  Retired_Batch **link = &epoch.limbo, *ready = NULL;
+
+  /** Take them out of limbo first, so reclaiming happens without the mutex. */
+  while(*link != NULL){
+    Retired_Batch *batch = *link;
+    if(batch->epoch + 2 <= current){
+      *link = batch->next;
+      batch->next = ready;
+      ready = batch;
+    }
+    else link = &batch->next;
+  }
+  pthread_mutex_unlock(&epoch.mutex);
+
+  while(ready != NULL){
+    Retired_Batch *next = ready->next;
+    reclaim_objects(ready->objects, ready->count);
+    free(ready);
+    ready = next;
+  }
+}
+
+/// Hands retired objects over to limbo and reclaims whatever is old enough.
+/// @param objects
+/// @param count Number of objects.
+static void hand_over(const Retired *objects, size_t count){
+  Retired_Batch *batch = malloc(sizeof(Retired_Batch) + count * sizeof(Retired));
+
+  /** No memory to keep them around, wait for the readers instead. */
+  if(batch == NULL){
+    pthread_mutex_lock(&epoch.mutex);
+    size_t target = atomic_load(&epoch.global) + 2;
+    while(try_advance() < target){
+      pthread_mutex_unlock(&epoch.mutex);
+      sched_yield();
+      pthread_mutex_lock(&epoch.mutex);
+    }
+    pthread_mutex_unlock(&epoch.mutex);
+    reclaim_objects(objects, count);
+    return;
+  }
+
+  batch->epoch = atomic_load(&epoch.global);
+  batch->count = count;
+  for(size_t i = 0; i < count; i++){
+    batch->objects[i] = objects[i];
+  }
+  pthread_mutex_lock(&epoch.mutex);
+  batch->next = epoch.limbo;
+  epoch.limbo = batch;
+  reclaim_batches(try_advance());
+}
+
+/// Unregisters a thread when it exits, handing over what it retired.
+/// @param arg Thread's slot.
+static void unregister_thread(void *arg){
+  Epoch_Thread *thread = (Epoch_Thread *)arg;
+
+  if(thread->count > 0) hand_over(thread->retired, thread->count);
+  thread->count = 0;
+  atomic_store(&thread->state, 0);
+  atomic_store(&thread->in_use, 0);
+}
+
+/// Takes a free slot for the calling thread.
+/// @return 0 if successful, 1 otherwise.
+static int register_thread(){
+  for(size_t i = 0; i < MAX_EPOCH_THREADS; i++){
+    int expected = 0;
+    if(atomic_compare_exchange_strong(&epoch.threads[i].in_use, &expected, 1)){
+      self = &epoch.threads[i];
+      self->count = 0;
+      if(pthread_setspecific(epoch.key, self) != 0){
+        atomic_store(&self->in_use, 0);
+        self = NULL;
+        return 1;
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int epoch_init(){
+  atomic_init(&epoch.global, 0);
+  epoch.limbo = NULL;
+  for(size_t i = 0; i < MAX_EPOCH_THREADS; i++){
+    atomic_init(&epoch.threads[i].state, 0);
+    atomic_init(&epoch.threads[i].in_use, 0);
+    epoch.threads[i].count = 0;
+  }
+  if(pthread_mutex_init(&epoch.mutex, NULL) != 0) return 1;
+  if(pthread_key_create(&epoch.key, unregister_thread) != 0){
+    pthread_mutex_destroy(&epoch.mutex);
+    return 1;
+  }
+  return 0;
+}
+
+void epoch_terminate(){
+  for(size_t i = 0; i < MAX_EPOCH_THREADS; i++){
+    reclaim_objects(epoch.threads[i].retired, epoch.threads[i].count);
+    epoch.threads[i].count = 0;
+  }
+  while(epoch.limbo != NULL){
+    Retired_Batch *next = epoch.limbo->next;
+    reclaim_objects(epoch.limbo->objects, epoch.limbo->count);
+    free(epoch.limbo);
+    epoch.limbo = next;
+  }
+  pthread_key_delete(epoch.key);
+  pthread_mutex_destroy(&epoch.mutex);
+}
+
+int epoch_enter(){
+  if(self == NULL && register_thread() != 0) return 1;
+
+  atomic_store(&self->state, (atomic_load(&epoch.global) << 1) | 1);
+  /** The state must be visible before the reader loads anything. */
+  atomic_thread_fence(memory_order_seq_cst);
+  return 0;
+}
+
+void epoch_exit(){
+  atomic_store_explicit(&self->state, 0, memory_order_release);
+}
+
+void epoch_retire(void *object, Reclaim_Fn reclaim, void *arg){
+  Retired retired = {object, reclaim, arg};
+
+  if(self == NULL && register_thread() != 0){
+    hand_over(&retired, 1);
+    return;
+  }
+  self->retired[self->count++] = retired;
+  if(self->count == EPOCH_BATCH_SIZE){
+    hand_over(self->retired, self->count);
+    self->count = 0;
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+#include <stddef.h>
+
+/** Maximum number of threads registered at once. */
+#define MAX_EPOCH_THREADS 256
+/** Number of objects a thread retires before handing them to be reclaimed. */
+#define EPOCH_BATCH_SIZE 64
+
+/// Function that gives a retired object back to where it came from.
+typedef void (*Reclaim_Fn)(void *object, void *arg);
+
+/// Starts the epoch based reclamation. Objects that lock-free readers might
+/// still be looking at are retired instead of freed, and only reclaimed once
+/// every thread that was reading when they were retired has left.
+/// @return 0 if successful, 1 otherwise.
+int epoch_init();
+
+/// Reclaims every object still retired. No thread can be reading anymore.
+void epoch_terminate();
+
+/// Starts a lock-free read. Threads register on their first read and are
+/// unregistered when they exit.
+/// @return 0 if successful, 1 if there was no room for the thread (it must
+/// read with locks instead).
+int epoch_enter();
+
+/// Ends a lock-free read started by epoch_enter.
+void epoch_exit();
+
+/// Retires an object that was already unlinked, so no new reader can find it.
+/// @param object Object to reclaim.
+/// @param reclaim Function called with object and arg once it's safe.
+/// @param arg Argument passed to reclaim.
+void epoch_retire(void *object, Reclaim_Fn reclaim, void *arg);
+
+#endif // KVS_EPOCH_H
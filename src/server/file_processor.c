@@ -5,13 +5,18 @@
 #include <dirent.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/wait.h>
-#include <signal.h>
+#include <stdatomic.h>
 
 #include "constants.h"
 #include "src/common/constants.h"
 #include "parser.h"
+#include "io.h"
 #include "operations.h"
+#include "file_processor.h"
+#include "job_pool.h"
+#include "job_graph.h"
+#include "ring.h"
+#include "src/common/io.h"
 
 typedef struct File{
   size_t path_size;
@@ -22,6 +27,11 @@ typedef struct File{
 typedef struct Thread_data{
   pthread_mutex_t *backup_mutex;
   size_t *backups_left;
+  int incremental;
+  Backup_Format format;
+  size_t segments;
+  size_t command_threads;
+  int pipelined;
   File *file;
 }Thread_data;
 
@@ -44,19 +54,376 @@ File *new_file(size_t path_size, char *directory_path, char *name){
     return new_file;
 }
 
+/// Command of a job, as parsed. keys and values point to the input buffer,
+/// or to the slot the command was copied to.
+typedef struct Job_Command{
+  enum Command command;
+  size_t num_pairs;
+  unsigned int delay;
+  /** SCAN or PREFIX that failed to parse, it's skipped. */
+  int invalid;
+  char *keys[MAX_WRITE_SIZE], *values[MAX_WRITE_SIZE];
+  /** Range of a SCAN or prefix of a PREFIX. */
+  char start[MAX_STRING_SIZE], end[MAX_STRING_SIZE];
+}Job_Command;
+
+/// What a job keeps between commands.
+typedef struct Job_State{
+  Thread_data *thread_data;
+  char *file_directory;
+  size_t backups_done;
+  /** Snapshot the job's next incremental backup goes from. */
+  struct Snapshot *base;
+  /** Runs the WRITE, READ and DELETE commands that don't share keys on several threads, if set. */
+  Job_Graph *graph;
+}Job_State;
+
+/// Command on the ring between the parser and executor stages, with its
+/// keys and values copied, since the input buffer moves on.
+typedef struct Parsed_Command{
+  Job_Command command;
+  char strings[2 * MAX_WRITE_SIZE * MAX_STRING_SIZE];
+}Parsed_Command;
+
+/// Output on the ring between the executor and output stages. The last
+/// block of a job is empty and has last set.
+typedef struct Output_Block{
+  size_t length;
+  int last;
+  char data[OUTPUT_BUFFER_SIZE];
+}Output_Block;
+
+/// Stages of a pipelined job: the parser thread reads and parses commands,
+/// the job's thread runs them, and the output thread writes what they
+/// output. Each stage only waits for the others when a ring is full or
+/// empty.
+typedef struct Pipeline{
+  Input_Buffer in;
+  int write_fd;
+  Ring commands, blocks;
+  /** Set by the output stage if a write fails. */
+  _Atomic int error;
+}Pipeline;
+
+/// Reads and parses the next command of a job.
+/// @param in Input buffer of the job.
+/// @param command Filled with the command.
+static void parse_job_command(Input_Buffer *in, Job_Command *command){
+  command->num_pairs = 0;
+  command->delay = 0;
+  command->invalid = 0;
+
+  switch (command->command = get_next(in)) {
+    case CMD_WRITE:
+      command->num_pairs = parse_write(in, command->keys, command->values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      if (command->num_pairs == 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+      }
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      command->num_pairs = parse_read_delete(in, command->keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      if (command->num_pairs == 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+      }
+      break;
+
+    case CMD_SCAN:
+      if (parse_scan(in, command->start, command->end, MAX_STRING_SIZE) != 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        command->invalid = 1;
+      }
+      break;
+
+    case CMD_PREFIX:
+      if (parse_prefix(in, command->start, MAX_STRING_SIZE) != 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        command->invalid = 1;
+      }
+      break;
+
+    case CMD_WAIT:
+      if (parse_wait(in, &command->delay, NULL) == -1) {
+        fprintf(stderr, "Failed to read pair\n");
+      }
+      break;
+
+    case CMD_INVALID:
+      fprintf(stderr, "Invalid command. See HELP for usage\n");
+      break;
+
+    case CMD_SHOW:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case EOC:
+      break;
+  }
+}
+
+/// Runs a command of a job.
+/// @param job State of the job.
+/// @param command Parsed command.
+/// @param out Output of the job.
+/// @return 1 once the job ended, 0 otherwise.
+static int run_job_command(Job_State *job, Job_Command *command, Output_Buffer *out){
+  Thread_data *thread_data = job->thread_data;
+
+  /** Any other command waits for the queued ones, and its output goes after theirs. */
+  if(job->graph != NULL && command->command != CMD_WRITE && command->command != CMD_READ &&
+     command->command != CMD_DELETE && command->command != CMD_EMPTY && command->command != CMD_INVALID &&
+     job_graph_run(job->graph, out) != 0)
+    fprintf(stderr, "Failure writing output file\n");
+
+  switch (command->command) {
+    case CMD_WRITE:
+      if (job->graph != NULL) {
+        if (job_graph_add(job->graph, CMD_WRITE, command->num_pairs, command->keys, command->values, out))
+          fprintf(stderr, "Failed to queue command\n");
+        break;
+      }
+      if (kvs_write(command->num_pairs, command->keys, command->values)) {
+        fprintf(stderr, "Failed to write pair\n");
+      }
+      break;
+
+    case CMD_READ:
+      if (job->graph != NULL) {
+        if (job_graph_add(job->graph, CMD_READ, command->num_pairs, command->keys, NULL, out))
+          fprintf(stderr, "Failed to queue command\n");
+        break;
+      }
+      if (kvs_read(command->num_pairs, command->keys, out)) {
+        fprintf(stderr, "Failed to read pair\n");
+      }
+      break;
+
+    case CMD_DELETE:
+      if (job->graph != NULL) {
+        if (job_graph_add(job->graph, CMD_DELETE, command->num_pairs, command->keys, NULL, out))
+          fprintf(stderr, "Failed to queue command\n");
+        break;
+      }
+      if (kvs_delete(command->num_pairs, command->keys, out)) {
+        fprintf(stderr,"Failed to delete pair\n");
+      }
+      break;
+
+    case CMD_SHOW:
+      kvs_show(out);
+      break;
+
+    case CMD_SCAN:
+      if (!command->invalid && kvs_scan(command->start, command->end, out)) {
+        fprintf(stderr, "Failed to scan pairs\n");
+      }
+      break;
+
+    case CMD_PREFIX:
+      if (!command->invalid && kvs_prefix(command->start, out)) {
+        fprintf(stderr, "Failed to scan pairs\n");
+      }
+      break;
+
+    case CMD_WAIT:
+      if (command->delay > 0) {
+        char message[] = "Waiting...\n";
+        /** Everything up to the wait is out before sleeping. */
+        if(output_append(out, message, sizeof(message) - 1) == -1 || output_flush(out) == -1)
+          fprintf(stderr, "Failure writing WAIT message");
+        kvs_wait(command->delay);
+      }
+      break;
+
+    case CMD_BACKUP:
+      if (kvs_backup(job->file_directory, &job->backups_done, thread_data->backups_left, 
+                     thread_data->backup_mutex, thread_data->incremental ? &job->base : NULL,
+                     thread_data->format, thread_data->segments)) { 
+        fprintf(stderr,"Failed to perform backup.\n");
+      }
+      break;
+
+    case CMD_HELP:{
+      char buffer[] = 
+          "Available commands:\n"
+          "  WRITE [(key,value)(key2,value2),...]\n"
+          "  READ [key,key2,...]\n"
+          "  DELETE [key,key2,...]\n"
+          "  SHOW\n"
+          "  SCAN [start,end]\n"
+          "  PREFIX <prefix>\n"
+          "  WAIT <delay_ms>\n"
+          "  BACKUP\n" 
+          "  HELP\n";
+      output_append(out, buffer, strlen(buffer));
+      break;
+    }
+    case CMD_INVALID:
+    case CMD_EMPTY:
+      break;
+    case EOC:
+      if(output_flush(out) == -1)
+        fprintf(stderr, "Failure writing output file\n");
+      return 1;
+  }
+  return 0;
+}
+
+/// Runs every command of a job on the calling thread.
+/// @param job State of the job.
+/// @param read_fd Job file.
+/// @param write_fd Output file.
+static void run_job(Job_State *job, int read_fd, int write_fd){
+  Job_Command command;
+  Input_Buffer in;
+  Output_Buffer out;
+
+  /** Commands are parsed straight from it, read a buffer at a time. */
+  input_init(&in, read_fd);
+  /** Commands append to it, it's written when full, before waiting and at the end. */
+  output_init(&out, write_fd);
+  do {
+    parse_job_command(&in, &command);
+  } while (!run_job_command(job, &command, &out));
+}
+
+/// Copies the keys and values of a parsed command to its slot.
+/// @param slot
+static void keep_strings(Parsed_Command *slot){
+  Job_Command *command = &slot->command;
+  char *strings = slot->strings;
+
+  if(command->command != CMD_WRITE && command->command != CMD_READ && command->command != CMD_DELETE) return;
+  for(size_t i = 0; i < command->num_pairs; i++){
+    for(int value = 0; value <= (command->command == CMD_WRITE); value++){
+      char **string = value ? &command->values[i] : &command->keys[i];
+      size_t length = strlen(*string) + 1;
+      memcpy(strings, *string, length);
+      *string = strings;
+      strings += length;
+    }
+  }
+}
+
+/// Thread function of the parser stage.
+/// @param arg Pipeline.
+/// @return NULL
+static void *parser_stage_fn(void *arg){
+  Pipeline *pipeline = (Pipeline *)arg;
+  enum Command command;
+
+  do {
+    Parsed_Command *slot = ring_reserve(&pipeline->commands);
+    parse_job_command(&pipeline->in, &slot->command);
+    keep_strings(slot);
+    command = slot->command.command;
+    ring_push(&pipeline->commands);
+  } while (command != EOC);
+  return NULL;
+}
+
+/// Thread function of the output stage.
+/// @param arg Pipeline.
+/// @return NULL
+static void *output_stage_fn(void *arg){
+  Pipeline *pipeline = (Pipeline *)arg;
+
+  while(1){
+    Output_Block *block = ring_peek(&pipeline->blocks);
+    int last = block->last;
+    if(block->length > 0 && write_all(pipeline->write_fd, block->data, block->length) == -1)
+      atomic_store(&pipeline->error, 1);
+    ring_pop(&pipeline->blocks);
+    if(last) return NULL;
+  }
+}
+
+/// Sink of the executor's output, hands it to the output stage.
+/// @param data
+/// @param size
+/// @param arg Pipeline.
+/// @return 0 if successful, -1 if the output stage failed to write.
+static int output_stage_sink(const char *data, size_t size, void *arg){
+  Pipeline *pipeline = (Pipeline *)arg;
+
+  while(size > 0){
+    Output_Block *block = ring_reserve(&pipeline->blocks);
+    block->length = size < OUTPUT_BUFFER_SIZE ? size : OUTPUT_BUFFER_SIZE;
+    block->last = 0;
+    memcpy(block->data, data, block->length);
+    ring_push(&pipeline->blocks);
+    data += block->length;
+    size -= block->length;
+  }
+  return atomic_load(&pipeline->error) ? -1 : 0;
+}
+
+/// Runs every command of a job with the parser and output stages on their
+/// own threads.
+/// @param job State of the job.
+/// @param read_fd Job file.
+/// @param write_fd Output file.
+/// @return 0 if the job ran, 1 if the stages couldn't be started (nothing
+/// was read yet).
+static int run_job_pipelined(Job_State *job, int read_fd, int write_fd){
+  Pipeline *pipeline;
+  pthread_t parser, writer;
+  Output_Buffer out;
+
+  if((pipeline = (Pipeline *)malloc(sizeof(Pipeline))) == NULL){
+    fprintf(stderr, "Failed to allocate memory for a pipeline.\n");
+    return 1;
+  }
+  input_init(&pipeline->in, read_fd);
+  pipeline->write_fd = write_fd;
+  atomic_init(&pipeline->error, 0);
+  if(ring_init(&pipeline->commands, PIPELINE_COMMANDS, sizeof(Parsed_Command)) != 0){
+    free(pipeline);
+    return 1;
+  }
+  if(ring_init(&pipeline->blocks, PIPELINE_BLOCKS, sizeof(Output_Block)) != 0){
+    ring_destroy(&pipeline->commands);
+    free(pipeline);
+    return 1;
+  }
+  if(pthread_create(&writer, NULL, output_stage_fn, pipeline) != 0){
+    fprintf(stderr, "Failed to create the output stage.\n");
+    ring_destroy(&pipeline->blocks);
+    ring_destroy(&pipeline->commands);
+    free(pipeline);
+    return 1;
+  }
+  int started = pthread_create(&parser, NULL, parser_stage_fn, pipeline) == 0;
+  if(!started){
+    fprintf(stderr, "Failed to create the parser stage.\n");
+  }
+
+  /** The job's thread is the executor stage. */
+  output_init_sink(&out, output_stage_sink, pipeline);
+  for(int quit = !started; !quit;){
+    Parsed_Command *slot = ring_peek(&pipeline->commands);
+    quit = run_job_command(job, &slot->command, &out);
+    ring_pop(&pipeline->commands);
+  }
+
+  Output_Block *block = ring_reserve(&pipeline->blocks);
+  block->length = 0;
+  block->last = 1;
+  ring_push(&pipeline->blocks);
+  if(started && pthread_join(parser, NULL) != 0) fprintf(stderr, "Failed to join the parser stage.\n");
+  if(pthread_join(writer, NULL) != 0) fprintf(stderr, "Failed to join the output stage.\n");
+  if(atomic_load(&pipeline->error)) fprintf(stderr, "Failure writing output file\n");
+
+  ring_destroy(&pipeline->blocks);
+  ring_destroy(&pipeline->commands);
+  free(pipeline);
+  return !started;
+}
+
 void *process_file(void *arg){
   Thread_data *thread_data = (Thread_data *)arg;
-  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  unsigned int delay;
-  size_t num_pairs;
-  size_t backups_done = 0;
   int read_fd, write_fd;
-  sigset_t mask;
-
-  sigemptyset (&mask);
-  sigaddset (&mask, SIGUSR1);
-  pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
   /** Build relative path of file. */
   char file_directory[thread_data->file->path_size];
@@ -88,107 +455,38 @@ void *process_file(void *arg){
     close(read_fd);
   }
 
-  int quit = 0;
-  while(!quit){
-    switch (get_next(read_fd)) {
-      case CMD_WRITE:
-        num_pairs = parse_write(read_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-        }
-
-        if (kvs_write(num_pairs, keys, values)) {
-          fprintf(stderr, "Failed to write pair\n");
-        }
-        break;
-
-      case CMD_READ:
-        num_pairs = parse_read_delete(read_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-        }
-
-        if (kvs_read(num_pairs, keys, write_fd)) {
-          fprintf(stderr, "Failed to read pair\n");
-        }
-        break;
-
-      case CMD_DELETE:
-        num_pairs = parse_read_delete(read_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-        }
-
-        if (kvs_delete(num_pairs, keys, write_fd)) {
-          fprintf(stderr,"Failed to delete pair\n");
-        }
-        break;
-
-      case CMD_SHOW:
-        kvs_show(write_fd);
-        break;
-
-      case CMD_WAIT:
-        if (parse_wait(read_fd, &delay, NULL) == -1) {
-          fprintf(stderr, "Failed to read pair\n");
-        }
-
-        if (delay > 0) {
-          char message[] = "Waiting...\n";
-          if(write(write_fd, message, sizeof(message) - 1) == -1)
-            fprintf(stderr, "Failure writing WAIT message");
-          kvs_wait(delay);
-        }
-        break;
-
-      case CMD_BACKUP:
-        if (kvs_backup(file_directory, &backups_done, thread_data->backups_left, 
-                                                      thread_data->backup_mutex)) { 
-          fprintf(stderr,"Failed to perform backup.\n");
-        }
-        break;
+  Job_State job = {thread_data, file_directory, 0, NULL, NULL};
+  if(thread_data->command_threads > 1 && (job.graph = job_graph_create(thread_data->command_threads)) == NULL)
+    fprintf(stderr, "Failed to start the command threads, running %s on one.\n", file_directory);
 
-      case CMD_INVALID:
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-        break;
+  if(!thread_data->pipelined || run_job_pipelined(&job, read_fd, write_fd) != 0)
+    run_job(&job, read_fd, write_fd);
 
-      case CMD_HELP:{
-        char buffer[] = 
-            "Available commands:\n"
-            "  WRITE [(key,value)(key2,value2),...]\n"
-            "  READ [key,key2,...]\n"
-            "  DELETE [key,key2,...]\n"
-            "  SHOW\n"
-            "  WAIT <delay_ms>\n"
-            "  BACKUP\n" 
-            "  HELP\n";
-        write_buffer(write_fd, buffer, strlen(buffer));
-        break;
-      }
-      case CMD_EMPTY:
-        break;
-      case EOC:
-        /** Close input and output file. */
-        close(read_fd);
-        close(write_fd);
-        free(thread_data->file);
-        free(thread_data);
-        quit = 1;
-    }
-  }
+  kvs_end_backups(job.base);
+  if(job.graph != NULL) job_graph_destroy(job.graph);
+  /** Close input and output file. */
+  close(read_fd);
+  close(write_fd);
+  free(thread_data->file);
+  free(thread_data);
   return NULL;
 }
 
 int dispatch_job_threads(char* directory_path, size_t MAX_BACKUPS, size_t MAX_THREADS, pthread_mutex_t* backup_mutex,
-                      DIR* pDir){
+                      DIR* pDir, int incremental, Backup_Format format, size_t segments, size_t command_threads,
+                      int pipelined, Job_Pool_Stats *stats){
   int error = 0;
   struct dirent* file_dir;
   size_t backups_left = MAX_BACKUPS;
-  size_t threads_index = 0;
-  pthread_t threads[MAX_THREADS];
   size_t directory_size = strlen(directory_path);
+  /** Workers take whichever job is next, so a long one doesn't hold the others back. */
+  Job_Pool *pool = job_pool_create(MAX_THREADS);
+
+  if(pool == NULL){
+    fprintf(stderr, "Failed to start the job threads.\n");
+    pthread_mutex_destroy(backup_mutex);
+    return 1;
+  }
 
   /** Keep running until there's no files to read. */
   while ((file_dir = readdir(pDir)) != NULL) {
@@ -204,47 +502,36 @@ int dispatch_job_threads(char* directory_path, size_t MAX_BACKUPS, size_t MAX_TH
     if((new_thread = (Thread_data *)malloc(sizeof(Thread_data))) == NULL){
       fprintf(stderr, "Failed to allocate memory for new thread struct.\n");
       error = 1;
+      continue;
     }
     new_thread->backups_left = &backups_left;
+    new_thread->incremental = incremental;
+    new_thread->format = format;
+    new_thread->segments = segments;
+    new_thread->command_threads = command_threads;
+    new_thread->pipelined = pipelined;
     /** Create a new File. */
     if((new_thread->file = new_file(directory_size + file_name_size + 2, directory_path, file_dir->d_name)) == NULL){ 
       free(new_thread);
-      error = 1;                                                                                     
+      error = 1;
+      continue;
     }
     new_thread->backup_mutex = backup_mutex;
 
-    /** Array of threads is full. */
-    if(threads_index >= MAX_THREADS){
-      /** Wait for a thread to finish. */
-      if(pthread_join(threads[threads_index % MAX_THREADS], NULL) != 0){
-        fprintf(stderr, "Failed to join thread.\n");
-        error = 1;
-        break;
-      }
-    }
-    /** Create a new thread. */
-    if(pthread_create(&threads[threads_index % MAX_THREADS], NULL, process_file, (void*) new_thread) != 0){
-      fprintf(stderr, "Failed to create a thread.\n");
+    /** Queue the job for the next free thread. */
+    if(job_pool_submit(pool, process_file, (void*) new_thread) != 0){
+      free(new_thread->file);
       free(new_thread);
       error = 1;
       break;
     }
-    threads_index++;
   }
 
-  /** Wait for all threads to finish. */
-  for(size_t i = 0; i < MAX_THREADS && i < threads_index; i++){
-    if(pthread_join(threads[i], NULL) != 0){
-      fprintf(stderr, "Failed to join thread.\n");
-      error = 1;
-    }
-  }
+  /** Wait for all jobs to finish. */
+  if(job_pool_destroy(pool, stats) != 0) error = 1;
 
   /** Wait for all backups to finish. */
-  while(backups_left < MAX_BACKUPS){
-    wait(NULL);
-    backups_left++;
-  }
+  kvs_wait_backups(MAX_BACKUPS, &backups_left, backup_mutex);
 
   /** Destroy backup mutex. */
   pthread_mutex_destroy(backup_mutex);
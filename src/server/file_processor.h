@@ -4,17 +4,37 @@
 #include <dirent.h>
 #include <pthread.h>
 
-/// Creates every thread to process the .job files.
+#include "operations.h"
+#include "job_pool.h"
+
+/** Commands a pipelined job's parser stage can be ahead of its executor. */
+#define PIPELINE_COMMANDS 32
+/** Output buffers a pipelined job's executor can be ahead of its output stage. */
+#define PIPELINE_BLOCKS 8
+
+/// Processes the .job files on a pool of MAX_THREADS threads, each job run
+/// by whichever thread is free first.
 /// @param directory_path path of the folder with .job files.
 /// @param MAX_BACKUPS max concurrent bakcups
-/// @param MAX_THREADS max concurrent threads.
+/// @param MAX_THREADS max concurrent threads (at least 1).
 /// @param backup_mutex mutex for bakcup.
 /// @param pDir DIR struct for folder with .job files.
+/// @param incremental Whether backups after a job's first one only store
+/// what changed since the job's previous backup.
+/// @param format Format of the backup files.
+/// @param segments Number of threads (and segment files) each backup is
+/// written with, 1 for a single file.
+/// @param command_threads Number of threads running the WRITE, READ and
+/// DELETE commands of each job that don't share keys, 1 to run them in order.
+/// @param pipelined Whether each job is parsed, run and written by three
+/// threads at once instead of one.
+/// @param stats Set to how many jobs ran and how long they waited, if not NULL.
 /// @return 0 if everything was successful and 1 otherwise.
 int dispatch_job_threads(char* directory_path, size_t MAX_BACKUPS, size_t MAX_THREADS, pthread_mutex_t* backup_mutex,
-                      DIR* pDir);
+                      DIR* pDir, int incremental, Backup_Format format, size_t segments, size_t command_threads,
+                      int pipelined, Job_Pool_Stats *stats);
 
-/// Processes every command on a file.
+/// Processes every command on a file, run as a job of the pool.
 /// @param arg pointer to arguments needed for making in and out file.
 /// @return NULL
 void *process_file(void *arg);
@@ -1,3 +1,5 @@
+#include "io.h"
+
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
@@ -43,3 +45,92 @@ size_t strn_memcpy(char *dest, const char *src, size_t n) {
   memcpy(dest, src, bytes_to_copy);
   return bytes_to_copy;
 }
+
+void input_init(Input_Buffer *in, int fd) {
+  in->fd = fd;
+  in->position = 0;
+  in->length = 0;
+}
+
+ssize_t input_fill(Input_Buffer *in) {
+  ssize_t bytes_read;
+
+  in->position = 0;
+  in->length = 0;
+  if ((bytes_read = read(in->fd, in->data, INPUT_BUFFER_SIZE)) > 0) in->length = (size_t)bytes_read;
+  return bytes_read;
+}
+
+size_t input_window(Input_Buffer *in, size_t size) {
+  if (in->length - in->position >= size) return in->length - in->position;
+
+  memmove(in->data, in->data + in->position, in->length - in->position);
+  in->length -= in->position;
+  in->position = 0;
+  while (in->length < size) {
+    ssize_t bytes_read = read(in->fd, in->data + in->length, INPUT_BUFFER_SIZE - in->length);
+    if (bytes_read <= 0) break;
+    in->length += (size_t)bytes_read;
+  }
+  return in->length;
+}
+
+void output_init(Output_Buffer *out, int fd) {
+  out->fd = fd;
+  out->sink = NULL;
+  out->sink_arg = NULL;
+  out->length = 0;
+}
+
+void output_init_sink(Output_Buffer *out, int (*sink)(const char *data, size_t size, void *arg), void *arg) {
+  output_init(out, -1);
+  out->sink = sink;
+  out->sink_arg = arg;
+}
+
+/// Writes bytes to the output's file descriptor, or hands them to its sink.
+/// @param out Output buffer.
+/// @param data Bytes to write.
+/// @param size Number of bytes.
+/// @return 0 if successful, -1 otherwise.
+static int output_write(Output_Buffer *out, const char *data, size_t size) {
+  if (out->sink != NULL) return out->sink(data, size, out->sink_arg);
+  while (size > 0) {
+    ssize_t written = write(out->fd, data, size);
+    if (written < 0) return -1;
+    data += written;
+    size -= (size_t)written;
+  }
+  return 0;
+}
+
+int output_flush(Output_Buffer *out) {
+  int result = out->length > 0 ? output_write(out, out->data, out->length) : 0;
+
+  out->length = 0;
+  return result;
+}
+
+char *output_reserve(Output_Buffer *out, size_t size) {
+  if (size > OUTPUT_BUFFER_SIZE) return NULL;
+  if (out->length + size > OUTPUT_BUFFER_SIZE && output_flush(out) != 0) return NULL;
+  return out->data + out->length;
+}
+
+void output_commit(Output_Buffer *out, size_t size) {
+  out->length += size;
+}
+
+int output_append(Output_Buffer *out, const char *data, size_t size) {
+  /** Too big to buffer, write it straight after what's buffered. */
+  if (size > OUTPUT_BUFFER_SIZE) {
+    if (output_flush(out) != 0) return -1;
+    return output_write(out, data, size);
+  }
+
+  char *room = output_reserve(out, size);
+  if (room == NULL) return -1;
+  memcpy(room, data, size);
+  output_commit(out, size);
+  return 0;
+}
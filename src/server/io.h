@@ -3,6 +3,32 @@
 
 #include <unistd.h>
 
+/** Size of the buffer a job's output goes through. */
+#define OUTPUT_BUFFER_SIZE 32768
+/** Size of the buffer a job's commands are read through. */
+#define INPUT_BUFFER_SIZE 65536
+
+/// Output of a job. Commands append to it and it's only written to fd when
+/// full or flushed, so small outputs don't cost a system call each. With a
+/// sink, what would be written is handed to it instead.
+typedef struct Output_Buffer {
+  int fd;
+  int (*sink)(const char *data, size_t size, void *arg);
+  void *sink_arg;
+  size_t length;
+  char data[OUTPUT_BUFFER_SIZE];
+} Output_Buffer;
+
+/// Commands of a job, read from fd a buffer at a time. The parser takes
+/// bytes from data[position] up to data[length] and only refills it once
+/// they run out.
+typedef struct Input_Buffer {
+  int fd;
+  size_t position;
+  size_t length;
+  char data[INPUT_BUFFER_SIZE];
+} Input_Buffer;
+
 /// Writes a string to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param str The string to write.
@@ -20,4 +46,60 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied
 size_t strn_memcpy(char *dest, const char *src, size_t n);
 
+/// Initializes an empty input buffer.
+/// @param in Input buffer.
+/// @param fd File descriptor the input comes from.
+void input_init(Input_Buffer *in, int fd);
+
+/// Reads the next bytes of the input, once everything buffered was used.
+/// @param in Input buffer.
+/// @return Number of bytes buffered, 0 at the end of the input, -1 on error.
+ssize_t input_fill(Input_Buffer *in);
+
+/// Makes the next size bytes of the input (or all that's left of it, if
+/// less) contiguous on the buffer, moving what's buffered to its start if
+/// needed.
+/// @param in Input buffer.
+/// @param size Number of bytes wanted, at most INPUT_BUFFER_SIZE.
+/// @return Number of bytes buffered from in->position, less than size only at
+/// the end of the input.
+size_t input_window(Input_Buffer *in, size_t size);
+
+/// Initializes an empty output buffer.
+/// @param out Output buffer.
+/// @param fd File descriptor the output goes to.
+void output_init(Output_Buffer *out, int fd);
+
+/// Initializes an empty output buffer that hands its output to a function
+/// instead of writing it.
+/// @param out Output buffer.
+/// @param sink Function taking the output, returning 0 if successful and -1
+/// otherwise.
+/// @param arg Last argument of the sink.
+void output_init_sink(Output_Buffer *out, int (*sink)(const char *data, size_t size, void *arg), void *arg);
+
+/// Writes everything buffered to the file descriptor.
+/// @param out Output buffer.
+/// @return 0 if successful, -1 otherwise.
+int output_flush(Output_Buffer *out);
+
+/// Returns room for size bytes at the end of the buffer, flushing it first
+/// if they don't fit. The bytes only count once output_commit is called.
+/// @param out Output buffer.
+/// @param size Number of bytes needed (at most OUTPUT_BUFFER_SIZE).
+/// @return Pointer to the room, NULL on failure.
+char *output_reserve(Output_Buffer *out, size_t size);
+
+/// Adds bytes written to room given by output_reserve to the output.
+/// @param out Output buffer.
+/// @param size Number of bytes written.
+void output_commit(Output_Buffer *out, size_t size);
+
+/// Appends bytes to the output.
+/// @param out Output buffer.
+/// @param data Bytes to append.
+/// @param size Number of bytes.
+/// @return 0 if successful, -1 otherwise.
+int output_append(Output_Buffer *out, const char *data, size_t size);
+
 #endif // KVS_IO_H
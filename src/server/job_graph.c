@@ -0,0 +1,336 @@
+#include "job_graph.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "constants.h"
+#include "kvs.h"
+#include "operations.h"
+
+/** Slots of the table of keys of a batch, a power of 2 at least twice JOB_GRAPH_MAX_KEYS. */
+#define KEY_SLOTS (2 * JOB_GRAPH_MAX_KEYS)
+/** No command, or no reader. */
+#define NO_NODE SIZE_MAX
+
+/// Queued command. output is only touched by the thread running it and
+/// successors, waiting and done are guarded by the graph's mutex.
+typedef struct Graph_Node{
+  enum Command command;
+  size_t num_pairs;
+  char **keys, **values;
+  char *output;
+  size_t output_length;
+  /** Commands waiting for this one. */
+  size_t *successors;
+  size_t num_successors, successors_capacity;
+  /** Earlier commands it still waits for. */
+  size_t waiting;
+  int done;
+  /** Pointers to the keys and values, followed by their characters. */
+  char *strings[];
+}Graph_Node;
+
+/// Key of the batch: the last command writing or deleting it, and the
+/// commands reading it since (a list on the graph's readers). It's only
+/// valid if batch is the graph's current one.
+typedef struct Key_Entry{
+  const char *key;
+  size_t batch;
+  size_t last_writer, first_reader;
+}Key_Entry;
+
+typedef struct Key_Reader{
+  size_t node, next;
+}Key_Reader;
+
+struct Job_Graph{
+  pthread_mutex_t mutex;
+  pthread_cond_t has_ready;
+  Graph_Node *nodes[JOB_GRAPH_BATCH_SIZE];
+  size_t num_nodes;
+  /** Commands that don't wait for any other, taken newest first. */
+  size_t ready[JOB_GRAPH_BATCH_SIZE];
+  size_t num_ready;
+  /** Queued commands that haven't finished. */
+  size_t unfinished;
+  int stop;
+  /** Keys of the batch, only used by the job's thread. */
+  Key_Entry keys[KEY_SLOTS];
+  Key_Reader readers[JOB_GRAPH_MAX_KEYS];
+  size_t num_keys, batch;
+  size_t num_helpers;
+  pthread_t helpers[];
+};
+
+/// Copies a command into a new node.
+/// @param command
+/// @param num_pairs Number of keys.
+/// @param keys
+/// @param values Values of a WRITE, NULL otherwise.
+/// @return Pointer to the node on success, NULL otherwise.
+static Graph_Node *new_node(enum Command command, size_t num_pairs, char *keys[], char *values[]){
+  size_t num_strings = values != NULL ? 2 * num_pairs : num_pairs, size = 0;
+  for(size_t i = 0; i < num_pairs; i++){
+    size += strlen(keys[i]) + 1;
+    if(values != NULL) size += strlen(values[i]) + 1;
+  }
+
+  Graph_Node *node = malloc(sizeof(Graph_Node) + num_strings * sizeof(char *) + size);
+  if(node == NULL){
+    fprintf(stderr, "Failed to allocate memory for a command.\n");
+    return NULL;
+  }
+  memset(node, 0, sizeof(Graph_Node));
+  node->command = command;
+  node->num_pairs = num_pairs;
+  node->keys = node->strings;
+  node->values = values != NULL ? node->strings + num_pairs : NULL;
+
+  char *characters = (char *)(node->strings + num_strings);
+  for(size_t i = 0; i < num_strings; i++){
+    const char *string = i < num_pairs ? keys[i] : values[i - num_pairs];
+    size_t length = strlen(string) + 1;
+    memcpy(characters, string, length);
+    node->strings[i] = characters;
+    characters += length;
+  }
+  return node;
+}
+
+/// Frees a node.
+/// @param node
+static void free_node(Graph_Node *node){
+  free(node->output);
+  free(node->successors);
+  free(node);
+}
+
+/// Finds a key of the batch, adding it if it's new.
+/// @param graph
+/// @param key
+/// @return Entry of the key.
+static Key_Entry *find_batch_key(Job_Graph *graph, const char *key){
+  for(size_t slot = hash(key) & (KEY_SLOTS - 1);; slot = (slot + 1) & (KEY_SLOTS - 1)){
+    Key_Entry *entry = &graph->keys[slot];
+    if(entry->batch != graph->batch){
+      entry->key = key;
+      entry->batch = graph->batch;
+      entry->last_writer = NO_NODE;
+      entry->first_reader = NO_NODE;
+      return entry;
+    }
+    if(strcmp(entry->key, key) == 0) return entry;
+  }
+}
+
+/// Makes a command wait for an earlier one, unless it already finished.
+/// Caller must hold the graph's mutex.
+/// @param graph
+/// @param before Index of the earlier command.
+/// @param after Index of the command that waits.
+/// @return 0 if successful, 1 otherwise.
+static int add_edge(Job_Graph *graph, size_t before, size_t after){
+  Graph_Node *node = graph->nodes[before];
+
+  if(before == after || node->done) return 0;
+  if(node->num_successors == node->successors_capacity){
+    size_t capacity = node->successors_capacity > 0 ? 2 * node->successors_capacity : 4;
+    size_t *successors = realloc(node->successors, capacity * sizeof(size_t));
+    if(successors == NULL) return 1;
+    node->successors = successors;
+    node->successors_capacity = capacity;
+  }
+  node->successors[node->num_successors++] = after;
+  graph->nodes[after]->waiting++;
+  return 0;
+}
+
+/// Runs a command, keeping its output on the node.
+/// @param node
+/// @param scratch Output buffer the command writes to, its output always fits.
+static void run_command(Graph_Node *node, Output_Buffer *scratch){
+  scratch->length = 0;
+  if(node->command == CMD_WRITE){
+    if(kvs_write(node->num_pairs, node->keys, node->values))
+      fprintf(stderr, "Failed to write pair\n");
+  } else if(node->command == CMD_READ){
+    if(kvs_read(node->num_pairs, node->keys, scratch))
+      fprintf(stderr, "Failed to read pair\n");
+  } else if(kvs_delete(node->num_pairs, node->keys, scratch)){
+    fprintf(stderr,"Failed to delete pair\n");
+  }
+
+  if(scratch->length == 0) return;
+  if((node->output = malloc(scratch->length)) == NULL){
+    fprintf(stderr, "Failed to keep the output of a command.\n");
+    return;
+  }
+  memcpy(node->output, scratch->data, scratch->length);
+  node->output_length = scratch->length;
+}
+
+/// Runs ready commands until the graph stops (helpers) or every queued
+/// command finished (the job's thread).
+/// @param graph
+/// @param helper Whether it's called by a helper thread.
+static void run_ready(Job_Graph *graph, int helper){
+  /** Commands don't write more than a buffer, so it's never flushed. */
+  Output_Buffer scratch;
+  output_init(&scratch, -1);
+
+  pthread_mutex_lock(&graph->mutex);
+  while(1){
+    while(graph->num_ready == 0 && (helper ? !graph->stop : graph->unfinished > 0))
+      pthread_cond_wait(&graph->has_ready, &graph->mutex);
+    if(graph->num_ready == 0) break;
+    Graph_Node *node = graph->nodes[graph->ready[--graph->num_ready]];
+    pthread_mutex_unlock(&graph->mutex);
+
+    run_command(node, &scratch);
+
+    pthread_mutex_lock(&graph->mutex);
+    node->done = 1;
+    for(size_t i = 0; i < node->num_successors; i++){
+      size_t successor = node->successors[i];
+      if(--graph->nodes[successor]->waiting == 0){
+        graph->ready[graph->num_ready++] = successor;
+        pthread_cond_signal(&graph->has_ready);
+      }
+    }
+    /** The job's thread may be waiting for the batch. */
+    if(--graph->unfinished == 0) pthread_cond_broadcast(&graph->has_ready);
+  }
+  pthread_mutex_unlock(&graph->mutex);
+}
+
+/// Thread function of a helper.
+/// @param arg Graph.
+/// @return NULL
+static void *helper_thread_fn(void *arg){
+  run_ready((Job_Graph *)arg, 1);
+  return NULL;
+}
+
+Job_Graph *job_graph_create(size_t num_threads){
+  Job_Graph *graph;
+  size_t num_helpers = num_threads > 1 ? num_threads - 1 : 0;
+
+  if((graph = calloc(1, sizeof(Job_Graph) + num_helpers * sizeof(pthread_t))) == NULL){
+    fprintf(stderr, "Failed to allocate memory for the command graph.\n");
+    return NULL;
+  }
+  pthread_mutex_init(&graph->mutex, NULL);
+  pthread_cond_init(&graph->has_ready, NULL);
+  graph->batch = 1;
+  for(; graph->num_helpers < num_helpers; graph->num_helpers++){
+    if(pthread_create(&graph->helpers[graph->num_helpers], NULL, helper_thread_fn, graph) != 0){
+      fprintf(stderr, "Failed to create a command thread.\n");
+      job_graph_destroy(graph);
+      return NULL;
+    }
+  }
+  return graph;
+}
+
+/// Queues a node after the commands of the batch it shares keys with. If
+/// it can't be made to wait for one of them, it's taken back out and isn't
+/// queued (its keys are left in the batch's table, job_graph_run must be
+/// called before it's queued again).
+/// @param graph
+/// @param node
+/// @return 0 if successful, 1 otherwise.
+static int queue_node(Job_Graph *graph, Graph_Node *node){
+  size_t index = graph->num_nodes;
+  int error = 0;
+
+  pthread_mutex_lock(&graph->mutex);
+  graph->nodes[graph->num_nodes++] = node;
+  for(size_t i = 0; i < node->num_pairs; i++){
+    Key_Entry *entry = find_batch_key(graph, node->keys[i]);
+    /** Reads of a key don't wait for each other, the rest keep their order. */
+    if(entry->last_writer != NO_NODE) error |= add_edge(graph, entry->last_writer, index);
+    if(node->command == CMD_READ){
+      graph->readers[graph->num_keys] = (Key_Reader){index, entry->first_reader};
+      entry->first_reader = graph->num_keys;
+    } else {
+      for(size_t reader = entry->first_reader; reader != NO_NODE; reader = graph->readers[reader].next)
+        error |= add_edge(graph, graph->readers[reader].node, index);
+      entry->last_writer = index;
+      entry->first_reader = NO_NODE;
+    }
+    graph->num_keys++;
+  }
+  if(error){
+    /** Edges to it are the last of their lists, only this thread adds them. */
+    for(size_t i = 0; i < index; i++){
+      Graph_Node *before = graph->nodes[i];
+      while(before->num_successors > 0 && before->successors[before->num_successors - 1] == index)
+        before->num_successors--;
+    }
+    node->waiting = 0;
+    graph->num_nodes--;
+  } else {
+    graph->unfinished++;
+    if(node->waiting == 0){
+      graph->ready[graph->num_ready++] = index;
+      pthread_cond_signal(&graph->has_ready);
+    }
+  }
+  pthread_mutex_unlock(&graph->mutex);
+  return error;
+}
+
+int job_graph_add(Job_Graph *graph, enum Command command, size_t num_pairs, char *keys[], char *values[],
+                  Output_Buffer *out){
+  int error = 0;
+
+  if((graph->num_nodes == JOB_GRAPH_BATCH_SIZE || graph->num_keys + num_pairs > JOB_GRAPH_MAX_KEYS) &&
+     job_graph_run(graph, out) != 0)
+    error = 1;
+  Graph_Node *node = new_node(command, num_pairs, keys, command == CMD_WRITE ? values : NULL);
+  if(node == NULL) return 1;
+
+  if(queue_node(graph, node) != 0){
+    /** Never run it out of order: let the batch finish, then it waits for nothing. */
+    fprintf(stderr, "Failed to order a command, running the ones before it first.\n");
+    if(job_graph_run(graph, out) != 0) error = 1;
+    queue_node(graph, node);
+  }
+  return error;
+}
+
+int job_graph_run(Job_Graph *graph, Output_Buffer *out){
+  int error = 0;
+
+  if(graph->num_nodes == 0) return 0;
+  run_ready(graph, 0);
+  for(size_t i = 0; i < graph->num_nodes; i++){
+    Graph_Node *node = graph->nodes[i];
+    if(node->output_length > 0 && output_append(out, node->output, node->output_length) != 0) error = 1;
+    free_node(node);
+  }
+  graph->num_nodes = 0;
+  graph->num_keys = 0;
+  /** Every key entry is stale now. */
+  graph->batch++;
+  return error;
+}
+
+void job_graph_destroy(Job_Graph *graph){
+  pthread_mutex_lock(&graph->mutex);
+  graph->stop = 1;
+  pthread_cond_broadcast(&graph->has_ready);
+  pthread_mutex_unlock(&graph->mutex);
+
+  for(size_t i = 0; i < graph->num_helpers; i++){
+    if(pthread_join(graph->helpers[i], NULL) != 0)
+      fprintf(stderr, "Failed to join command thread.\n");
+  }
+  for(size_t i = 0; i < graph->num_nodes; i++) free_node(graph->nodes[i]);
+  pthread_cond_destroy(&graph->has_ready);
+  pthread_mutex_destroy(&graph->mutex);
+  free(graph);
+}
@@ -0,0 +1,51 @@
+#ifndef KVS_JOB_GRAPH_H
+#define KVS_JOB_GRAPH_H
+
+#include <stddef.h>
+
+#include "io.h"
+#include "parser.h"
+
+/** Most commands queued on a graph before they're run. */
+#define JOB_GRAPH_BATCH_SIZE 1024
+/** Most keys of the commands queued on a graph. */
+#define JOB_GRAPH_MAX_KEYS 8192
+
+/// WRITE, READ and DELETE commands of a job, run by several threads. A
+/// command waits for the earlier commands of the batch sharing a key with
+/// it, unless both only read it, and the others run in any order as soon as
+/// a thread is free. Threads start on commands while later ones are still
+/// being queued. Outputs are kept per command and written in the job's
+/// order once the batch is done.
+typedef struct Job_Graph Job_Graph;
+
+/// Starts the threads of a graph.
+/// @param num_threads Number of threads running commands, counting the
+/// job's own thread (which helps while it waits for a batch).
+/// @return Pointer to the graph on success, NULL otherwise.
+Job_Graph *job_graph_create(size_t num_threads);
+
+/// Queues a command, running the batch first if it's full. Keys and values
+/// are copied, so they may change once it returns.
+/// @param graph
+/// @param command CMD_WRITE, CMD_READ or CMD_DELETE.
+/// @param num_pairs Number of keys.
+/// @param keys Keys of the command.
+/// @param values Values of a WRITE, NULL otherwise.
+/// @param out Output of the job.
+/// @return 0 if successful, 1 otherwise.
+int job_graph_add(Job_Graph *graph, enum Command command, size_t num_pairs, char *keys[], char *values[],
+                  Output_Buffer *out);
+
+/// Waits for every queued command and appends their outputs in order.
+/// @param graph
+/// @param out Output of the job.
+/// @return 0 if successful, 1 otherwise.
+int job_graph_run(Job_Graph *graph, Output_Buffer *out);
+
+/// Stops the threads of a graph and frees it. Queued commands must have been
+/// run.
+/// @param graph
+void job_graph_destroy(Job_Graph *graph);
+
+#endif // KVS_JOB_GRAPH_H
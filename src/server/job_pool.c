@@ -0,0 +1,235 @@
+#include "job_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "server-client.h"
+
+typedef struct Job{
+  void *(*run)(void *);
+  void *arg;
+  /** When it was queued, in microseconds. */
+  uint64_t queued_at;
+}Job;
+
+/// Worker thread and its deque, which holds jobs head to head + count - 1,
+/// on slot number % capacity. The owner and thieves both take from the
+/// head, so a job never waits behind one queued after it while the owner is
+/// busy. stats is only touched by the worker's own thread.
+typedef struct Worker{
+  pthread_mutex_t mutex;
+  Job *jobs;
+  size_t head, count, capacity;
+  size_t index;
+  pthread_t thread;
+  struct Job_Pool *pool;
+  Job_Pool_Stats stats;
+}Worker;
+
+struct Job_Pool{
+  pthread_mutex_t mutex;
+  pthread_cond_t has_jobs;
+  /** Jobs on any deque that no worker took yet. */
+  size_t pending;
+  /** Deque the next job is queued on. */
+  size_t next;
+  int stop;
+  size_t num_workers;
+  Worker workers[];
+};
+
+/// Current time, for the time jobs wait.
+/// @return Microseconds since some fixed point.
+static uint64_t now_us(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/// Adds a job to the end of a worker's deque, growing it if it's full.
+/// @param worker
+/// @param job
+/// @return 0 if successful, 1 otherwise.
+static int push_job(Worker *worker, const Job *job){
+  pthread_mutex_lock(&worker->mutex);
+  if(worker->count == worker->capacity){
+    Job *jobs = malloc(2 * worker->capacity * sizeof(Job));
+    if(jobs == NULL){
+      pthread_mutex_unlock(&worker->mutex);
+      return 1;
+    }
+    for(size_t i = 0; i < worker->count; i++)
+      jobs[i] = worker->jobs[(worker->head + i) % worker->capacity];
+    free(worker->jobs);
+    worker->jobs = jobs;
+    worker->head = 0;
+    worker->capacity *= 2;
+  }
+  worker->jobs[(worker->head + worker->count) % worker->capacity] = *job;
+  worker->count++;
+  pthread_mutex_unlock(&worker->mutex);
+  return 0;
+}
+
+/// Takes the oldest job of a worker's deque.
+/// @param worker
+/// @param job Set to the job taken.
+/// @return 1 if a job was taken, 0 if the deque is empty.
+static int take_job(Worker *worker, Job *job){
+  pthread_mutex_lock(&worker->mutex);
+  if(worker->count == 0){
+    pthread_mutex_unlock(&worker->mutex);
+    return 0;
+  }
+  *job = worker->jobs[worker->head];
+  worker->head = (worker->head + 1) % worker->capacity;
+  worker->count--;
+  pthread_mutex_unlock(&worker->mutex);
+  return 1;
+}
+
+/// Thread function of a worker: runs jobs from its deque, steals when it's
+/// empty and sleeps when every deque is.
+/// @param arg Worker.
+/// @return NULL
+static void *worker_thread_fn(void *arg){
+  Worker *worker = (Worker *)arg;
+  Job_Pool *pool = worker->pool;
+  block_SIGUSR1();
+
+  while(1){
+    Job job;
+    int found = take_job(worker, &job), stolen = 0;
+    /** Look at the other deques starting from the next worker, so thieves spread out. */
+    for(size_t i = 1; !found && i < pool->num_workers; i++){
+      found = stolen = take_job(&pool->workers[(worker->index + i) % pool->num_workers], &job);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if(found){
+      pool->pending--;
+      pthread_mutex_unlock(&pool->mutex);
+
+      uint64_t wait = now_us() - job.queued_at;
+      worker->stats.jobs++;
+      worker->stats.stolen += (size_t)stolen;
+      worker->stats.total_wait_us += wait;
+      if(wait > worker->stats.max_wait_us) worker->stats.max_wait_us = wait;
+      job.run(job.arg);
+      continue;
+    }
+    /** A job counted as pending is on a deque or about to leave one, look again. */
+    while(pool->pending == 0 && !pool->stop)
+      pthread_cond_wait(&pool->has_jobs, &pool->mutex);
+    if(pool->pending == 0){
+      pthread_mutex_unlock(&pool->mutex);
+      return NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+/// Stops the workers once nothing is pending and joins them.
+/// @param pool
+/// @param num_started Number of workers whose thread was started.
+/// @return 0 if successful, 1 if a worker couldn't be joined.
+static int stop_workers(Job_Pool *pool, size_t num_started){
+  int error = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->has_jobs);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for(size_t i = 0; i < num_started; i++){
+    if(pthread_join(pool->workers[i].thread, NULL) != 0){
+      fprintf(stderr, "Failed to join worker thread.\n");
+      error = 1;
+    }
+  }
+  return error;
+}
+
+/// Frees a pool whose workers are stopped.
+/// @param pool
+static void free_pool(Job_Pool *pool){
+  for(size_t i = 0; i < pool->num_workers; i++){
+    pthread_mutex_destroy(&pool->workers[i].mutex);
+    free(pool->workers[i].jobs);
+  }
+  pthread_cond_destroy(&pool->has_jobs);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+Job_Pool *job_pool_create(size_t num_workers){
+  Job_Pool *pool;
+
+  if(num_workers == 0) return NULL;
+  if((pool = calloc(1, sizeof(Job_Pool) + num_workers * sizeof(Worker))) == NULL){
+    fprintf(stderr, "Failed to allocate memory for the job pool.\n");
+    return NULL;
+  }
+  pool->num_workers = num_workers;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->has_jobs, NULL);
+  for(size_t i = 0; i < num_workers; i++){
+    Worker *worker = &pool->workers[i];
+    pthread_mutex_init(&worker->mutex, NULL);
+    worker->index = i;
+    worker->pool = pool;
+    worker->capacity = JOB_POOL_DEQUE_SIZE;
+    if((worker->jobs = malloc(JOB_POOL_DEQUE_SIZE * sizeof(Job))) == NULL){
+      fprintf(stderr, "Failed to allocate memory for the job pool.\n");
+      free_pool(pool);
+      return NULL;
+    }
+  }
+  for(size_t i = 0; i < num_workers; i++){
+    if(pthread_create(&pool->workers[i].thread, NULL, worker_thread_fn, &pool->workers[i]) != 0){
+      fprintf(stderr, "Failed to create a worker thread.\n");
+      stop_workers(pool, i);
+      free_pool(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+int job_pool_submit(Job_Pool *pool, void *(*job)(void *), void *arg){
+  Job new_job = {job, arg, now_us()};
+
+  /** Only the submitting thread moves next. */
+  Worker *worker = &pool->workers[pool->next];
+  pool->next = (pool->next + 1) % pool->num_workers;
+  if(push_job(worker, &new_job) != 0){
+    fprintf(stderr, "Failed to queue a job.\n");
+    return 1;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->pending++;
+  pthread_cond_signal(&pool->has_jobs);
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+int job_pool_destroy(Job_Pool *pool, Job_Pool_Stats *stats){
+  /** Workers only leave once nothing is pending, so every job runs first. */
+  int error = stop_workers(pool, pool->num_workers);
+
+  if(stats != NULL){
+    memset(stats, 0, sizeof(*stats));
+    for(size_t i = 0; i < pool->num_workers; i++){
+      Job_Pool_Stats *worker = &pool->workers[i].stats;
+      stats->jobs += worker->jobs;
+      stats->stolen += worker->stolen;
+      stats->total_wait_us += worker->total_wait_us;
+      if(worker->max_wait_us > stats->max_wait_us) stats->max_wait_us = worker->max_wait_us;
+    }
+  }
+  free_pool(pool);
+  return error;
+}
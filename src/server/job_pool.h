@@ -0,0 +1,44 @@
+#ifndef KVS_JOB_POOL_H
+#define KVS_JOB_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Jobs each worker's deque has room for before it grows. */
+#define JOB_POOL_DEQUE_SIZE 16
+
+/// Fixed set of worker threads running queued jobs. Every worker has its
+/// own deque: jobs are handed to the deques in turn, a worker runs the
+/// oldest job of its own deque, and once it's empty steals the oldest job
+/// of another worker's deque, so no job waits behind a long one while a
+/// worker is idle.
+typedef struct Job_Pool Job_Pool;
+
+/// What the pool did, gathered when it's destroyed.
+typedef struct Job_Pool_Stats{
+  size_t jobs;
+  /** Jobs run by a worker other than the one they were queued on. */
+  size_t stolen;
+  /** Time jobs spent queued, in microseconds. */
+  uint64_t total_wait_us, max_wait_us;
+}Job_Pool_Stats;
+
+/// Starts the workers.
+/// @param num_workers Number of worker threads, at least 1.
+/// @return Pointer to the pool on success, NULL otherwise.
+Job_Pool *job_pool_create(size_t num_workers);
+
+/// Queues a job.
+/// @param pool
+/// @param job Function the job runs, its return value is ignored.
+/// @param arg Argument of the function.
+/// @return 0 if successful, 1 otherwise.
+int job_pool_submit(Job_Pool *pool, void *(*job)(void *), void *arg);
+
+/// Waits for every queued job to run, stops the workers and frees the pool.
+/// @param pool
+/// @param stats Filled with what the pool did, can be NULL.
+/// @return 0 if successful, 1 if a worker couldn't be joined.
+int job_pool_destroy(Job_Pool *pool, Job_Pool_Stats *stats);
+
+#endif // KVS_JOB_POOL_H
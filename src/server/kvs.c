@@ -3,36 +3,406 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "constants.h"
-#include "src/common/io.h"
+#include "notifier.h"
+#include "epoch.h"
 
 
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+size_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    return (size_t)h;
 }
 
+size_t stripe_index(HashTable *ht, const char *key) {
+    return hash(key) & (ht->num_stripes - 1);
+}
+
+pthread_rwlock_t *stripe_lock(HashTable *ht, size_t index) {
+    return &ht->stripes[index].lock;
+}
+
+void stripe_write_lock(HashTable *ht, size_t index) {
+    pthread_rwlock_wrlock(&ht->stripes[index].lock);
+    atomic_fetch_add(&ht->stripes[index].version, 1);
+}
 
-struct HashTable* create_hash_table() {
+void stripe_write_unlock(HashTable *ht, size_t index) {
+    atomic_fetch_add(&ht->stripes[index].version, 1);
+    pthread_rwlock_unlock(&ht->stripes[index].lock);
+}
+
+size_t stripe_version(HashTable *ht, size_t index) {
+    return atomic_load_explicit(&ht->stripes[index].version, memory_order_acquire);
+}
+
+struct HashTable* create_hash_table(size_t num_stripes) {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
-      pthread_rwlock_init(&ht->lockTable[i], NULL); // initiate rwlocks.
+
+  /** Round the number of stripes up to a power of two. */
+  if (num_stripes == 0) num_stripes = DEFAULT_NUM_STRIPES;
+  if (num_stripes > MAX_NUM_STRIPES) num_stripes = MAX_NUM_STRIPES;
+  ht->num_stripes = 1;
+  while (ht->num_stripes < num_stripes) ht->num_stripes *= 2;
+
+  size_t size = INITIAL_TABLE_SIZE;
+  while (size < ht->num_stripes) size *= 2;
+  atomic_init(&ht->size, size);
+  ht->num_arenas = ht->num_stripes < MAX_NUM_ARENAS ? ht->num_stripes : MAX_NUM_ARENAS;
+  atomic_init(&ht->table, calloc(size, sizeof(Bucket)));
+  ht->stripes = aligned_alloc(_Alignof(Stripe), ht->num_stripes * sizeof(Stripe));
+  ht->arenas = malloc(ht->num_arenas * sizeof(Arena));
+  if (!ht->table || !ht->stripes || !ht->arenas) {
+      free(ht->table);
+      free(ht->stripes);
+      free(ht->arenas);
+      free(ht);
+      return NULL;
+  }
+  for (size_t i = 0; i < ht->num_arenas; i++) {
+      if (arena_init(&ht->arenas[i], sizeof(KeyNode)) != 0) {
+          while (i-- > 0) arena_destroy(&ht->arenas[i]);
+          free(ht->table);
+          free(ht->stripes);
+          free(ht->arenas);
+          free(ht);
+          return NULL;
+      }
+  }
+  ht->old_table = NULL;
+  ht->old_size = 0;
+  atomic_init(&ht->rehash_index, 0);
+  atomic_init(&ht->resize_version, 0);
+  atomic_init(&ht->num_keys, 0);
+  pthread_mutex_init(&ht->rehashMutex, NULL);
+  atomic_init(&ht->clock, 0);
+  pthread_mutex_init(&ht->snapshotMutex, NULL);
+  ht->snapshots = NULL;
+  atomic_init(&ht->oldest_snapshot, SIZE_MAX);
+  atomic_init(&ht->newest_snapshot, 0);
+  ht->bases = NULL;
+  atomic_init(&ht->oldest_base, SIZE_MAX);
+  atomic_init(&ht->num_tombstones, 0);
+  for (size_t i = 0; i < ht->num_stripes; i++) {
+      /** Stripe i only holds keys whose arena is arenas[i % num_arenas]. */
+      if (skiplist_init(&ht->stripes[i].index, &ht->arenas[i & (ht->num_arenas - 1)]) != 0) {
+          while (i-- > 0) {
+              skiplist_destroy(&ht->stripes[i].index);
+              pthread_rwlock_destroy(&ht->stripes[i].lock);
+          }
+          for (size_t j = 0; j < ht->num_arenas; j++) arena_destroy(&ht->arenas[j]);
+          free(ht->table);
+          free(ht->stripes);
+          free(ht->arenas);
+          free(ht);
+          return NULL;
+      }
+      pthread_rwlock_init(&ht->stripes[i].lock, NULL); // initiate rwlocks.
+      atomic_init(&ht->stripes[i].version, 0);
+      ht->stripes[i].graveyard = NULL;
   }
   return ht;
 }
 
+/// Returns the arena a hash allocates from.
+/// @param ht Hash table.
+/// @param h Hash of the key.
+/// @return Arena of the key.
+static Arena *get_arena(HashTable *ht, size_t h) {
+    return &ht->arenas[h & (ht->num_arenas - 1)];
+}
+
+/// Returns the bucket a hash belongs to. Caller must hold the hash's stripe, so
+/// the bucket can't be moved while it's being used.
+/// @param ht Hash table.
+/// @param h Hash of the key.
+/// @return Pointer to the head of the bucket.
+static Bucket *get_bucket(HashTable *ht, size_t h) {
+    if (ht->old_table != NULL) {
+        size_t old_index = h & (ht->old_size - 1);
+        /** Bucket wasn't moved to the new array yet. */
+        if (old_index >= atomic_load_explicit(&ht->rehash_index, memory_order_acquire))
+            return &ht->old_table[old_index];
+    }
+    return &ht->table[h & (ht->size - 1)];
+}
+
+KeyNode *find_key(HashTable *ht, const char *key) {
+    size_t h = hash(key);
+    KeyNode *keyNode = *get_bucket(ht, h);
+
+    while (keyNode != NULL) {
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0)
+            return keyNode;
+        keyNode = keyNode->next;
+    }
+    return NULL;
+}
+
+void foreach_key(HashTable *ht, void (*visit)(KeyNode *node, void *arg), void *arg) {
+    /** Buckets still on the old array. */
+    if (ht->old_table != NULL) {
+        for (size_t i = atomic_load(&ht->rehash_index); i < ht->old_size; i++) {
+            for (KeyNode *keyNode = ht->old_table[i]; keyNode != NULL; keyNode = keyNode->next)
+                visit(keyNode, arg);
+        }
+    }
+    for (size_t i = 0; i < ht->size; i++) {
+        for (KeyNode *keyNode = ht->table[i]; keyNode != NULL; keyNode = keyNode->next)
+            visit(keyNode, arg);
+    }
+}
+
+/// Moves the cursor at the root of a min-heap of skiplist cursors down to
+/// its place, ordering cursors by key.
+/// @param heap Cursors, each one on the next entry of its stripe's index.
+/// @param count Number of cursors.
+static void sift_down(Skip_Node **heap, size_t count) {
+    size_t i = 0;
+
+    while (1) {
+        size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < count && strcmp(heap[left]->key, heap[smallest]->key) < 0) smallest = left;
+        if (right < count && strcmp(heap[right]->key, heap[smallest]->key) < 0) smallest = right;
+        if (smallest == i) return;
+        Skip_Node *node = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = node;
+        i = smallest;
+    }
+}
+
+/// Moves the last cursor of a min-heap of skiplist cursors up to its place.
+/// @param heap Cursors, each one on the next entry of its stripe's index.
+/// @param count Number of cursors.
+static void sift_up(Skip_Node **heap, size_t count) {
+    for (size_t i = count - 1; i > 0 && strcmp(heap[i]->key, heap[(i - 1) / 2]->key) < 0; i = (i - 1) / 2) {
+        Skip_Node *node = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = node;
+    }
+}
+
+int foreach_key_from(HashTable *ht, const char *start, int (*visit)(KeyNode *node, void *arg), void *arg) {
+    Skip_Node **heap = malloc(ht->num_stripes * sizeof(Skip_Node *));
+    size_t count = 0;
+
+    if (heap == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a scan.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        Skip_Node *node = skiplist_seek(&ht->stripes[i].index, start);
+        if (node != NULL) {
+            heap[count++] = node;
+            sift_up(heap, count);
+        }
+    }
+    /** Smallest key of every stripe on top, each stripe's next key replaces it. */
+    while (count > 0) {
+        Skip_Node *node = heap[0];
+        if (visit((KeyNode *)node->value, arg) != 0) break;
+        if (node->next[0] != NULL) heap[0] = node->next[0];
+        else heap[0] = heap[--count];
+        sift_down(heap, count);
+    }
+    free(heap);
+    return 0;
+}
+
+/// Locks every stripe of the table for writing, to start or finish a
+/// resize. Makes resize_version odd at the start and even at the end.
+/// @param ht Hash table.
+static void wrlock_all(HashTable *ht) {
+    for (size_t i = 0; i < ht->num_stripes; i++)
+        pthread_rwlock_wrlock(&ht->stripes[i].lock);
+    if (ht->old_table == NULL) atomic_fetch_add(&ht->resize_version, 1);
+}
+
+/// Unlocks every stripe of the table.
+/// @param ht Hash table.
+static void unlock_all(HashTable *ht) {
+    if (ht->old_table == NULL) atomic_fetch_add(&ht->resize_version, 1);
+    for (size_t i = 0; i < ht->num_stripes; i++)
+        pthread_rwlock_unlock(&ht->stripes[i].lock);
+}
+
+/// Gives a bucket array back to malloc.
+/// @param object Bucket array.
+/// @param arg Unused.
+static void reclaim_buckets(void *object, void *arg) {
+    (void)arg;
+    free(object);
+}
+
+/// Gives a value back to its arena.
+/// @param object Value.
+/// @param arg Arena of the value.
+static void reclaim_value(void *object, void *arg) {
+    arena_free_string((Arena *)arg, object, strlen(object) + 1);
+}
+
+/// Frees older values of a node no reader can be on anymore.
+/// @param old Newest of the values.
+/// @param arena Arena of the node.
+static void free_history(Old_Value *old, Arena *arena) {
+    while (old != NULL) {
+        Old_Value *next = old->next;
+        arena_free_string(arena, old->value, strlen(old->value) + 1);
+        free(old);
+        old = next;
+    }
+}
+
+/// Gives a node, its key and its values back to their arena.
+/// @param object Node.
+/// @param arg Arena of the node.
+static void reclaim_node(void *object, void *arg) {
+    KeyNode *keyNode = (KeyNode *)object;
+    char *value = atomic_load_explicit(&keyNode->value, memory_order_relaxed);
+
+    free_history(keyNode->history, (Arena *)arg);
+    arena_free_string((Arena *)arg, keyNode->key, strlen(keyNode->key) + 1);
+    arena_free_string((Arena *)arg, value, strlen(value) + 1);
+    arena_free_object((Arena *)arg, keyNode);
+}
+
+/// Moves the next bucket of the old array to the new one.
+/// Caller must hold rehashMutex.
+/// @param ht Hash table being resized.
+static void move_bucket(HashTable *ht) {
+    size_t index = atomic_load(&ht->rehash_index);
+    pthread_rwlock_t *lock = &ht->stripes[index & (ht->num_stripes - 1)].lock;
+
+    pthread_rwlock_wrlock(lock);
+    KeyNode *keyNode = ht->old_table[index];
+    while (keyNode != NULL) {
+        KeyNode *next = keyNode->next;
+        Bucket *bucket = &ht->table[keyNode->hash & (ht->size - 1)];
+        keyNode->next = *bucket;
+        *bucket = keyNode;
+        keyNode = next;
+    }
+    ht->old_table[index] = NULL;
+    atomic_store_explicit(&ht->rehash_index, index + 1, memory_order_release);
+    pthread_rwlock_unlock(lock);
+}
+
+void rehash_step(HashTable *ht) {
+    /** Someone else is already resizing. */
+    if (pthread_mutex_trylock(&ht->rehashMutex) != 0) return;
+
+    if (ht->old_table == NULL) {
+        /** Start a resize if the table is too full. */
+        if (atomic_load(&ht->num_keys) > ht->size * MAX_LOAD_FACTOR) {
+            Bucket *new_table = calloc(ht->size * 2, sizeof(Bucket));
+            if (new_table != NULL) {
+                wrlock_all(ht);
+                ht->old_table = ht->table;
+                ht->old_size = ht->size;
+                ht->table = new_table;
+                atomic_store(&ht->size, ht->old_size * 2);
+                atomic_store(&ht->rehash_index, 0);
+                unlock_all(ht);
+            }
+        }
+    }
+    else {
+        for (int i = 0; i < REHASH_STEP && atomic_load(&ht->rehash_index) < ht->old_size; i++)
+            move_bucket(ht);
+
+        /** Every bucket was moved, drop the old array. */
+        if (atomic_load(&ht->rehash_index) == ht->old_size) {
+            wrlock_all(ht);
+            /** Readers without locks might still be going through it. */
+            epoch_retire(ht->old_table, reclaim_buckets, NULL);
+            ht->old_table = NULL;
+            ht->old_size = 0;
+            unlock_all(ht);
+        }
+    }
+    pthread_mutex_unlock(&ht->rehashMutex);
+}
+
+/// Tells if a snapshot being taken might need what a node holds now.
+/// Caller must hold the node's stripe for writing.
+/// @param ht Hash table.
+/// @param keyNode Node about to be changed.
+/// @return 1 if it must be kept, 0 otherwise.
+static int snapshot_needs(HashTable *ht, KeyNode *keyNode) {
+    return atomic_load(&ht->oldest_snapshot) != SIZE_MAX &&
+           keyNode->version <= atomic_load(&ht->newest_snapshot);
+}
+
+/// Retires the older values of a node no snapshot being taken needs. A
+/// value is only needed by snapshots between its version and the version of
+/// the value that replaced it. Caller must hold the node's stripe for writing.
+/// @param ht Hash table.
+/// @param keyNode Node.
+/// @param arena Arena of the node.
+static void prune_history(HashTable *ht, KeyNode *keyNode, Arena *arena) {
+    size_t oldest = atomic_load(&ht->oldest_snapshot);
+    size_t newer = keyNode->version;
+    Old_Value **link = &keyNode->history;
+
+    while (*link != NULL && newer > oldest) {
+        newer = (*link)->version;
+        link = &(*link)->next;
+    }
+    Old_Value *old = *link;
+    *link = NULL;
+    while (old != NULL) {
+        Old_Value *next = old->next;
+        /** Readers without locks may have found it before it was replaced. */
+        epoch_retire(old->value, reclaim_value, arena);
+        free(old);
+        old = next;
+    }
+}
+
+/// Keeps a node that was just unlinked on its stripe's graveyard if a
+/// snapshot being taken or a base might still need it. Caller must hold the
+/// node's stripe for writing.
+/// @param ht Hash table.
+/// @param keyNode Deleted node.
+/// @return 1 if it was kept, 0 otherwise.
+static int bury_node(HashTable *ht, KeyNode *keyNode) {
+    if (atomic_load(&ht->oldest_snapshot) == SIZE_MAX && atomic_load(&ht->oldest_base) == SIZE_MAX)
+        return 0;
+
+    Tombstone *tombstone = malloc(sizeof(Tombstone));
+    if (tombstone == NULL) {
+        fprintf(stderr, "Failed to keep deleted key %s for a backup\n", keyNode->key);
+        return 0;
+    }
+    Stripe *stripe = &ht->stripes[keyNode->hash & (ht->num_stripes - 1)];
+    tombstone->node = keyNode;
+    tombstone->version = atomic_load(&ht->clock);
+    tombstone->next = stripe->graveyard;
+    stripe->graveyard = tombstone;
+    atomic_fetch_add(&ht->num_tombstones, 1);
+    return 1;
+}
+
+/// Hands a notification to the notifier for every subscriber of the key.
+/// Subscribers are written to by the notifier's threads, never here.
+/// @param node Node of the key.
+/// @param frame Notification.
+static void publish_notification(KeyNode *node, const char *frame){
+    Subscriber_Set *set = &node->subscribers;
+    if (notifier_publish(frame, node->hash, set->targets, set->count) != 0)
+        fprintf(stderr, "Failed to notify subscribers of key %s\n", node->key);
+}
+
 void notify_key_change(KeyNode *node){
-    Node *aux = node->client_list->head;
+    if (node->subscribers.count == 0) return;
     size_t key_len = strlen(node->key), value_len = strlen(node->value);
     /** 3 for "(,)" and 2 for the two '\0'. */
     char buffer[MAX_STRING_SIZE*2 + 3 + 2];
@@ -48,15 +418,12 @@ void notify_key_change(KeyNode *node){
     }
     buffer[MAX_STRING_SIZE*2 + 4] = ')';
 
-    while(aux != NULL){
-        write_all(aux->notif_fd, buffer, MAX_STRING_SIZE*2 + 5);
-        aux = aux->next;
-    }
+    publish_notification(node, buffer);
 }
 
 
 void notify_key_deletion(KeyNode *node){
-    Node *aux = node->client_list->head;
+    if (node->subscribers.count == 0) return;
     size_t key_len = strlen(node->key);
     /** 3 for "(,)" and 2 for the two '\0'. */
     char buffer[MAX_STRING_SIZE*2 + 3 + 2];
@@ -72,20 +439,36 @@ void notify_key_deletion(KeyNode *node){
     }
     buffer[MAX_STRING_SIZE*2 + 4] = ')';
 
-    while(aux != NULL){
-        write_all(aux->notif_fd, buffer, MAX_STRING_SIZE*2 + 5);
-        aux = aux->next;
-    }
+    publish_notification(node, buffer);
 }
 
 int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
+    size_t h = hash(key);
+    Bucket *bucket = get_bucket(ht, h);
+    KeyNode *keyNode = *bucket;
+    Arena *arena = get_arena(ht, h);
+    size_t capacity;
     // Search for the key node
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {    
-            free(keyNode->value);
-            keyNode->value = strdup(value);
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {    
+            /** Readers without locks may be copying the old value, replace it. */
+            char *new_value = arena_strdup(arena, value, &capacity);
+            if (new_value == NULL) return 1;
+            Old_Value *old = NULL;
+            if (snapshot_needs(ht, keyNode) && (old = malloc(sizeof(Old_Value))) == NULL) {
+                arena_free_string(arena, new_value, capacity);
+                return 1;
+            }
+            char *old_value = atomic_exchange_explicit(&keyNode->value, new_value, memory_order_acq_rel);
+            if (old != NULL) {
+                old->value = old_value;
+                old->version = keyNode->version;
+                old->next = keyNode->history;
+                keyNode->history = old;
+            }
+            else epoch_retire(old_value, reclaim_value, arena);
+            keyNode->version = atomic_load(&ht->clock);
+            if (keyNode->history != NULL) prune_history(ht, keyNode, arena);
             /** A change on the key occured. */
             notify_key_change(keyNode);
             return 0;
@@ -94,56 +477,105 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
     }
 
     // Key not found, create a new key node
-    keyNode = (KeyNode*)malloc(sizeof(KeyNode));
-    keyNode->client_list = (List*)malloc(sizeof(List));
-    keyNode->client_list->head = NULL;
-    pthread_rwlock_init(&keyNode->client_list->lockList, NULL); // Lock for each notif_fd list
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+    char *new_key, *new_value;
+    size_t key_capacity;
+    if ((keyNode = arena_alloc_object(arena)) == NULL) return 1;
+    new_key = arena_strdup(arena, key, &key_capacity); // Allocate memory for the key
+    new_value = arena_strdup(arena, value, &capacity); // Allocate memory for the value
+    if (new_key == NULL || new_value == NULL || initSubscribers(&keyNode->subscribers) != 0) {
+        if (new_key) arena_free_string(arena, new_key, key_capacity);
+        if (new_value) arena_free_string(arena, new_value, capacity);
+        arena_free_object(arena, keyNode);
+        return 1;
+    }
+    /** Ordered index, for scans. */
+    if (skiplist_insert(&ht->stripes[h & (ht->num_stripes - 1)].index, new_key, h, keyNode) != 0) {
+        freeSubscribers(&keyNode->subscribers);
+        arena_free_string(arena, new_key, key_capacity);
+        arena_free_string(arena, new_value, capacity);
+        arena_free_object(arena, keyNode);
+        return 1;
+    }
+    keyNode->key = new_key;
+    atomic_init(&keyNode->value, new_value);
+    keyNode->hash = h;
+    keyNode->version = atomic_load(&ht->clock);
+    keyNode->history = NULL;
+    atomic_init(&keyNode->next, *bucket); // Link to existing nodes
+    /** Readers without locks only find the node once it's complete. */
+    atomic_store_explicit(bucket, keyNode, memory_order_release);
+    atomic_fetch_add(&ht->num_keys, 1);
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
+int read_pair_into(HashTable *ht, const char *key, char *buffer, size_t size) {
+    KeyNode *keyNode = find_key(ht, key);
+
+    if (keyNode == NULL) return -1; // Key not found
+    char *value = keyNode->value;
+    size_t length = strnlen(value, size);
+    memcpy(buffer, value, length);
+    return (int)length;
+}
+
+int read_pair_lockless(HashTable *ht, const char *key, char *buffer, size_t size) {
+    size_t h = hash(key);
+    size_t version = atomic_load_explicit(&ht->resize_version, memory_order_acquire);
+
+    /** Buckets move between arrays while resizing. */
+    if (version & 1) return -2;
+    Bucket *table = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    size_t size_mask = atomic_load_explicit(&ht->size, memory_order_relaxed) - 1;
+    atomic_thread_fence(memory_order_acquire);
+    /** table and size might belong to different arrays. */
+    if (atomic_load_explicit(&ht->resize_version, memory_order_relaxed) != version) return -2;
 
+    int length = -1;
+    KeyNode *keyNode = atomic_load_explicit(&table[h & size_mask], memory_order_acquire);
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return copy of the value if found
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            char *value = atomic_load_explicit(&keyNode->value, memory_order_acquire);
+            length = (int)strnlen(value, size);
+            memcpy(buffer, value, (size_t)length);
+            break;
         }
-        keyNode = keyNode->next; // Move to the next node
+        keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire);
     }
-    return NULL; // Key not found
+
+    /** A resize started meanwhile and the key might have been moved away. */
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&ht->resize_version, memory_order_relaxed) != version) return -2;
+    return length;
 }
 
 int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
+    size_t h = hash(key);
+    Bucket *bucket = get_bucket(ht, h);
+    KeyNode *keyNode = *bucket;
     KeyNode *prevNode = NULL;
 
     // Search for the key node
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
             // Key found; delete this node
+            KeyNode *next = keyNode->next;
             if (prevNode == NULL) {
                 // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
+                atomic_store_explicit(bucket, next, memory_order_release);
             } else {
                 // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+                atomic_store_explicit(&prevNode->next, next, memory_order_release);
             }
+            skiplist_remove(&ht->stripes[h & (ht->num_stripes - 1)].index, keyNode->key);
             // Notify clients of deletion.
             notify_key_deletion(keyNode);
             // Free client list.
-            freeList(keyNode->client_list); 
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
+            freeSubscribers(&keyNode->subscribers); 
+            // Readers without locks may still be on the node, it goes back
+            // to the arena once they're done, or once no snapshot needs it.
+            if (!bury_node(ht, keyNode))
+                epoch_retire(keyNode, reclaim_node, get_arena(ht, h));
+            atomic_fetch_sub(&ht->num_keys, 1);
             return 0; // Exit the function
         }
         prevNode = keyNode; // Move prevNode to current node
@@ -153,74 +585,258 @@ int delete_pair(HashTable *ht, const char *key) {
     return 1;
 }
 
-void freeList(List* list){
-    freeClientNodes(list);
-    pthread_rwlock_destroy(&list->lockList);
-    free(list);
+void snapshot_begin(HashTable *ht, Snapshot *snapshot, Snapshot *base, void (*at_begin)(void *arg), void *arg) {
+    /** No write is halfway through while the clock moves. */
+    for (size_t i = 0; i < ht->num_stripes; i++)
+        pthread_rwlock_rdlock(&ht->stripes[i].lock);
+    pthread_mutex_lock(&ht->snapshotMutex);
+    snapshot->version = atomic_fetch_add(&ht->clock, 1);
+    snapshot->next = ht->snapshots;
+    ht->snapshots = snapshot;
+    if (snapshot->next == NULL) atomic_store(&ht->oldest_snapshot, snapshot->version);
+    atomic_store(&ht->newest_snapshot, snapshot->version);
+    if (base != NULL) {
+        base->version = snapshot->version;
+        base->next = ht->bases;
+        ht->bases = base;
+        if (base->next == NULL) atomic_store(&ht->oldest_base, base->version);
+    }
+    /** Under the mutex too, so snapshots call it in the order of their versions. */
+    if (at_begin != NULL) at_begin(arg);
+    pthread_mutex_unlock(&ht->snapshotMutex);
+    for (size_t i = 0; i < ht->num_stripes; i++)
+        pthread_rwlock_unlock(&ht->stripes[i].lock);
 }
 
-void addClientId(List* client_list, const int notif_fd){
-    Node* newNode = (Node*)malloc(sizeof(Node));
-    newNode->notif_fd = notif_fd;
+/// Pairs of a snapshot_foreach.
+typedef struct Snapshot_Visit {
+    size_t version;
+    size_t since;
+    void (*visit)(const char *key, const char *value, void *arg);
+    void *arg;
+} Snapshot_Visit;
 
-    if (client_list->head == NULL){
-        client_list->head = newNode;
-        client_list->head->next = NULL;
-        return;
+/// Visits the value a node had at the snapshot's version, if it was written
+/// after the base.
+/// @param keyNode Node.
+/// @param snapshot What to visit.
+static void visit_node(KeyNode *keyNode, Snapshot_Visit *snapshot) {
+    const char *value = keyNode->value;
+    size_t written = keyNode->version;
+
+    for (Old_Value *old = keyNode->history; written > snapshot->version; old = old->next) {
+        /** The key didn't exist then. */
+        if (old == NULL) return;
+        value = old->value;
+        written = old->version;
     }
-    newNode->next = client_list->head;
-    client_list->head = newNode;
+    if (written >= snapshot->since) snapshot->visit(keyNode->key, value, snapshot->arg);
 }
 
-int removeClientId(List* client_list, const int notif_fd){
-    Node *aux = client_list->head;
+/// Visits what a stripe had at the snapshot's version. Caller must hold the
+/// stripe.
+/// @param ht Hash table.
+/// @param s Index of the stripe.
+/// @param snapshot What to visit.
+static void visit_stripe(HashTable *ht, size_t s, Snapshot_Visit *snapshot) {
+    Tombstone *graveyard = ht->stripes[s].graveyard;
 
-    /** Client_list is empty. */
-    if(client_list->head == NULL) return 1;
+    /** Keys deleted between the base and the snapshot, before they're
+     *  written again. */
+    if (snapshot->since > 0) {
+        for (Tombstone *tombstone = graveyard; tombstone != NULL; tombstone = tombstone->next) {
+            if (tombstone->version >= snapshot->since && tombstone->version <= snapshot->version)
+                snapshot->visit(tombstone->node->key, NULL, snapshot->arg);
+        }
+    }
+    if (ht->old_table != NULL) {
+        for (size_t i = s; i < ht->old_size; i += ht->num_stripes) {
+            if (i < atomic_load(&ht->rehash_index)) continue;
+            for (KeyNode *keyNode = ht->old_table[i]; keyNode != NULL; keyNode = keyNode->next)
+                visit_node(keyNode, snapshot);
+        }
+    }
+    for (size_t i = s; i < ht->size; i += ht->num_stripes) {
+        for (KeyNode *keyNode = ht->table[i]; keyNode != NULL; keyNode = keyNode->next)
+            visit_node(keyNode, snapshot);
+    }
+    /** Keys deleted since the snapshot started. */
+    for (Tombstone *tombstone = graveyard; tombstone != NULL; tombstone = tombstone->next) {
+        if (tombstone->version > snapshot->version) visit_node(tombstone->node, snapshot);
+    }
+}
 
-    /** Remove head. */
-    if(client_list->head->notif_fd == notif_fd){
-        Node *temp = client_list->head;
-        client_list->head = client_list->head->next;
-        free(temp);
-        return 0;
+void snapshot_foreach(HashTable *ht, Snapshot *snapshot, Snapshot *since,
+                      void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    snapshot_foreach_stripes(ht, snapshot, since, 0, ht->num_stripes, visit, arg);
+}
+
+void snapshot_foreach_stripes(HashTable *ht, Snapshot *snapshot, Snapshot *since, size_t first, size_t end,
+                              void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    Snapshot_Visit visiting = {snapshot->version, since != NULL ? since->version + 1 : 0, visit, arg};
+
+    for (size_t s = first; s < end; s++) {
+        /** Buckets of a stripe only move while it's held for writing. */
+        pthread_rwlock_rdlock(&ht->stripes[s].lock);
+        visit_stripe(ht, s, &visiting);
+        pthread_rwlock_unlock(&ht->stripes[s].lock);
     }
-    while(aux->next != NULL){
-        if(aux->next->notif_fd == notif_fd){
-          Node *temp = aux->next;
-          aux->next = aux->next->next;
-          free(temp);
-          return 0;
+}
+
+/// Removes a snapshot or base from its list. Caller must hold snapshotMutex.
+/// @param list List of snapshots or bases, newest first.
+/// @param snapshot Snapshot to remove.
+/// @return Version of the oldest one left, SIZE_MAX if none.
+static size_t unlist_snapshot(Snapshot **list, Snapshot *snapshot) {
+    Snapshot **link = list;
+    size_t oldest = SIZE_MAX;
+
+    while (*link != snapshot) link = &(*link)->next;
+    *link = snapshot->next;
+    for (Snapshot *other = *list; other != NULL; other = other->next)
+        oldest = other->version;
+    return oldest;
+}
+
+/// Retires the deleted nodes no snapshot or base needs anymore.
+/// @param ht Hash table.
+static void prune_graveyards(HashTable *ht) {
+    if (atomic_load(&ht->num_tombstones) == 0) return;
+
+    for (size_t s = 0; s < ht->num_stripes; s++) {
+        pthread_rwlock_wrlock(&ht->stripes[s].lock);
+        /** A new snapshot may have started meanwhile, it's on the list by now. */
+        size_t oldest = atomic_load(&ht->oldest_snapshot);
+        if (atomic_load(&ht->oldest_base) < oldest) oldest = atomic_load(&ht->oldest_base);
+        Tombstone **grave = &ht->stripes[s].graveyard;
+        while (*grave != NULL) {
+            Tombstone *tombstone = *grave;
+            if (tombstone->version <= oldest) {
+                *grave = tombstone->next;
+                epoch_retire(tombstone->node, reclaim_node, get_arena(ht, tombstone->node->hash));
+                free(tombstone);
+                atomic_fetch_sub(&ht->num_tombstones, 1);
+            }
+            else grave = &tombstone->next;
         }
-        aux = aux->next;
+        pthread_rwlock_unlock(&ht->stripes[s].lock);
+    }
+}
+
+void snapshot_end(HashTable *ht, Snapshot *snapshot) {
+    pthread_mutex_lock(&ht->snapshotMutex);
+    atomic_store(&ht->oldest_snapshot, unlist_snapshot(&ht->snapshots, snapshot));
+    atomic_store(&ht->newest_snapshot, ht->snapshots != NULL ? ht->snapshots->version : 0);
+    pthread_mutex_unlock(&ht->snapshotMutex);
+
+    /** Older values are dropped on the next write of their key. */
+    prune_graveyards(ht);
+}
+
+void base_end(HashTable *ht, Snapshot *base) {
+    pthread_mutex_lock(&ht->snapshotMutex);
+    atomic_store(&ht->oldest_base, unlist_snapshot(&ht->bases, base));
+    pthread_mutex_unlock(&ht->snapshotMutex);
+    prune_graveyards(ht);
+}
+
+int initSubscribers(Subscriber_Set* set){
+    set->targets = set->inline_targets;
+    set->count = 0;
+    set->capacity = INLINE_SUBSCRIBERS;
+    return pthread_rwlock_init(&set->lock, NULL) != 0;
+}
+
+void freeSubscribers(Subscriber_Set* set){
+    if (set->targets != set->inline_targets) free(set->targets);
+    pthread_rwlock_destroy(&set->lock);
+}
+
+/// Finds where a notification fd is, or would be, on a subscriber set.
+/// @param set Subscribers of a key.
+/// @param notif_fd notification fd of the client.
+/// @return Index of the first subscriber with a fd not below notif_fd.
+static size_t find_subscriber(Subscriber_Set* set, const int notif_fd){
+    size_t low = 0, high = set->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (set->targets[mid].notif_fd < notif_fd) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+int addClientId(Subscriber_Set* set, const int notif_fd, const int conflate){
+    size_t i = find_subscriber(set, notif_fd);
+
+    /** Subscribing again only updates the subscription. */
+    if (i < set->count && set->targets[i].notif_fd == notif_fd) {
+        set->targets[i].conflate = conflate;
+        return 0;
+    }
+
+    if (set->count == set->capacity) {
+        size_t capacity = set->capacity * 2;
+        Notif_Target *targets = malloc(capacity * sizeof(Notif_Target));
+        if (targets == NULL) return 1;
+        memcpy(targets, set->targets, set->count * sizeof(Notif_Target));
+        if (set->targets != set->inline_targets) free(set->targets);
+        set->targets = targets;
+        set->capacity = capacity;
     }
+
+    memmove(&set->targets[i + 1], &set->targets[i], (set->count - i) * sizeof(Notif_Target));
+    set->targets[i] = (Notif_Target){notif_fd, conflate};
+    set->count++;
+    return 0;
+}
+
+int removeClientId(Subscriber_Set* set, const int notif_fd){
+    size_t i = find_subscriber(set, notif_fd);
+
     /** notif_fd was not found. */
-    return 1;
+    if (i == set->count || set->targets[i].notif_fd != notif_fd) return 1;
+
+    set->count--;
+    memmove(&set->targets[i], &set->targets[i + 1], (set->count - i) * sizeof(Notif_Target));
+    return 0;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            freeList(temp->client_list);
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+/// Frees what every node of a bucket array holds outside of the arenas, and
+/// the array itself. Nodes, keys and values go away with the arenas.
+/// @param ht Hash table.
+/// @param table Bucket array.
+/// @param size Number of buckets.
+static void free_buckets(HashTable *ht, Bucket *table, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        for (KeyNode *keyNode = table[i]; keyNode != NULL; keyNode = keyNode->next) {
+            freeSubscribers(&keyNode->subscribers);
+            free_history(keyNode->history, get_arena(ht, keyNode->hash));
         }
     }
-    free(ht);
+    free(table);
 }
 
-void freeClientNodes(List* list){
-    Node* tmp = list->head;
-    Node* prev = NULL;
-
-    if(list->head == NULL) return;
-    while(tmp != NULL){
-        prev = tmp;
-        tmp = tmp->next;
-        free(prev);
+void free_table(HashTable *ht) {
+    free_buckets(ht, ht->table, ht->size);
+    if (ht->old_table != NULL)
+        free_buckets(ht, ht->old_table, ht->old_size);
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        /** Subscribers of deleted nodes are already gone. */
+        while (ht->stripes[i].graveyard != NULL) {
+            Tombstone *tombstone = ht->stripes[i].graveyard;
+            ht->stripes[i].graveyard = tombstone->next;
+            free_history(tombstone->node->history, get_arena(ht, tombstone->node->hash));
+            free(tombstone);
+        }
+        skiplist_destroy(&ht->stripes[i].index);
+        pthread_rwlock_destroy(&ht->stripes[i].lock);
     }
+    pthread_mutex_destroy(&ht->rehashMutex);
+    pthread_mutex_destroy(&ht->snapshotMutex);
+    for (size_t i = 0; i < ht->num_arenas; i++)
+        arena_destroy(&ht->arenas[i]);
+    free(ht->arenas);
+    free(ht->stripes);
+    free(ht);
 }
@@ -1,42 +1,242 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+/** Number of buckets a new table starts with (power of two). */
+#define INITIAL_TABLE_SIZE 64
+/** Number of lock stripes used when none is given at startup. */
+#define DEFAULT_NUM_STRIPES 64
+/** Maximum number of lock stripes. */
+#define MAX_NUM_STRIPES 65536
+/** Average chain length that triggers a resize. */
+#define MAX_LOAD_FACTOR 2
+/** Number of buckets moved to the new array on each rehash step. */
+#define REHASH_STEP 64
+
+/** Maximum number of arenas the nodes, keys and values are allocated from. */
+#define MAX_NUM_ARENAS 64
+/** Number of subscribers a key holds without allocating. */
+#define INLINE_SUBSCRIBERS 2
 
 #include <stddef.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+#include "slab.h"
+#include "notifier.h"
+#include "skiplist.h"
+
+/// Subscribers of a key, sorted by notif_fd. A few fit inline in the node;
+/// bigger sets move to an array that doubles when full. targets always
+/// points to the current storage, so it's handed to the notifier as is.
+typedef struct Subscriber_Set {
+    Notif_Target *targets;
+    size_t count, capacity;
+    pthread_rwlock_t lock;
+    Notif_Target inline_targets[INLINE_SUBSCRIBERS];
+} Subscriber_Set;
+
+/// Value a key had before being overwritten, kept while a snapshot taken
+/// when it was the key's value might still need it.
+typedef struct Old_Value {
+    char *value;
+    size_t version;
+    struct Old_Value *next;
+} Old_Value;
+
+/// Node, key and value live in the arena of the key's stripe. Readers may go
+/// through the table without locks (see read_pair_lockless), so links and
+/// values are published with release stores, a value is never changed in
+/// place (a new one replaces it) and whatever is unlinked is retired to the
+/// epoch reclamation instead of freed. version is the table's clock when
+/// value was written and history holds older values, newest first.
 typedef struct KeyNode {
     char *key;
-    char *value;
-    struct KeyNode *next;
-    struct List* client_list;
+    _Atomic(char *) value;
+    size_t hash;
+    _Atomic(struct KeyNode *) next;
+    size_t version;
+    Old_Value *history;
+    Subscriber_Set subscribers;
 } KeyNode;
 
+/// Node deleted while a snapshot might still need it, see Stripe.
+typedef struct Tombstone {
+    KeyNode *node;
+    size_t version;
+    struct Tombstone *next;
+} Tombstone;
+
+/// Head of a bucket's chain.
+typedef _Atomic(KeyNode *) Bucket;
+
+/// Lock stripe, padded to its own cache line so threads using neighbour
+/// stripes don't fight over it. version is odd while a writer holds the
+/// stripe and moves forward on every write, so lock-free readers can tell
+/// if what they read changed under them. graveyard holds the stripe's nodes
+/// deleted while snapshots were being taken. index keeps the stripe's nodes
+/// in key order, for scans; it's only changed while holding the stripe for
+/// writing and its entries come from the stripe's arena.
+typedef struct Stripe {
+    _Alignas(64) pthread_rwlock_t lock;
+    _Atomic size_t version;
+    Tombstone *graveyard;
+    Skiplist index;
+} Stripe;
+
+/// Point-in-time view of a table. Sees every write stamped with a version
+/// not above its own. Also used as the base of incremental backups, which
+/// only keeps the keys deleted after it.
+typedef struct Snapshot {
+    size_t version;
+    struct Snapshot *next;
+} Snapshot;
+
+/// Both num_stripes and the bucket arrays' sizes are powers of two, with
+/// never less buckets than stripes. Many buckets map to each stripe, and the
+/// stripe of a key (hash % num_stripes) is the same before and after a
+/// resize. While resizing, buckets of old_table below rehash_index have
+/// already been moved to table, and resize_version is odd. Arenas are shared
+/// by groups of stripes (num_arenas divides num_stripes), so a key always
+/// uses the same arena. Writes are stamped with clock, which every snapshot moves forward.
+/// snapshots lists the ones being taken, newest first, and oldest_snapshot
+/// and newest_snapshot are their versions (SIZE_MAX and 0 with none). bases
+/// and oldest_base are the same for the bases of incremental backups.
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t lockTable[TABLE_SIZE];
+    _Atomic(Bucket *) table;
+    _Atomic size_t size;
+    Bucket *old_table;
+    size_t old_size;
+    _Atomic size_t rehash_index;
+    _Atomic size_t resize_version;
+    _Atomic size_t num_keys;
+    pthread_mutex_t rehashMutex;
+    Stripe *stripes;
+    size_t num_stripes;
+    Arena *arenas;
+    size_t num_arenas;
+    _Atomic size_t clock;
+    pthread_mutex_t snapshotMutex;
+    Snapshot *snapshots;
+    _Atomic size_t oldest_snapshot;
+    _Atomic size_t newest_snapshot;
+    Snapshot *bases;
+    _Atomic size_t oldest_base;
+    _Atomic size_t num_tombstones;
 } HashTable;
 
-typedef struct Node {
-    int notif_fd;
-    struct Node* next;
-} Node;
+/// Hash function over the whole key (64-bit FNV-1a).
+/// @param key String to hash.
+/// @return hash.
+size_t hash(const char *key);
+
+/// Returns the index of the stripe that guards a key.
+/// @param ht Hash table.
+/// @param key Key of the pair.
+/// @return Index of the stripe.
+size_t stripe_index(HashTable *ht, const char *key);
+
+/// Returns the lock of a stripe.
+/// @param ht Hash table.
+/// @param index Index of the stripe.
+/// @return Lock of the stripe.
+pthread_rwlock_t *stripe_lock(HashTable *ht, size_t index);
+
+/// Takes a stripe's lock for writing, making its version odd.
+/// @param ht Hash table.
+/// @param index Index of the stripe.
+void stripe_write_lock(HashTable *ht, size_t index);
+
+/// Releases a stripe locked with stripe_write_lock.
+/// @param ht Hash table.
+/// @param index Index of the stripe.
+void stripe_write_unlock(HashTable *ht, size_t index);
 
-typedef struct List{
-    struct Node* head;
-    pthread_rwlock_t lockList;
-} List;
+/// Returns the version of a stripe, odd if a writer holds it.
+/// @param ht Hash table.
+/// @param index Index of the stripe.
+/// @return Version of the stripe.
+size_t stripe_version(HashTable *ht, size_t index);
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key);
+/// Finds the node of a key. Caller must hold the key's stripe lock.
+/// @param ht Hash table to search.
+/// @param key Key of the pair.
+/// @return Node of the key, NULL if it doesn't exist.
+KeyNode *find_key(HashTable *ht, const char *key);
+
+/// Calls visit for every node of the table. Caller must hold every stripe lock.
+/// @param ht Hash table to go through.
+/// @param visit Function called for every node.
+/// @param arg Argument passed to visit.
+void foreach_key(HashTable *ht, void (*visit)(KeyNode *node, void *arg), void *arg);
+
+/// Calls visit for every node with a key not below start, in key order,
+/// until it returns something other than 0. Merges the ordered indexes of
+/// the stripes. Caller must hold every stripe lock.
+/// @param ht Hash table to go through.
+/// @param start Smallest key to visit.
+/// @param visit Function called for every node.
+/// @param arg Argument passed to visit.
+/// @return 0 if successful, 1 otherwise.
+int foreach_key_from(HashTable *ht, const char *start, int (*visit)(KeyNode *node, void *arg), void *arg);
+
+/// Starts a snapshot of the table. Every stripe is held only while the clock
+/// moves forward; from then on overwritten values and deleted nodes the
+/// snapshot needs are kept aside until snapshot_end.
+/// @param ht Hash table.
+/// @param snapshot Snapshot to start, registered on the table until it ends.
+/// @param base If not NULL, starts a base at the same version: keys deleted
+/// from then on are kept until base_end, for a later snapshot_foreach.
+/// @param at_begin If not NULL, called while every stripe is still held, so
+/// no write is halfway through (to note where the log stands). Snapshots
+/// call it one at a time, in the order they're taken.
+/// @param arg Argument passed to at_begin.
+void snapshot_begin(HashTable *ht, Snapshot *snapshot, Snapshot *base, void (*at_begin)(void *arg), void *arg);
+
+/// Calls visit for every pair the table had when the snapshot started,
+/// holding one stripe at a time. Pairs come stripe by stripe, in no
+/// particular order, and a key deleted since a base comes before it's
+/// written again.
+/// @param ht Hash table.
+/// @param snapshot Snapshot started with snapshot_begin.
+/// @param since If not NULL, a base started before the snapshot: only pairs
+/// written after it are visited, along with the keys deleted after it (with
+/// a NULL value).
+/// @param visit Function called with the key and value of every pair.
+/// @param arg Argument passed to visit.
+void snapshot_foreach(HashTable *ht, Snapshot *snapshot, Snapshot *since,
+                      void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Same as snapshot_foreach, but only for the stripes from first up to (not
+/// including) end. Different ranges of a snapshot can be visited at once.
+/// @param ht Hash table.
+/// @param snapshot Snapshot started with snapshot_begin.
+/// @param since Base of the snapshot or NULL, as in snapshot_foreach.
+/// @param first First stripe to visit.
+/// @param end Stripe after the last one to visit.
+/// @param visit Function called with the key and value of every pair.
+/// @param arg Argument passed to visit.
+void snapshot_foreach_stripes(HashTable *ht, Snapshot *snapshot, Snapshot *since, size_t first, size_t end,
+                              void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Ends a snapshot, dropping what only it still needed.
+/// @param ht Hash table.
+/// @param snapshot Snapshot started with snapshot_begin.
+void snapshot_end(HashTable *ht, Snapshot *snapshot);
+
+/// Stops keeping deleted keys for a base.
+/// @param ht Hash table.
+/// @param base Base started with snapshot_begin.
+void base_end(HashTable *ht, Snapshot *base);
+
+/// Grows the table when it's too full and moves a few buckets to the new
+/// array. Must be called without holding any of the table's stripe locks.
+/// @param ht Hash table.
+void rehash_step(HashTable *ht);
 
 /// Creates a new event hash table.
+/// @param num_stripes Number of lock stripes, rounded up to a power of two.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(size_t num_stripes);
 
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
@@ -45,26 +245,49 @@ struct HashTable *create_hash_table();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
-/// Frees the client list.
-/// @param list 
-void freeList(List* list);
+/// Initializes an empty subscriber set.
+/// @param set
+/// @return 0 if successful, 1 otherwise.
+int initSubscribers(Subscriber_Set* set);
+
+/// Frees the subscriber set's array and destroys its lock.
+/// @param set
+void freeSubscribers(Subscriber_Set* set);
 
-/// Adds the client to the list of clients subscribed to the key.
-/// @param client_list List of the client notifcation fd's.
+/// Adds the client to the set of clients subscribed to the key. A client
+/// that is already on the set only has its conflate flag updated.
+/// @param set Subscribers of the key.
 /// @param notif_fd notification fd of the client.
-void addClientId(List* client_list, const int notif_fd);
+/// @param conflate Whether only the latest pending change should be delivered.
+/// @return 0 if successful, 1 if there was no memory for it.
+int addClientId(Subscriber_Set* set, const int notif_fd, const int conflate);
 
-/// Removes the client from the list of clients subscribed to the key.
-/// @param client_list List of the client notifcation fd's.
+/// Removes the client from the set of clients subscribed to the key.
+/// @param set Subscribers of the key.
 /// @param notif_fd notification fd of the client.
 /// @return 0 if notif_fd was removed, 1 if subscription didin't exist.
-int removeClientId(List* client_list, const int notif_fd);
+int removeClientId(Subscriber_Set* set, const int notif_fd);
+
+/// Copies the value of a key into the caller's buffer, without allocating.
+/// Caller must hold the key's stripe lock.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param buffer Buffer to copy the value to (not '\0' terminated).
+/// @param size Size of the buffer.
+/// @return Number of bytes copied, -1 if the key doesn't exist.
+int read_pair_into(HashTable *ht, const char *key, char *buffer, size_t size);
 
-/// Deletes the value of given key.
-/// @param ht Hash table to delete from.
-/// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-char* read_pair(HashTable *ht, const char *key);
+/// Copies the value of a key into the caller's buffer without taking any
+/// lock. Caller must be inside an epoch (see epoch_enter). The value was the
+/// key's at some point during the call; to read several keys at once, check
+/// the stripes' versions didn't change around the calls.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param buffer Buffer to copy the value to (not '\0' terminated).
+/// @param size Size of the buffer.
+/// @return Number of bytes copied, -1 if the key doesn't exist and -2 if the
+/// table is being resized (the caller should read with locks).
+int read_pair_lockless(HashTable *ht, const char *key, char *buffer, size_t size);
 
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
@@ -72,12 +295,8 @@ char* read_pair(HashTable *ht, const char *key);
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
-/// Frees the hashtable.
+/// Frees the hashtable, giving its arenas back in bulk.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
-/// Free all client nodes of a list.
-/// @param list 
-void freeClientNodes(List* list);
-
 #endif  // KVS_H
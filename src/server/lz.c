@@ -0,0 +1,132 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/** Shortest match worth a sequence. */
+#define MIN_MATCH 4
+/** Number of entries of the table of positions, by hash of 4 bytes. */
+#define HASH_BITS 12
+
+/// Hashes the 4 bytes at a position.
+/// @param data
+/// @return Index on the table of positions.
+static size_t hash4(const unsigned char *data){
+  uint32_t value = (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+  return (size_t)((value * 2654435761u) >> (32 - HASH_BITS));
+}
+
+/// Writes what's left of a length after its nibble, as bytes of 255 and a
+/// last one below it.
+/// @param dst Where to write.
+/// @param end End of the output.
+/// @param length What's left of the length (it's at least 15).
+/// @return Past the last byte written, NULL if it doesn't fit.
+static unsigned char *put_length(unsigned char *dst, unsigned char *end, size_t length){
+  for (length -= 15; length >= 255; length -= 255){
+    if (dst == end) return NULL;
+    *dst++ = 255;
+  }
+  if (dst == end) return NULL;
+  *dst++ = (unsigned char)length;
+  return dst;
+}
+
+/// Reads what's left of a length after its nibble.
+/// @param src Where to read, moved past the length.
+/// @param end End of the input.
+/// @param length Length so far, 15 when there's more to it.
+/// @return Length, SIZE_MAX if the input ends first.
+static size_t get_length(const unsigned char **src, const unsigned char *end, size_t length){
+  if (length < 15) return length;
+  for (unsigned char byte = 255; byte == 255; length += byte){
+    if (*src == end) return SIZE_MAX;
+    byte = *(*src)++;
+  }
+  return length;
+}
+
+/// Writes a sequence.
+/// @param dst Where to write.
+/// @param end End of the output.
+/// @param literals First literal.
+/// @param num_literals Number of literals.
+/// @param offset Offset of the match, 0 for the last sequence.
+/// @param match_length Length of the match.
+/// @return Past the sequence, NULL if it doesn't fit.
+static unsigned char *put_sequence(unsigned char *dst, unsigned char *end, const unsigned char *literals,
+                                   size_t num_literals, size_t offset, size_t match_length){
+  size_t extra = offset > 0 ? match_length - MIN_MATCH : 0;
+
+  if (dst == end) return NULL;
+  unsigned char *token = dst++;
+  *token = (unsigned char)((num_literals < 15 ? num_literals : 15) << 4 | (extra < 15 ? extra : 15));
+  if (num_literals >= 15 && (dst = put_length(dst, end, num_literals)) == NULL) return NULL;
+  if ((size_t)(end - dst) < num_literals) return NULL;
+  memcpy(dst, literals, num_literals);
+  dst += num_literals;
+  if (offset == 0) return dst;
+
+  if (end - dst < 2) return NULL;
+  *dst++ = (unsigned char)offset;
+  *dst++ = (unsigned char)(offset >> 8);
+  if (extra >= 15) dst = put_length(dst, end, extra);
+  return dst;
+}
+
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity){
+  /** Positions plus one, 0 for none yet. */
+  uint32_t positions[1 << HASH_BITS] = {0};
+  unsigned char *out = dst, *end = dst + capacity;
+  size_t anchor = 0, position = 0;
+
+  if (size > LZ_MAX_INPUT) return 0;
+  while (size >= MIN_MATCH && position <= size - MIN_MATCH){
+    size_t slot = hash4(src + position);
+    size_t candidate = positions[slot];
+    positions[slot] = (uint32_t)position + 1;
+
+    if (candidate == 0 || memcmp(src + candidate - 1, src + position, MIN_MATCH) != 0){
+      position++;
+      continue;
+    }
+    size_t match = candidate - 1, length = MIN_MATCH;
+    while (position + length < size && src[match + length] == src[position + length]) length++;
+
+    out = put_sequence(out, end, src + anchor, position - anchor, position - match, length);
+    if (out == NULL) return 0;
+    position += length;
+    anchor = position;
+  }
+  out = put_sequence(out, end, src + anchor, size - anchor, 0, 0);
+  return out != NULL ? (size_t)(out - dst) : 0;
+}
+
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t raw_size){
+  const unsigned char *end = src + size;
+  size_t length = 0;
+
+  while (src < end){
+    unsigned char token = *src++;
+    size_t num_literals = get_length(&src, end, token >> 4);
+    if (num_literals > (size_t)(end - src) || num_literals > raw_size - length) return 1;
+    memcpy(dst + length, src, num_literals);
+    src += num_literals;
+    length += num_literals;
+    /** Last sequence. */
+    if (src == end) break;
+
+    if (end - src < 2) return 1;
+    size_t offset = (size_t)src[0] | (size_t)src[1] << 8;
+    src += 2;
+    size_t match_length = get_length(&src, end, token & 15);
+    if (match_length == SIZE_MAX || offset == 0 || offset > length || match_length + MIN_MATCH > raw_size - length)
+      return 1;
+    match_length += MIN_MATCH;
+    /** Byte by byte, a match may overlap what it's writing. */
+    for (size_t i = 0; i < match_length; i++, length++){
+      dst[length] = dst[length - offset];
+    }
+  }
+  return length != raw_size;
+}
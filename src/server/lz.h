@@ -0,0 +1,28 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+
+/** Biggest input lz_compress takes, so every offset fits in 16 bits. */
+#define LZ_MAX_INPUT 65535
+
+/// Compresses a block with an LZ77 scheme: sequences of a token (literal
+/// count on the high nibble, match length minus 4 on the low one, 15 meaning
+/// more bytes of 255 follow), the literals, and the match's offset (16 bits,
+/// little endian). The last sequence has only literals.
+/// @param src Data to compress, at most LZ_MAX_INPUT bytes.
+/// @param size Size of the data.
+/// @param dst Buffer for the compressed data.
+/// @param capacity Size of dst.
+/// @return Size of the compressed data, 0 if it doesn't fit in capacity.
+size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity);
+
+/// Decompresses a block compressed by lz_compress.
+/// @param src Compressed data.
+/// @param size Size of the compressed data.
+/// @param dst Buffer for the data.
+/// @param raw_size Size of the data once decompressed.
+/// @return 0 if it decompressed to exactly raw_size bytes, 1 otherwise.
+int lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t raw_size);
+
+#endif // KVS_LZ_H
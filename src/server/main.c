@@ -16,6 +16,9 @@
 #include "parser.h"
 #include "operations.h"
 #include "file_processor.h"
+#include "kvs.h"
+#include "notifier.h"
+#include "wal.h"
 #include "server-client.h"
 #include "src/common/constants.h"
 #include "src/common/io.h"
@@ -25,12 +28,41 @@ void setup_SIGPIPE_ignore(){
   signal(SIGPIPE, SIG_IGN);
 }
 
+/// Prints how the server is used.
+/// @param name Name of the executable.
+static void print_usage(const char *name){
+  fprintf(stderr, "Usage: %s [options] <directory_path> <max_backups> <max_threads> <pipe_path>\n"
+                  "Options:\n"
+                  "  -s <num_stripes>  number of lock stripes of the KVS (default %d)\n"
+                  "  -n <num_threads>  number of notification delivery threads (default %d)\n"
+                  "  -i                incremental backups: after a job's first backup, only\n"
+                  "                    what changed since its previous one is stored\n"
+                  "  -b                binary backups (length prefixed records and a checksum)\n"
+                  "  -z                binary backups with their records in compressed blocks\n"
+                  "  -p <num_threads>  threads writing each backup, each to a segment file\n"
+                  "                    listed by the .bck manifest (default 1, 0 for one per core)\n"
+                  "  -r                start from the newest binary backup of the directory\n"
+                  "  -w <log_path>     log every WRITE and DELETE, replayed on startup; once\n"
+                  "                    a binary backup is on disk the log only keeps what\n"
+                  "                    came after it, so restart with -r\n"
+                  "  -y <policy>       when the log is synced: always (default), none, or\n"
+                  "                    every <ms> milliseconds\n"
+                  "  -j <num_threads>  threads running the commands of each job that don't\n"
+                  "                    share keys (default 1, 0 for one per core)\n"
+                  "  -e                each job is parsed, run and written by three threads\n"
+                  "                    at once, handing commands and output over ring buffers\n"
+                  "  -t                print how many jobs ran and how long they waited for a\n"
+                  "                    thread once every job is done\n",
+                  name, DEFAULT_NUM_STRIPES, DEFAULT_NOTIF_THREADS);
+}
+
 int main(int argc, char** argv) {
   pthread_mutex_t backup_mutex;
   DIR* pDir;
   pthread_t host_thread, managing_threads[MAX_SESSION_COUNT];
   Server_data *server_data;
   Host_thread host_thread_data;
+  Job_Pool_Stats stats;
   struct sigaction sa;
   sa.sa_handler = handle_SIGUSR1;
   sa.sa_flags = 0;
@@ -41,17 +73,101 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  if (kvs_init()) {
-    fprintf(stderr, "Failed  to initialize KVS\n");
-    return 1;
+  size_t num_stripes = DEFAULT_NUM_STRIPES;
+  size_t notif_threads = DEFAULT_NOTIF_THREADS;
+  size_t backup_segments = 1;
+  size_t command_threads = 1;
+  Backup_Format format = BACKUP_TEXT;
+  int incremental = 0, restore = 0, pipelined = 0, print_stats = 0;
+  const char *log_path = NULL;
+  Wal_Sync log_sync = WAL_SYNC_ALWAYS;
+  unsigned int log_interval = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "s:n:ibzp:rw:y:j:et")) != -1){
+    switch(opt){
+      case 's':
+        num_stripes = (size_t)strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        notif_threads = (size_t)strtoul(optarg, NULL, 10);
+        break;
+      case 'i':
+        incremental = 1;
+        break;
+      case 'b':
+        if(format == BACKUP_TEXT) format = BACKUP_BINARY;
+        break;
+      case 'z':
+        format = BACKUP_COMPRESSED;
+        break;
+      case 'p':
+        backup_segments = (size_t)strtoul(optarg, NULL, 10);
+        if(backup_segments == 0){
+          long cores = sysconf(_SC_NPROCESSORS_ONLN);
+          backup_segments = cores > 0 ? (size_t)cores : 1;
+        }
+        break;
+      case 'j':
+        command_threads = (size_t)strtoul(optarg, NULL, 10);
+        if(command_threads == 0){
+          long cores = sysconf(_SC_NPROCESSORS_ONLN);
+          command_threads = cores > 0 ? (size_t)cores : 1;
+        }
+        break;
+      case 'e':
+        pipelined = 1;
+        break;
+      case 't':
+        print_stats = 1;
+        break;
+      case 'r':
+        restore = 1;
+        break;
+      case 'w':
+        log_path = optarg;
+        break;
+      case 'y':
+        if(strcmp(optarg, "always") == 0) log_sync = WAL_SYNC_ALWAYS;
+        else if(strcmp(optarg, "none") == 0) log_sync = WAL_SYNC_NONE;
+        else if((log_interval = (unsigned int)strtoul(optarg, NULL, 10)) > 0) log_sync = WAL_SYNC_INTERVAL;
+        else{
+          print_usage(argv[0]);
+          return 1;
+        }
+        break;
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
   }
 
-  if(argc < 5){
-    fprintf(stderr, "Usage: %s <directory_path> <max_backups> <max_threads> <pipe_path>\n", argv[0]);
+  if(argc - optind < 4){
+    print_usage(argv[0]);
     return 1;
   }
+  /** getopt stops at the first positional argument, so an option after them would be silently ignored. */
+  for(int i = optind + 4; i < argc; i++){
+    if(argv[i][0] == '-'){
+      fprintf(stderr, "Option \"%s\" must come before <directory_path>\n", argv[i]);
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  /** Positional arguments, right after the options. */
+  argv += optind - 1;
   const size_t MAX_BACKUPS = (size_t)strtoul(argv[2], NULL, 10);
   const size_t MAX_THREADS = (size_t)strtoul(argv[3], NULL, 10);
+
+  if (kvs_init(num_stripes)) {
+    fprintf(stderr, "Failed  to initialize KVS\n");
+    return 1;
+  }
+
+  if (notifier_init(notif_threads)) {
+    fprintf(stderr, "Failed to start the notifier\n");
+    kvs_terminate();
+    return 1;
+  }
   
   setup_SIGPIPE_ignore();
 
@@ -62,6 +178,23 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  /** Warm restart, the table is built before any job starts. */
+  if(restore && kvs_restore(argv[1], MAX_THREADS) != 0){
+    fprintf(stderr, "Failed to restore the KVS.\n");
+    kvs_terminate();
+    closedir(pDir);
+    return 1;
+  }
+
+  /** What was logged after the backups goes on top, then new writes are
+      logged after it. */
+  if(log_path != NULL && (kvs_replay_log(log_path) != 0 || wal_open(log_path, log_sync, log_interval) != 0)){
+    fprintf(stderr, "Failed to recover from the log.\n");
+    kvs_terminate();
+    closedir(pDir);
+    return 1;
+  }
+
   /** Initialize mutex for backup. */
   if(pthread_mutex_init(&backup_mutex, NULL) != 0){
     fprintf(stderr, "Failed to initialize backup mutex.\n");
@@ -109,11 +242,15 @@ int main(int argc, char** argv) {
   }
 
   /** Start processing .job files. */
-  if(dispatch_job_threads(argv[1], MAX_BACKUPS, MAX_THREADS, &backup_mutex, pDir) == 1){
+  if(dispatch_job_threads(argv[1], MAX_BACKUPS, MAX_THREADS, &backup_mutex, pDir, incremental, format,
+                          backup_segments, command_threads, pipelined, &stats) == 1){
     kvs_terminate();
     closedir(pDir);
     return 1;
   }
+  if(print_stats && stats.jobs > 0)
+    fprintf(stderr, "Jobs: %zu run, %zu stolen, queue wait %.3f ms average, %.3f ms max\n", stats.jobs,
+            stats.stolen, (double)stats.total_wait_us / (double)stats.jobs / 1000.0, (double)stats.max_wait_us / 1000.0);
   
   for(int i = 0; i < MAX_SESSION_COUNT; i++){
     if(pthread_join(managing_threads[i], NULL) != 0){
@@ -134,6 +271,8 @@ int main(int argc, char** argv) {
   }
 
   /** Ending program. */
+  wal_close();
+  notifier_terminate();
   kvs_terminate();
   closedir(pDir);
   destroy_server_data(server_data);
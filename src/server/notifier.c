@@ -0,0 +1,407 @@
+#include "notifier.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "server-client.h"
+
+/// Change on a key, waiting to be handed to its subscribers' queues.
+typedef struct Notif_Event{
+  struct Notif_Event *next;
+  char frame[NOTIF_FRAME_SIZE];
+  size_t key_hash;
+  size_t num_targets;
+  Notif_Target targets[];
+}Notif_Event;
+
+/// Client receiving notifications. Only one delivery thread works on a
+/// subscriber at a time (while scheduled is set), so frames reach the FIFO
+/// in the order they were queued. A subscriber whose queue filled up is
+/// lagging: it takes no more frames, and once the queued ones are written
+/// its FIFO is closed. The FIFO is non-blocking, so a client that stops
+/// reading is cut off as soon as its FIFO is full. Frames are numbered: the queue holds
+/// numbers head to head + count - 1, on slot number % NOTIF_QUEUE_SIZE.
+/// pending maps a key's hash to the number of its last queued frame, so
+/// conflated subscriptions can find it.
+typedef struct Subscriber{
+  int notif_fd;
+  pthread_mutex_t mutex;
+  pthread_cond_t idle;
+  int scheduled, broken, lagging;
+  size_t head, count, conflated;
+  char frames[NOTIF_QUEUE_SIZE][NOTIF_FRAME_SIZE];
+  size_t pending[NOTIF_CONFLATION_SLOTS];
+  struct Subscriber *next_ready;
+}Subscriber;
+
+typedef struct Notifier{
+  pthread_mutex_t mutex;
+  pthread_cond_t has_events, has_ready;
+  Notif_Event *events_head, *events_tail;
+  Subscriber *ready_head, *ready_tail;
+  /** Events ever published and ever handed to their subscribers' queues. */
+  uint64_t published, dispatched;
+  pthread_cond_t has_dispatched;
+  pthread_rwlock_t registry_lock;
+  Subscriber *subscribers[MAX_SUBSCRIBERS];
+  pthread_t dispatcher;
+  pthread_t *delivery;
+  size_t num_delivery;
+  /** Open on /dev/null, put in place of the FIFO of a subscriber that's cut off. */
+  int null_fd;
+  int stop;
+}Notifier;
+
+static Notifier notifier;
+
+/// Finds a registered subscriber. Caller must hold registry_lock.
+/// @param notif_fd Fd of the client's notification FIFO.
+/// @return Index on the registry, -1 if it isn't registered.
+static int find_subscriber(int notif_fd){
+  for(int i = 0; i < MAX_SUBSCRIBERS; i++){
+    if(notifier.subscribers[i] != NULL && notifier.subscribers[i]->notif_fd == notif_fd)
+      return i;
+  }
+  return -1;
+}
+
+/// Closes the FIFO of a lagging subscriber. The fd
+/// is pointed at /dev/null, so the client reads end of file and knows
+/// notifications stopped, while the fd stays taken until the session closes
+/// it. Caller must hold the subscriber's mutex.
+/// @param subscriber
+static void cut_off(Subscriber *subscriber){
+  subscriber->broken = 1;
+  if(dup2(notifier.null_fd, subscriber->notif_fd) == -1)
+    fprintf(stderr, "Failed to close the notification FIFO of fd %d.\n", subscriber->notif_fd);
+}
+
+/// Queues a frame on a subscriber and makes sure a delivery thread will
+/// pick it up. A subscriber whose queue is full becomes lagging rather than
+/// missing a change without knowing.
+/// @param subscriber
+/// @param frame Notification, NOTIF_FRAME_SIZE bytes.
+/// @param key_hash Hash of the frame's key.
+/// @param conflate Whether a pending frame of the same key can be replaced.
+static void push_frame(Subscriber *subscriber, const char *frame, size_t key_hash, int conflate){
+  size_t *pending = &subscriber->pending[key_hash % NOTIF_CONFLATION_SLOTS];
+
+  pthread_mutex_lock(&subscriber->mutex);
+  if(subscriber->broken || subscriber->lagging){
+    pthread_mutex_unlock(&subscriber->mutex);
+    return;
+  }
+  /** Replace the key's frame if it's still waiting (and really is the same key). */
+  if(conflate && *pending >= subscriber->head && *pending < subscriber->head + subscriber->count){
+    char *queued = subscriber->frames[*pending % NOTIF_QUEUE_SIZE];
+    if(memcmp(queued, frame, MAX_STRING_SIZE + 2) == 0){
+      memcpy(queued, frame, NOTIF_FRAME_SIZE);
+      subscriber->conflated++;
+      pthread_mutex_unlock(&subscriber->mutex);
+      return;
+    }
+  }
+  if(subscriber->count == NOTIF_QUEUE_SIZE){
+    /** Subscriber isn't keeping up, don't let it hold anyone else. */
+    subscriber->lagging = 1;
+    fprintf(stderr, "Notification queue of fd %d is full, closing its notifications.\n", subscriber->notif_fd);
+    pthread_mutex_unlock(&subscriber->mutex);
+    return;
+  }
+  *pending = subscriber->head + subscriber->count;
+  memcpy(subscriber->frames[*pending % NOTIF_QUEUE_SIZE], frame, NOTIF_FRAME_SIZE);
+  subscriber->count++;
+
+  if(!subscriber->scheduled){
+    subscriber->scheduled = 1;
+    pthread_mutex_lock(&notifier.mutex);
+    subscriber->next_ready = NULL;
+    if(notifier.ready_tail == NULL) notifier.ready_head = subscriber;
+    else notifier.ready_tail->next_ready = subscriber;
+    notifier.ready_tail = subscriber;
+    pthread_cond_signal(&notifier.has_ready);
+    pthread_mutex_unlock(&notifier.mutex);
+  }
+  pthread_mutex_unlock(&subscriber->mutex);
+}
+
+/// Thread function that hands every published event to its subscribers.
+/// @param arg Unused.
+/// @return NULL
+static void *dispatcher_thread_fn(void *arg){
+  (void)arg;
+  block_SIGUSR1();
+
+  while(1){
+    pthread_mutex_lock(&notifier.mutex);
+    while(notifier.events_head == NULL && !notifier.stop)
+      pthread_cond_wait(&notifier.has_events, &notifier.mutex);
+    if(notifier.events_head == NULL){
+      pthread_mutex_unlock(&notifier.mutex);
+      return NULL;
+    }
+    Notif_Event *event = notifier.events_head;
+    notifier.events_head = event->next;
+    if(notifier.events_head == NULL) notifier.events_tail = NULL;
+    pthread_mutex_unlock(&notifier.mutex);
+
+    pthread_rwlock_rdlock(&notifier.registry_lock);
+    for(size_t i = 0; i < event->num_targets; i++){
+      int index = find_subscriber(event->targets[i].notif_fd);
+      if(index != -1)
+        push_frame(notifier.subscribers[index], event->frame, event->key_hash, event->targets[i].conflate);
+    }
+    pthread_rwlock_unlock(&notifier.registry_lock);
+    free(event);
+
+    pthread_mutex_lock(&notifier.mutex);
+    notifier.dispatched++;
+    pthread_cond_broadcast(&notifier.has_dispatched);
+    pthread_mutex_unlock(&notifier.mutex);
+  }
+}
+
+/// Writes frames to a subscriber's FIFO, without waiting for the client to
+/// read them.
+/// @param notif_fd Fd of the client's notification FIFO.
+/// @param buffer Frames.
+/// @param size Number of bytes.
+/// @return 0 if successful, 1 if the FIFO is full, -1 if the client is gone.
+static int write_frames(int notif_fd, const char *buffer, size_t size){
+  size_t written = 0;
+
+  while(written < size){
+    ssize_t result = write(notif_fd, buffer + written, size - written);
+    if(result == -1){
+      if(errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    }
+    written += (size_t)result;
+  }
+  return 0;
+}
+
+/// Thread function that writes queued frames to the subscribers' FIFOs.
+/// @param arg Unused.
+/// @return NULL
+static void *delivery_thread_fn(void *arg){
+  (void)arg;
+  block_SIGUSR1();
+  char buffer[NOTIF_BATCH_SIZE * NOTIF_FRAME_SIZE];
+
+  while(1){
+    pthread_mutex_lock(&notifier.mutex);
+    while(notifier.ready_head == NULL && !notifier.stop)
+      pthread_cond_wait(&notifier.has_ready, &notifier.mutex);
+    if(notifier.ready_head == NULL){
+      pthread_mutex_unlock(&notifier.mutex);
+      return NULL;
+    }
+    Subscriber *subscriber = notifier.ready_head;
+    notifier.ready_head = subscriber->next_ready;
+    if(notifier.ready_head == NULL) notifier.ready_tail = NULL;
+    pthread_mutex_unlock(&notifier.mutex);
+
+    /** Drain the subscriber, a batch of frames per write. */
+    while(1){
+      pthread_mutex_lock(&subscriber->mutex);
+      if(subscriber->count == 0 || subscriber->broken){
+        if(subscriber->lagging && !subscriber->broken) cut_off(subscriber);
+        subscriber->count = 0;
+        subscriber->scheduled = 0;
+        pthread_cond_broadcast(&subscriber->idle);
+        pthread_mutex_unlock(&subscriber->mutex);
+        break;
+      }
+      size_t num_frames = 0;
+      while(subscriber->count > 0 && num_frames < NOTIF_BATCH_SIZE){
+        memcpy(buffer + num_frames * NOTIF_FRAME_SIZE, subscriber->frames[subscriber->head % NOTIF_QUEUE_SIZE], NOTIF_FRAME_SIZE);
+        subscriber->head++;
+        subscriber->count--;
+        num_frames++;
+      }
+      int notif_fd = subscriber->notif_fd;
+      pthread_mutex_unlock(&subscriber->mutex);
+
+      int result = write_frames(notif_fd, buffer, num_frames * NOTIF_FRAME_SIZE);
+      if(result != 0){
+        pthread_mutex_lock(&subscriber->mutex);
+        if(result == 1 && !subscriber->broken){
+          /** Client stopped reading, don't let it hold this thread. */
+          if(!subscriber->lagging)
+            fprintf(stderr, "Notification FIFO of fd %d is full, closing its notifications.\n", notif_fd);
+          cut_off(subscriber);
+        }
+        /** Client is gone, stop writing to it until it's removed. */
+        subscriber->broken = 1;
+        pthread_mutex_unlock(&subscriber->mutex);
+      }
+    }
+  }
+}
+
+int notifier_init(size_t num_threads){
+  if(num_threads == 0) num_threads = 1;
+
+  pthread_mutex_init(&notifier.mutex, NULL);
+  pthread_cond_init(&notifier.has_events, NULL);
+  pthread_cond_init(&notifier.has_ready, NULL);
+  pthread_cond_init(&notifier.has_dispatched, NULL);
+  pthread_rwlock_init(&notifier.registry_lock, NULL);
+  notifier.events_head = notifier.events_tail = NULL;
+  notifier.ready_head = notifier.ready_tail = NULL;
+  notifier.published = notifier.dispatched = 0;
+  for(int i = 0; i < MAX_SUBSCRIBERS; i++) notifier.subscribers[i] = NULL;
+  notifier.stop = 0;
+  notifier.num_delivery = 0;
+
+  if((notifier.null_fd = open("/dev/null", O_WRONLY)) == -1){
+    fprintf(stderr, "Failed to open /dev/null.\n");
+    return 1;
+  }
+  if((notifier.delivery = malloc(num_threads * sizeof(pthread_t))) == NULL){
+    fprintf(stderr, "Failed to allocate memory for the delivery threads.\n");
+    close(notifier.null_fd);
+    return 1;
+  }
+  if(pthread_create(&notifier.dispatcher, NULL, dispatcher_thread_fn, NULL) != 0){
+    fprintf(stderr, "Failed to create the notification dispatcher thread.\n");
+    free(notifier.delivery);
+    close(notifier.null_fd);
+    return 1;
+  }
+  for(; notifier.num_delivery < num_threads; notifier.num_delivery++){
+    if(pthread_create(&notifier.delivery[notifier.num_delivery], NULL, delivery_thread_fn, NULL) != 0){
+      fprintf(stderr, "Failed to create a notification delivery thread.\n");
+      notifier_terminate();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void notifier_terminate(){
+  pthread_mutex_lock(&notifier.mutex);
+  notifier.stop = 1;
+  pthread_cond_broadcast(&notifier.has_events);
+  pthread_cond_broadcast(&notifier.has_ready);
+  pthread_mutex_unlock(&notifier.mutex);
+
+  pthread_join(notifier.dispatcher, NULL);
+  for(size_t i = 0; i < notifier.num_delivery; i++)
+    pthread_join(notifier.delivery[i], NULL);
+  free(notifier.delivery);
+  close(notifier.null_fd);
+
+  for(int i = 0; i < MAX_SUBSCRIBERS; i++){
+    if(notifier.subscribers[i] != NULL){
+      pthread_mutex_destroy(&notifier.subscribers[i]->mutex);
+      pthread_cond_destroy(&notifier.subscribers[i]->idle);
+      free(notifier.subscribers[i]);
+    }
+  }
+  pthread_rwlock_destroy(&notifier.registry_lock);
+  pthread_cond_destroy(&notifier.has_dispatched);
+  pthread_cond_destroy(&notifier.has_ready);
+  pthread_cond_destroy(&notifier.has_events);
+  pthread_mutex_destroy(&notifier.mutex);
+}
+
+int notifier_add_subscriber(int notif_fd){
+  int flags = fcntl(notif_fd, F_GETFL);
+  /** Delivery threads never wait on a client, a full FIFO cuts it off. */
+  if(flags == -1 || fcntl(notif_fd, F_SETFL, flags | O_NONBLOCK) == -1){
+    fprintf(stderr, "Failed to make the notification FIFO of fd %d non-blocking.\n", notif_fd);
+    return 1;
+  }
+  Subscriber *subscriber = (Subscriber *)malloc(sizeof(Subscriber));
+  if(subscriber == NULL){
+    fprintf(stderr, "Failed to allocate memory for a new subscriber.\n");
+    return 1;
+  }
+  subscriber->notif_fd = notif_fd;
+  subscriber->scheduled = subscriber->broken = subscriber->lagging = 0;
+  subscriber->head = subscriber->count = subscriber->conflated = 0;
+  /** Empty slots point at a frame number that was never queued. */
+  for(size_t i = 0; i < NOTIF_CONFLATION_SLOTS; i++) subscriber->pending[i] = SIZE_MAX;
+  subscriber->next_ready = NULL;
+  pthread_mutex_init(&subscriber->mutex, NULL);
+  pthread_cond_init(&subscriber->idle, NULL);
+
+  pthread_rwlock_wrlock(&notifier.registry_lock);
+  for(int i = 0; i < MAX_SUBSCRIBERS; i++){
+    if(notifier.subscribers[i] == NULL){
+      notifier.subscribers[i] = subscriber;
+      pthread_rwlock_unlock(&notifier.registry_lock);
+      return 0;
+    }
+  }
+  pthread_rwlock_unlock(&notifier.registry_lock);
+
+  fprintf(stderr, "Too many subscribers registered.\n");
+  pthread_mutex_destroy(&subscriber->mutex);
+  pthread_cond_destroy(&subscriber->idle);
+  free(subscriber);
+  return 1;
+}
+
+void notifier_remove_subscriber(int notif_fd){
+  /** Events published so far may still name the fd, and a client opening
+   *  it next would get them. Later ones don't, it was unsubscribed first. */
+  pthread_mutex_lock(&notifier.mutex);
+  uint64_t published = notifier.published;
+  while(notifier.dispatched < published)
+    pthread_cond_wait(&notifier.has_dispatched, &notifier.mutex);
+  pthread_mutex_unlock(&notifier.mutex);
+
+  pthread_rwlock_wrlock(&notifier.registry_lock);
+  int index = find_subscriber(notif_fd);
+  if(index == -1){
+    pthread_rwlock_unlock(&notifier.registry_lock);
+    return;
+  }
+  Subscriber *subscriber = notifier.subscribers[index];
+  notifier.subscribers[index] = NULL;
+  pthread_rwlock_unlock(&notifier.registry_lock);
+
+  /** Drop what's pending and wait for the delivery thread to let go of it. */
+  pthread_mutex_lock(&subscriber->mutex);
+  subscriber->broken = 1;
+  while(subscriber->scheduled)
+    pthread_cond_wait(&subscriber->idle, &subscriber->mutex);
+  pthread_mutex_unlock(&subscriber->mutex);
+
+  pthread_mutex_destroy(&subscriber->mutex);
+  pthread_cond_destroy(&subscriber->idle);
+  free(subscriber);
+}
+
+int notifier_publish(const char *frame, size_t key_hash, const Notif_Target *targets, size_t num_targets){
+  if(num_targets == 0) return 0;
+
+  Notif_Event *event = (Notif_Event *)malloc(sizeof(Notif_Event) + num_targets * sizeof(Notif_Target));
+  if(event == NULL){
+    fprintf(stderr, "Failed to allocate memory for a notification.\n");
+    return 1;
+  }
+  memcpy(event->frame, frame, NOTIF_FRAME_SIZE);
+  memcpy(event->targets, targets, num_targets * sizeof(Notif_Target));
+  event->key_hash = key_hash;
+  event->num_targets = num_targets;
+  event->next = NULL;
+
+  pthread_mutex_lock(&notifier.mutex);
+  if(notifier.events_tail == NULL) notifier.events_head = event;
+  else notifier.events_tail->next = event;
+  notifier.events_tail = event;
+  notifier.published++;
+  pthread_cond_signal(&notifier.has_events);
+  pthread_mutex_unlock(&notifier.mutex);
+  return 0;
+}
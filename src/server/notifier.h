@@ -0,0 +1,65 @@
+#ifndef KVS_NOTIFIER_H
+#define KVS_NOTIFIER_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "src/common/constants.h"
+
+/** Size of a notification: "(key" padded, ",value" padded and ")". */
+#define NOTIF_FRAME_SIZE (MAX_STRING_SIZE*2 + 5)
+/** Maximum number of notifications waiting to be delivered to a subscriber. */
+#define NOTIF_QUEUE_SIZE 256
+/** Maximum number of notifications delivered with a single write. */
+#define NOTIF_BATCH_SIZE 32
+/** Number of delivery threads when none is given at startup. */
+#define DEFAULT_NOTIF_THREADS 2
+/** Number of entries of each subscriber's index of pending frames by key. */
+#define NOTIF_CONFLATION_SLOTS 128
+/** Maximum number of registered subscribers (one per session). */
+#define MAX_SUBSCRIBERS MAX_SESSION_COUNT
+
+/// Starts the dispatcher thread and the delivery threads.
+/// @param num_threads Number of delivery threads.
+/// @return 0 if successful, 1 otherwise.
+int notifier_init(size_t num_threads);
+
+/// Subscriber of a key. With conflate set, a notification for the key that
+/// wasn't delivered yet is replaced by the newer one instead of queueing both.
+typedef struct Notif_Target{
+  int notif_fd;
+  int conflate;
+}Notif_Target;
+
+/// Stops every thread of the notifier and frees what was left to deliver.
+void notifier_terminate();
+
+/// Registers a client's notification FIFO so it can receive notifications.
+/// The FIFO is made non-blocking. A subscriber that falls NOTIF_QUEUE_SIZE
+/// notifications behind gets the ones already queued and is then cut off,
+/// and one whose FIFO fills up (it stopped reading) is cut off right away:
+/// its FIFO is closed (the fd is pointed at /dev/null, and stays open until
+/// the caller closes it), so the client sees end of file instead of missing
+/// changes silently.
+/// @param notif_fd Fd of the client's notification FIFO.
+/// @return 0 if successful, 1 otherwise.
+int notifier_add_subscriber(int notif_fd);
+
+/// Unregisters a client's notification FIFO. Pending notifications are
+/// dropped, and it only returns once no delivery thread is using the fd and
+/// every notification published before it was dispatched, so the fd can be
+/// closed (and given to another client) afterwards. The client must have
+/// been removed from every key's subscribers first.
+/// @param notif_fd Fd of the client's notification FIFO.
+void notifier_remove_subscriber(int notif_fd);
+
+/// Queues a notification for a group of subscribers. Never blocks on the
+/// subscribers, so it can be called while holding the table's locks.
+/// @param frame Notification, NOTIF_FRAME_SIZE bytes.
+/// @param key_hash Hash of the key the notification is about.
+/// @param targets Subscribers of the key.
+/// @param num_targets Number of subscribers.
+/// @return 0 if successful, 1 otherwise.
+int notifier_publish(const char *frame, size_t key_hash, const Notif_Target *targets, size_t num_targets);
+
+#endif // KVS_NOTIFIER_H
@@ -1,3 +1,5 @@
+#include "operations.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,96 +7,36 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 
 #include "kvs.h"
-#include "constants.h"
+#include "io.h"
+#include "epoch.h"
+#include "snapshot_file.h"
+#include "wal.h"
 
 static struct HashTable* kvs_table = NULL;
 
-/// Merges two sorted arrays.
-/// @param keys sorted array of keys.
-/// @param values values that correspond to a key.
-/// @param l left limit for sorting.
-/// @param m middle of the array.
-/// @param r right limit for sorting.
-void merge(char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t l, size_t m, size_t r) {
-  size_t i, j, k;
-  size_t n1 = m - l + 1;
-  size_t n2 = r - m;
-
-  /** Create temp arrays */
-  char L[n1][MAX_STRING_SIZE], R[n2][MAX_STRING_SIZE];
-  char Lval[n1][MAX_STRING_SIZE], Rval[n2][MAX_STRING_SIZE];
-
-  /**  Copy data to temp arrays L[] and R[] */
-  for (i = 0; i < n1; i++) {
-      strcpy(L[i], keys[l + i]);
-      strcpy(Lval[i], values[l + i]);
-  }
-  for (j = 0; j < n2; j++) {
-      strcpy(R[j], keys[m + 1 + j]);
-      strcpy(Rval[j], values[m + 1 + j]);
-  }
-
-  /**  Merge the temp arrays back into keys[l..r] and values[l..r] */
-  i = 0;
-  j = 0;
-  k = l;
-  while (i < n1 && j < n2) {
-      if (strcmp(L[i], R[j]) <= 0) {
-          strcpy(keys[k], L[i]);
-          strcpy(values[k], Lval[i]);
-          i++;
-      } else {
-          strcpy(keys[k], R[j]);
-          strcpy(values[k], Rval[j]);
-          j++;
-      }
-      k++;
-  }
-
-  /**  Copy the remaining elements of L[], if there are any */
-  while (i < n1) {
-      strcpy(keys[k], L[i]);
-      strcpy(values[k], Lval[i]);
-      i++;
-      k++;
-  }
-  /**  Copy the remaining elements of R[], if there are any */
-  while (j < n2) {
-      strcpy(keys[k], R[j]);
-      strcpy(values[k], Rval[j]);
-      j++;
-      k++;
-  }
-}
-
-/// Sorts keys array and keeps values conected to the corresponding key.
-/// @param keys array with keys to be sorted.
-/// @param values array with values that correspond to a key.
-/// @param l left limit for sorting.
-/// @param r right limit for sorting.
-void mergeSort(char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t l, size_t r){
-  if (l < r) {
-    size_t m = l + (r - l) / 2;
-
-    /** Sort first and second halves */
-    mergeSort(keys, values, l, m);
-    mergeSort(keys, values, m + 1, r);
-
-    /** Merge both halves. */
-    merge(keys, values, l, m, r);
-  }
-}
-
-/// Returns wich key has a bigger first character. 
+/// Compares two keys, given by pointers to them.
 /// @param key1 
 /// @param key2 
 /// @return 0 if equal, < 0 if less and > 0 if greater.
 int compare_keys(const void* key1, const void *key2){
-  return strncmp(key1, key2, 1);
+  return strncmp(*(char *const *)key1, *(char *const *)key2, MAX_STRING_SIZE);
+}
+
+/// Fills sorted with pointers to the keys, in increasing order. Only the
+/// pointers move, the keys stay where they are.
+/// @param num_pairs Number of keys.
+/// @param keys Pointers to the keys.
+/// @param sorted Array to fill, with room for num_pairs pointers.
+static void sort_keys(size_t num_pairs, char *keys[], char *sorted[]){
+  for (size_t i = 0; i < num_pairs; i++) {
+    sorted[i] = keys[i];
+  }
+  qsort(sorted, num_pairs, sizeof(char *), compare_keys);
 }
 
 /// Calculates a timespec from a delay in milliseconds.
@@ -104,14 +46,19 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-int kvs_init() {
+int kvs_init(size_t num_stripes) {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
     return 1;
   }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  if (epoch_init() != 0) return 1;
+  kvs_table = create_hash_table(num_stripes);
+  if (kvs_table == NULL) {
+    epoch_terminate();
+    return 1;
+  }
+  return 0;
 }
 
 int kvs_terminate() {
@@ -120,6 +67,8 @@ int kvs_terminate() {
     return 1;
   }
 
+  /** Retired values still belong to the table's arenas. */
+  epoch_terminate();
   free_table(kvs_table);
   return 0;
 }
@@ -148,92 +97,239 @@ int write_buffer(int fd, char *buffer, size_t buffer_size){
   return 0;
 }
 
-/// Locks all of the entries on the KVS hash table, with the given keys, for writing.
-/// @param num_pairs Number of keys received.
-/// @param keys Array with entries that need to be blocked.
-void wrlock_table_entries(size_t num_pairs, char keys[][MAX_STRING_SIZE]){
+/// Distinct stripes a multi-key command touches, in increasing order. Every
+/// command takes its stripes in that order, once each, so commands with
+/// overlapping keys can't deadlock. order has the indexes of the keys
+/// grouped by stripe, in the same order, keeping the order of the keys
+/// within a stripe.
+typedef struct Lock_Set{
+  size_t count;
+  int write;
+  size_t stripes[MAX_WRITE_SIZE];
+  size_t order[MAX_WRITE_SIZE];
+}Lock_Set;
+
+/// Sorts the indexes of the keys by stripe with a stable radix sort, one
+/// byte of the stripe index at a time. Keys are never moved.
+/// @param num_pairs Number of keys (at most MAX_WRITE_SIZE).
+/// @param key_stripes Stripe of each key.
+/// @param order Filled with the sorted indexes.
+static void sort_by_stripe(size_t num_pairs, const size_t key_stripes[], size_t order[]){
+  size_t buffer[MAX_WRITE_SIZE];
+  size_t *from = order, *to = buffer;
+
   for(size_t i = 0; i < num_pairs; i++){
-    pthread_rwlock_wrlock(&kvs_table->lockTable[hash(keys[i])]);
+    order[i] = i;
   }
+  for(size_t shift = 0; (kvs_table->num_stripes - 1) >> shift != 0; shift += 8){
+    size_t counts[256 + 1] = {0};
+
+    for(size_t i = 0; i < num_pairs; i++){
+      counts[((key_stripes[from[i]] >> shift) & 255) + 1]++;
+    }
+    for(size_t i = 1; i <= 256; i++){
+      counts[i] += counts[i - 1];
+    }
+    for(size_t i = 0; i < num_pairs; i++){
+      to[counts[(key_stripes[from[i]] >> shift) & 255]++] = from[i];
+    }
+    size_t *aux = from;
+    from = to;
+    to = aux;
+  }
+  if(from != order) memcpy(order, from, num_pairs * sizeof(size_t));
 }
 
-/// Locks all of the entries on the KVS hash table, with the given keys, for reading.
-/// @param num_pairs Number of keys received.
-/// @param keys Array with entries that need to be blocked.
-void rdlock_table_entries(size_t num_pairs, char keys[][MAX_STRING_SIZE]){
+/// Collects the distinct stripes of the keys.
+/// @param set Lock set to fill.
+/// @param num_pairs Number of keys received (at most MAX_WRITE_SIZE).
+/// @param keys Pointers to the keys.
+static void lock_set_build(Lock_Set *set, size_t num_pairs, char *keys[]){
+  size_t key_stripes[MAX_WRITE_SIZE];
+
+  set->count = 0;
+  set->write = 0;
   for(size_t i = 0; i < num_pairs; i++){
-    pthread_rwlock_rdlock(&kvs_table->lockTable[hash(keys[i])]);
+    key_stripes[i] = stripe_index(kvs_table, keys[i]);
+  }
+  sort_by_stripe(num_pairs, key_stripes, set->order);
+  for(size_t i = 0; i < num_pairs; i++){
+    size_t stripe = key_stripes[set->order[i]];
+    if(set->count == 0 || set->stripes[set->count - 1] != stripe)
+      set->stripes[set->count++] = stripe;
   }
 }
 
-/// Unlocks all of the entries on the KVS hash table, with the given keys.
-/// @param num_pairs Number of keys received.
-/// @param keys Array with entries that need to be unlocked.
-void unlock_table_entries(size_t num_pairs, char keys[][MAX_STRING_SIZE]){
-  for(size_t i = 0; i < num_pairs; i++){
-    pthread_rwlock_unlock(&kvs_table->lockTable[hash(keys[i])]);
+/// Locks every stripe of the set, in order.
+/// @param set Lock set.
+/// @param write Whether the stripes are locked for writing.
+static void lock_set_acquire(Lock_Set *set, int write){
+  set->write = write;
+  for(size_t i = 0; i < set->count; i++){
+    if(write) stripe_write_lock(kvs_table, set->stripes[i]);
+    else pthread_rwlock_rdlock(stripe_lock(kvs_table, set->stripes[i]));
   }
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+/// Unlocks every stripe of the set.
+/// @param set Lock set locked with lock_set_acquire.
+static void lock_set_release(Lock_Set *set){
+  for(size_t i = 0; i < set->count; i++){
+    if(set->write) stripe_write_unlock(kvs_table, set->stripes[i]);
+    else pthread_rwlock_unlock(stripe_lock(kvs_table, set->stripes[i]));
+  }
+}
+
+/// Locks every stripe of the KVS hash table for reading.
+static void rdlock_all_entries(){
+  for (size_t i = 0; i < kvs_table->num_stripes; i++){
+    pthread_rwlock_rdlock(stripe_lock(kvs_table, i));
+  }
+}
+
+/// Unlocks every stripe of the KVS hash table.
+static void unlock_all_entries(){
+  for (size_t i = 0; i < kvs_table->num_stripes; i++){
+    pthread_rwlock_unlock(stripe_lock(kvs_table, i));
+  }
+}
+
+int kvs_write(size_t num_pairs, char *keys[], char *values[]) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  /** Sort the keys. */
-  mergeSort(keys, values, 0, num_pairs-1);
   /** Lock all of received inputs. */
-  wrlock_table_entries(num_pairs, keys);
+  Lock_Set locks;
+  lock_set_build(&locks, num_pairs, keys);
+  lock_set_acquire(&locks, 1);
 
+  /** Pairs go in stripe by stripe. A key written twice keeps the last value,
+      since keys of the same stripe keep their order. */
+  const char *logged_keys[MAX_WRITE_SIZE], *logged_values[MAX_WRITE_SIZE];
+  size_t logged = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+    size_t pair = locks.order[i];
+    if (write_pair(kvs_table, keys[pair], values[pair]) != 0) {
+      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[pair], values[pair]);
+    } else {
+      logged_keys[logged] = keys[pair];
+      logged_values[logged++] = values[pair];
     }
   }
+  /** Logged before the stripes are let go, so a key's records are in the
+      order they were applied. */
+  uint64_t lsn = 0;
+  int log_error = logged > 0 && wal_enabled() && wal_append(logged, logged_keys, logged_values, &lsn) != 0;
 
   /** Unlock all of received inputs. */
-  unlock_table_entries(num_pairs, keys);
-  return 0;
+  lock_set_release(&locks);
+  /** Grow the table if needed. */
+  rehash_step(kvs_table);
+  /** Waiting for the disk doesn't hold anyone else up. */
+  if (lsn > 0) log_error = wal_commit(lsn) != 0;
+  return log_error;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+/// Formats the output of READ.
+/// @param num_pairs Number of keys.
+/// @param keys Pointers to the keys to read, sorted.
+/// @param buffer Buffer for the output, with room for every pair.
+/// @param lockless If set, values are read without locks (the caller must
+/// be inside an epoch), otherwise the caller must hold the keys' stripes.
+/// @return Length of the output, 0 if a lock-free read ran into a resize.
+static size_t format_read(size_t num_pairs, char *keys[], char *buffer, int lockless){
+  size_t length = 0;
+
+  buffer[length++] = '[';
+  for (size_t i = 0; i < num_pairs; i++) {
+    size_t key_length = strlen(keys[i]);
+    buffer[length++] = '(';
+    memcpy(buffer + length, keys[i], key_length);
+    length += key_length;
+    buffer[length++] = ',';
+
+    /** Value goes straight into the output buffer. */
+    int value_length = lockless ? read_pair_lockless(kvs_table, keys[i], buffer + length, MAX_STRING_SIZE)
+                                : read_pair_into(kvs_table, keys[i], buffer + length, MAX_STRING_SIZE);
+    if (value_length == -2) return 0;
+    if (value_length < 0) {
+      memcpy(buffer + length, "KVSERROR", 8*sizeof(char));
+      length += 8*sizeof(char);
+    } else {
+      length += (size_t)value_length;
+    }
+    buffer[length++] = ')';
+  }
+  buffer[length++] = ']';
+  buffer[length++] = '\n';
+  return length;
+}
+
+/// Formats the output of READ without taking the stripes' locks. Writers
+/// make a stripe's version odd while they hold it, so the read only counts
+/// if every stripe had the same even version before and after it.
+/// @param num_pairs Number of keys.
+/// @param keys Pointers to the keys to read, sorted.
+/// @param locks Stripes of the keys.
+/// @param buffer Buffer for the output, with room for every pair.
+/// @return Length of the output, 0 if it has to be read with locks.
+static size_t format_read_lockless(size_t num_pairs, char *keys[], Lock_Set *locks, char *buffer){
+  size_t versions[MAX_WRITE_SIZE];
+  size_t length = 0;
+
+  for (int attempt = 0; length == 0 && attempt < LOCKLESS_READ_ATTEMPTS; attempt++) {
+    if (epoch_enter() != 0) return 0;
+
+    int stable = 1;
+    for (size_t i = 0; stable && i < locks->count; i++) {
+      versions[i] = stripe_version(kvs_table, locks->stripes[i]);
+      stable = (versions[i] & 1) == 0;
+    }
+    if (stable) length = format_read(num_pairs, keys, buffer, 1);
+
+    atomic_thread_fence(memory_order_acquire);
+    for (size_t i = 0; length > 0 && i < locks->count; i++) {
+      if (stripe_version(kvs_table, locks->stripes[i]) != versions[i])
+        length = 0;
+    }
+    epoch_exit();
+  }
+  return length;
+}
+
+int kvs_read(size_t num_pairs, char *keys[], Output_Buffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
   /** Sort the keys. */
-  qsort(keys, num_pairs, sizeof(keys[0]), compare_keys);
-  /** Lock all of received inputs. */
-  rdlock_table_entries(num_pairs, keys);
+  char *sorted[MAX_WRITE_SIZE];
+  sort_keys(num_pairs, keys, sorted);
 
-  write(fd, "[", 1*sizeof(char));
-  for (size_t i = 0; i < num_pairs; i++) {
-    // strlen("(,KVSERROR)") = 11
-    char buffer[MAX_STRING_SIZE + 11*sizeof(char) + 1];
-    char* result = read_pair(kvs_table, keys[i]);
-
-    if (result == NULL) {
-      snprintf(buffer, sizeof(buffer), "(%s,KVSERROR)", keys[i]);
-      /** strlen("(,KVSERROR)") = 11 */
-      if(write_buffer(fd, buffer, strlen(keys[i]) + 11*sizeof(char)) == -1)
-        fprintf(stderr, "Failed to write buffer on READ command.\n");
-    } else {
-      snprintf(buffer, sizeof(buffer), "(%s,%s)", keys[i], result);
-      /** strlen("(,)") = 3. */
-      if(write_buffer(fd, buffer,  strlen(keys[i]) + strlen(result) + 3*sizeof(char)) == -1)
-        fprintf(stderr, "Failed to write buffer on READ command.\n");
-    }
-    free(result);
+  /** Whole output of the command, strlen("(,KVSERROR)") = 11 and strlen("[]\n") = 3. */
+  char *buffer = output_reserve(out, num_pairs * (2*MAX_STRING_SIZE + 11*sizeof(char)) + 3*sizeof(char));
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to write buffer on READ command.\n");
+    return 0;
   }
-  write(fd, "]\n", 2*sizeof(char));
+  Lock_Set locks;
+  lock_set_build(&locks, num_pairs, keys);
+  size_t length = format_read_lockless(num_pairs, sorted, &locks, buffer);
 
-  /** Unlock all of received inputs. */
-  unlock_table_entries(num_pairs, keys);
+  /** Writers or a resize kept getting in the way. */
+  if (length == 0) {
+    lock_set_acquire(&locks, 0);
+    length = format_read(num_pairs, sorted, buffer, 0);
+    lock_set_release(&locks);
+  }
+
+  output_commit(out, length);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_delete(size_t num_pairs, char *keys[], Output_Buffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
@@ -241,58 +337,148 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
   int aux = 0;
   
   /** Sort the keys. */
-  qsort(keys, num_pairs, sizeof(keys[0]), compare_keys);
+  char *sorted[MAX_WRITE_SIZE];
+  sort_keys(num_pairs, keys, sorted);
   
   /** Lock all of received inputs. */
-  wrlock_table_entries(num_pairs, keys);
+  Lock_Set locks;
+  lock_set_build(&locks, num_pairs, keys);
+  lock_set_acquire(&locks, 1);
 
+  const char *logged_keys[MAX_WRITE_SIZE];
+  size_t logged = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (delete_pair(kvs_table, sorted[i]) == 0) {
+      logged_keys[logged++] = sorted[i];
+    } else {
       if (!aux) {
-        write(fd, "[", 1*sizeof(char));
+        output_append(out, "[", 1*sizeof(char));
         aux = 1;
       }
       /** strlen("(,KVSMISSING)") = 13.*/
-      char buffer[strlen(keys[i]) + 13*sizeof(char) + 1];
-      snprintf(buffer, sizeof(buffer), "(%s,KVSMISSING)", keys[i]);
-      write_buffer(fd, buffer, sizeof(buffer) - 1);
+      char buffer[strlen(sorted[i]) + 13*sizeof(char) + 1];
+      snprintf(buffer, sizeof(buffer), "(%s,KVSMISSING)", sorted[i]);
+      output_append(out, buffer, sizeof(buffer) - 1);
     }
   }
   if (aux) {
-    write(fd, "]\n", 2*sizeof(char));
+    output_append(out, "]\n", 2*sizeof(char));
   }
+  uint64_t lsn = 0;
+  int log_error = logged > 0 && wal_enabled() && wal_append(logged, logged_keys, NULL, &lsn) != 0;
 
   /** Unlock all of received inputs. */
-  unlock_table_entries(num_pairs, keys);
-  return 0;
+  lock_set_release(&locks);
+  /** Keep moving buckets if the table is being resized. */
+  rehash_step(kvs_table);
+  if (lsn > 0) log_error = wal_commit(lsn) != 0;
+  return log_error;
 }
 
-void kvs_show(int fd) {
-  /** Lock the hashtable to read. */
-  for (size_t i = 0; i < TABLE_SIZE; i++){
-    pthread_rwlock_rdlock(&kvs_table->lockTable[i]);
-  }
-
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-      char* key = keyNode->key;
-      char* value = keyNode->value;
-      /** strlen("(, )\n") = 5. */
-      char buffer[2*MAX_STRING_SIZE + 5 *sizeof(char) + 1];
-      if(snprintf(buffer, sizeof(buffer), "(%s, %s)\n", key, value) == -1){
-        fprintf(stderr, "Error alocating memory on SHOW command.\n");
-        continue;
-      }
-      write_buffer(fd, buffer,  strlen(key) + strlen(value) + 5 *sizeof(char));
-      keyNode = keyNode->next; // Move to the next node
-    }
+/// Formats a pair straight into the output buffer given in arg.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @param arg Pointer to the Output_Buffer.
+static void format_pair(const char *key, const char *value, void *arg){
+  Output_Buffer *out = (Output_Buffer *)arg;
+  size_t key_length = strlen(key);
+  size_t value_length = strlen(value);
+
+  /** strlen("(, )\n") = 5. */
+  char *buffer = output_reserve(out, key_length + value_length + 5*sizeof(char));
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to write buffer on SHOW command.\n");
+    return;
   }
+  char *start = buffer;
+  *buffer++ = '(';
+  memcpy(buffer, key, key_length);
+  buffer += key_length;
+  *buffer++ = ',';
+  *buffer++ = ' ';
+  memcpy(buffer, value, value_length);
+  buffer += value_length;
+  *buffer++ = ')';
+  *buffer++ = '\n';
+  output_commit(out, (size_t)(buffer - start));
+}
+
+/// Formats a node's pair into the output buffer given in arg.
+/// @param keyNode Node of the pair.
+/// @param arg Pointer to the Output_Buffer.
+static void show_pair(KeyNode *keyNode, void *arg){
+  format_pair(keyNode->key, keyNode->value, arg);
+}
+
+void kvs_show(Output_Buffer *out) {
+  /** Lock the hashtable to read. */
+  rdlock_all_entries();
+
+  foreach_key(kvs_table, show_pair, out);
 
   /** Unlock the hashtable. */
-  for (size_t i = 0; i < TABLE_SIZE; i++){
-    pthread_rwlock_unlock(&kvs_table->lockTable[i]);
+  unlock_all_entries();
+}
+
+/// Range of keys SCAN and PREFIX go through, written as SHOW would.
+typedef struct Scan{
+  Output_Buffer *out;
+  const char *end;
+  const char *prefix;
+  size_t prefix_length;
+}Scan;
+
+/// Formats a pair of the range given in arg into its SHOW buffer.
+/// @param keyNode Node of the pair.
+/// @param arg Pointer to the Scan.
+/// @return 1 once the pair is past the range, 0 otherwise.
+static int scan_pair(KeyNode *keyNode, void *arg){
+  Scan *scan = (Scan *)arg;
+
+  if (scan->end != NULL && strcmp(keyNode->key, scan->end) > 0) return 1;
+  if (scan->prefix != NULL && strncmp(keyNode->key, scan->prefix, scan->prefix_length) != 0) return 1;
+  show_pair(keyNode, scan->out);
+  return 0;
+}
+
+/// Writes, in key order, the pairs of a range.
+/// @param start Smallest key of the range.
+/// @param scan Rest of the range and where to write it.
+/// @return 0 if successful, 1 otherwise.
+static int scan_keys(const char *start, Scan *scan){
+  /** Keys can't come and go while every stripe is held. */
+  rdlock_all_entries();
+  int error = foreach_key_from(kvs_table, start, scan_pair, scan);
+  unlock_all_entries();
+  return error;
+}
+
+int kvs_scan(const char *start, const char *end, Output_Buffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  Scan scan;
+  scan.out = out;
+  scan.end = end[0] != '\0' ? end : NULL;
+  scan.prefix = NULL;
+
+  return scan_keys(start, &scan);
+}
+
+int kvs_prefix(const char *prefix, Output_Buffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
+  Scan scan;
+  scan.out = out;
+  scan.end = NULL;
+  scan.prefix = prefix;
+  scan.prefix_length = strlen(prefix);
+
+  /** Keys with the prefix come right after it. */
+  return scan_keys(prefix, &scan);
 }
 
 /// Creates the path for a backup file and opens it.
@@ -326,135 +512,522 @@ int create_backup_file(char file_name[], size_t backup_number){
   return fd;
 }
 
-int kvs_backup(char file_name[], size_t* backups_done, size_t *backups_left, pthread_mutex_t *backup_mutex){
-  pid_t pid;
-  int status;
+/// Formats a pair of a backup into the output buffer given in arg. Keys
+/// deleted since the base of an incremental backup are written as (key).
+/// @param key Key of the pair.
+/// @param value Value of the pair, NULL if the key was deleted.
+/// @param arg Pointer to the Output_Buffer.
+static void backup_pair(const char *key, const char *value, void *arg){
+  if (value != NULL) {
+    format_pair(key, value, arg);
+    return;
+  }
+  Output_Buffer *out = (Output_Buffer *)arg;
+  size_t key_length = strlen(key);
+  /** strlen("()\n") = 3. */
+  char *buffer = output_reserve(out, key_length + 3*sizeof(char));
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to write buffer on BACKUP command.\n");
+    return;
+  }
+  buffer[0] = '(';
+  memcpy(buffer + 1, key, key_length);
+  buffer[key_length + 1] = ')';
+  buffer[key_length + 2] = '\n';
+  output_commit(out, key_length + 3);
+}
+
+/// Appends a pair of a backup to the binary snapshot given in arg.
+/// @param key Key of the pair.
+/// @param value Value of the pair, NULL if the key was deleted.
+/// @param arg Pointer to the Snapshot_Writer.
+static void binary_pair(const char *key, const char *value, void *arg){
+  if (snapshot_writer_add((Snapshot_Writer *)arg, key, value) != 0)
+    fprintf(stderr, "Failed to write buffer on BACKUP command.\n");
+}
+
+/// Backup written by a background thread from a snapshot of the KVS. since
+/// is the base of an incremental backup, NULL for a full one. With more
+/// than one segment, the stripes are split between that many threads, each
+/// writing a segment file of its own, and fd gets the manifest. next links
+/// the backups waiting for a slot.
+typedef struct Backup{
+  struct Backup *next;
+  Snapshot snapshot;
+  Snapshot *since;
+  /** Where the log stood when the snapshot was taken. */
+  Wal_Mark mark;
+  /** Whether the files are synced, so the log can be cut once they're written. */
+  int durable;
+  Backup_Format format;
+  uint64_t taken;
+  int fd;
+  size_t number;
+  size_t num_segments;
+  size_t *backups_left;
+  pthread_mutex_t *backup_mutex;
+  char file_name[];
+}Backup;
+
+/// Stripes of a backup written by one thread.
+typedef struct Backup_Segment{
+  Backup *backup;
+  size_t first, end;
+  int fd;
+  int error;
+}Backup_Segment;
+
+/** Signaled whenever a backup finishes and its slot is free again. */
+static pthread_cond_t backup_finished = PTHREAD_COND_INITIALIZER;
+/** Backups taken while every slot was busy, oldest first, guarded by the
+ *  backup mutex. They hold the slot of the backup that finishes before them. */
+static Backup *queued_head = NULL, *queued_tail = NULL;
+
+/// Frees a backup that's done and hands its slot to the oldest queued one,
+/// or gives it back if there's none.
+/// @param backup
+/// @return Backup to write next with the slot, NULL if none.
+static Backup *finish_backup(Backup *backup){
+  pthread_mutex_t *backup_mutex = backup->backup_mutex;
+  Backup *next;
 
   pthread_mutex_lock(backup_mutex);
-  /** Wait until there's backups to do. */
-  if(*backups_left == 0){
-    /** Wait until a child process finishes. */
-    wait(&status);
-    /** There's a new backup that can be done. */
-    (*backups_left)++;  
+  if ((next = queued_head) != NULL) {
+    if ((queued_head = next->next) == NULL) queued_tail = NULL;
+  }
+  else {
+    (*backup->backups_left)++;
+    pthread_cond_broadcast(&backup_finished);
   }
   pthread_mutex_unlock(backup_mutex);
+  free(backup);
+  return next;
+}
 
-  /** Lock the hashtable to read. */
-  for (size_t i = 0; i < TABLE_SIZE; i++){
-    pthread_rwlock_rdlock(&kvs_table->lockTable[i]);
+void kvs_end_backups(struct Snapshot *base){
+  if (base == NULL) return;
+  base_end(kvs_table, base);
+  free(base);
+}
+
+/// Writes the pairs of a range of stripes of a backup to a file.
+/// @param arg Pointer to the Backup_Segment.
+/// @return NULL.
+static void *write_segment(void *arg){
+  Backup_Segment *segment = (Backup_Segment *)arg;
+  Backup *backup = segment->backup;
+  Output_Buffer out;
+
+  output_init(&out, segment->fd);
+  if (backup->format != BACKUP_TEXT) {
+    Snapshot_Writer writer;
+    uint64_t flags = (backup->since != NULL ? SNAPSHOT_DELTA : 0) |
+                     (backup->format == BACKUP_COMPRESSED ? SNAPSHOT_COMPRESSED : 0);
+    snapshot_writer_init(&writer, &out, flags, backup->taken);
+    snapshot_foreach_stripes(kvs_table, &backup->snapshot, backup->since, segment->first, segment->end,
+                             binary_pair, &writer);
+    segment->error = snapshot_writer_finish(&writer);
+  }
+  else {
+    snapshot_foreach_stripes(kvs_table, &backup->snapshot, backup->since, segment->first, segment->end,
+                             backup_pair, &out);
+    segment->error = output_flush(&out);
   }
+  return NULL;
+}
 
-  /** Create a new process. */
-  pid = fork();
-  /** Problema creating a fork. */
-  if (pid < 0){
-    fprintf(stderr, "Failure creating new process for backup\n");
-    return 1;
+/// Writes a backup in segments "<job>-N.bck.<i>", one thread each, and then
+/// the manifest listing them.
+/// @param backup
+/// @return 0 if successful, 1 otherwise.
+static int write_segments(Backup *backup){
+  size_t count = backup->num_segments;
+  Backup_Segment segments[count];
+  pthread_t threads[count];
+  char paths[count][SNAPSHOT_PATH_SIZE];
+  const char *names[count];
+  size_t length = strlen(backup->file_name);
+  const char *slash = strrchr(backup->file_name, '/');
+  size_t directory = slash != NULL ? (size_t)(slash - backup->file_name + 1) : 0;
+  int error = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    segments[i].backup = backup;
+    segments[i].first = kvs_table->num_stripes * i / count;
+    segments[i].end = kvs_table->num_stripes * (i + 1) / count;
+    segments[i].error = 0;
+    snprintf(paths[i], SNAPSHOT_PATH_SIZE, "%.*s-%zu.bck.%zu", (int)(length - 4), backup->file_name, backup->number, i);
+    names[i] = paths[i] + directory;
+    segments[i].fd = open(paths[i], O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    error |= segments[i].fd < 0;
+  }
+
+  size_t started = 0;
+  while (!error && started + 1 < count &&
+         pthread_create(&threads[started], NULL, write_segment, &segments[started]) == 0)
+    started++;
+  /** Whatever didn't get its own thread is written here. */
+  for (size_t i = started; !error && i < count; i++)
+    write_segment(&segments[i]);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  for (size_t i = 0; i < count; i++) {
+    error |= segments[i].error;
+    /** Their directory is synced along with the manifest. */
+    if (!error && backup->durable) error = fsync(segments[i].fd) != 0;
+    if (segments[i].fd >= 0) close(segments[i].fd);
   }
-  /** Child. */
-  else if(pid == 0){
-    int fd = create_backup_file(file_name, ++(*backups_done));
-    /** Problem opening the backup file. */
-    if(fd < 0){
-      fprintf(stderr, "Failure creating backup %zd for file \"%s\"\n", *backups_done, file_name);
-      _exit(EXIT_FAILURE);
+
+  /** The manifest only lists segments once they're all there. */
+  return error || snapshot_manifest_write(backup->fd, names, count) != 0;
+}
+
+/// Writes a backup and frees it, then the queued ones the slot goes to.
+/// @param arg Pointer to the Backup.
+/// @return NULL.
+static void *write_backup(void *arg){
+  for (Backup *backup = (Backup *)arg; backup != NULL; backup = finish_backup(backup)) {
+    int error;
+    if (backup->num_segments > 1) {
+      error = write_segments(backup);
+    }
+    else {
+      Backup_Segment segment = {backup, 0, kvs_table->num_stripes, backup->fd, 0};
+      write_segment(&segment);
+      error = segment.error;
     }
-    /** Copy info of KVS. */
-    kvs_show(fd);
-    close(fd);
-    /** Exit out of child process. */
-    _exit(EXIT_SUCCESS);
-  }
-  /** Parent. */
-  else{
-    /** Unlock the hashtable. */
-    for (size_t i = 0; i < TABLE_SIZE; i++){
-      pthread_rwlock_unlock(&kvs_table->lockTable[i]);
+    if (error == 0 && backup->durable) {
+      char path[SNAPSHOT_PATH_SIZE];
+      snprintf(path, sizeof(path), "%.*s-%zu.bck", (int)(strlen(backup->file_name) - 4), backup->file_name,
+               backup->number);
+      error = snapshot_file_sync(backup->fd, path);
     }
-    pthread_mutex_lock(backup_mutex);
-    (*backups_left)--;
-    pthread_mutex_unlock(backup_mutex);
-    (*backups_done)++;
+    if (error != 0)
+      fprintf(stderr, "Failed to write backup %zd for file \"%s\"\n", backup->number, backup->file_name);
+    /** Once it's on disk, a restart takes it and only needs the log after it. */
+    wal_release(&backup->mark, error == 0 && backup->durable);
+    snapshot_end(kvs_table, &backup->snapshot);
+    /** The job's base already moved on to this backup's snapshot. */
+    kvs_end_backups(backup->since);
+    close(backup->fd);
+  }
+  return NULL;
+}
+
+/** When the last backup's snapshot was taken, only touched by mark_log. */
+static uint64_t last_taken = 0;
+
+/// Marks the log where a backup's snapshot is taken and notes when it was.
+/// Backups call it one at a time, holding every stripe, so a restart that
+/// takes the backup taken last also takes the one marked last (the log may
+/// already be cut there). taken never goes back, even if the clock does.
+/// @param arg Pointer to the Backup.
+static void mark_log(void *arg){
+  Backup *backup = (Backup *)arg;
+  struct timespec now;
+
+  wal_mark(&backup->mark);
+  clock_gettime(CLOCK_REALTIME, &now);
+  backup->taken = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+  if (backup->taken <= last_taken) backup->taken = last_taken + 1;
+  last_taken = backup->taken;
+}
+
+int kvs_backup(char file_name[], size_t* backups_done, size_t *backups_left, pthread_mutex_t *backup_mutex,
+               struct Snapshot **base, Backup_Format format, size_t segments){
+  size_t length = strlen(file_name);
+  Backup *backup = malloc(sizeof(Backup) + length + 1);
+  if (backup == NULL) {
+    fprintf(stderr, "Failed to allocate memory for backup.\n");
+    return 1;
+  }
+  memcpy(backup->file_name, file_name, length + 1);
+  backup->next = NULL;
+  backup->number = ++(*backups_done);
+  backup->backups_left = backups_left;
+  backup->backup_mutex = backup_mutex;
+  backup->format = format;
+  /** Text backups aren't restored from, the log must keep what they hold. */
+  backup->durable = wal_enabled() && format != BACKUP_TEXT;
+  /** Every segment gets at least a stripe. */
+  if (segments > kvs_table->num_stripes) segments = kvs_table->num_stripes;
+  if (segments > SNAPSHOT_MAX_SEGMENTS) segments = SNAPSHOT_MAX_SEGMENTS;
+  backup->num_segments = segments;
+
+  backup->fd = create_backup_file(file_name, backup->number);
+  /** Problem opening the backup file. */
+  if(backup->fd < 0){
+    fprintf(stderr, "Failure creating backup %zd for file \"%s\"\n", backup->number, file_name);
+    free(backup);
+    return 1;
+  }
+
+  /** Incremental backups only write what changed since the job's last one,
+   *  the first one (or one without a base) is full. */
+  Snapshot *new_base = NULL;
+  if (base != NULL && (new_base = malloc(sizeof(Snapshot))) == NULL)
+    fprintf(stderr, "Failed to allocate base of backup %zd, the next one will be full.\n", backup->number);
+  backup->since = base != NULL ? *base : NULL;
+  if (base != NULL) *base = new_base;
+
+  /** Only the snapshot is taken here, even without a free slot: the job
+   *  goes on and the backup waits in the queue. */
+  snapshot_begin(kvs_table, &backup->snapshot, new_base, mark_log, backup);
+
+  pthread_mutex_lock(backup_mutex);
+  int start = *backups_left > 0;
+  if (start) (*backups_left)--;
+  else if (queued_tail != NULL) queued_tail = queued_tail->next = backup;
+  else queued_head = queued_tail = backup;
+  pthread_mutex_unlock(backup_mutex);
+  if (!start) return 0;
+
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, write_backup, backup) == 0){
+    pthread_detach(thread);
     return 0;
-  }    
+  }
+  /** Without a thread the job writes it (and whatever got queued) itself. */
+  fprintf(stderr, "Failure creating new thread for backup %zd, writing it now\n", backup->number);
+  write_backup(backup);
+  return 0;
 }
 
-int subscribe_key(const char* key, const int notif_fd){
-  int index = hash(key);
-  KeyNode* keyNode = kvs_table->table[index];
+void kvs_wait_backups(size_t max_backups, size_t *backups_left, pthread_mutex_t *backup_mutex){
+  pthread_mutex_lock(backup_mutex);
+  while(*backups_left < max_backups){
+    pthread_cond_wait(&backup_finished, backup_mutex);
+  }
+  pthread_mutex_unlock(backup_mutex);
+}
 
-  while (keyNode != NULL){
-    if (strcmp(key, keyNode->key) == 0){
-      pthread_rwlock_wrlock(&keyNode->client_list->lockList); 
-      addClientId(keyNode->client_list, notif_fd);
-      pthread_rwlock_unlock(&keyNode->client_list->lockList);
-      return 0;
-      }
-      keyNode = keyNode->next;
-    }
+/// Records of a snapshot between two offsets, restored by one thread.
+typedef struct Restore_Chunk{
+  const Snapshot_Map *map;
+  size_t start, end;
+  int error;
+}Restore_Chunk;
+
+/// Applies a record of a snapshot to the KVS, holding its key's stripe.
+/// @param record
+/// @return 0 if successful, 1 otherwise.
+static int restore_record(const Snapshot_Record *record){
+  char key[MAX_STRING_SIZE + 1], value[MAX_STRING_SIZE + 1];
 
+  if (record->key_length == 0 || record->key_length > MAX_STRING_SIZE || record->value_length > MAX_STRING_SIZE)
     return 1;
+  memcpy(key, record->key, record->key_length);
+  key[record->key_length] = '\0';
+  if (record->value != NULL) {
+    memcpy(value, record->value, record->value_length);
+    value[record->value_length] = '\0';
+  }
+
+  size_t stripe = stripe_index(kvs_table, key);
+  int result = 0;
+  stripe_write_lock(kvs_table, stripe);
+  if (record->value != NULL) result = write_pair(kvs_table, key, value);
+  else delete_pair(kvs_table, key);
+  stripe_write_unlock(kvs_table, stripe);
+  /** Keep moving buckets if the table is being resized. */
+  rehash_step(kvs_table);
+  return result;
 }
 
-int unsubscribe_key(const char* key, const int notif_fd){
-  int index = hash(key), result;
-  KeyNode* keyNode = kvs_table->table[index];
-
-  while (keyNode != NULL){
-    if (strcmp(key, keyNode->key) == 0){
-      pthread_rwlock_wrlock(&keyNode->client_list->lockList); 
-      result = removeClientId(keyNode->client_list, notif_fd);
-      pthread_rwlock_unlock(&keyNode->client_list->lockList);
-      return result;
-      }
+/// Restores the records of a chunk.
+/// @param arg Pointer to the Restore_Chunk.
+/// @return NULL.
+static void *restore_chunk(void *arg){
+  Restore_Chunk *chunk = (Restore_Chunk *)arg;
+  Snapshot_Record record;
+
+  for (size_t offset = chunk->start; offset < chunk->end && !chunk->error;) {
+    offset = snapshot_map_record(chunk->map, offset, &record);
+    chunk->error = offset == 0 || restore_record(&record) != 0;
+  }
+  return NULL;
+}
+
+/// Loads a binary snapshot file into the KVS. A full one is split into
+/// chunks restored in parallel (its keys are all different); a delta is
+/// applied in order, since a deleted key may be written again further on.
+/// @param path Path of the snapshot.
+/// @param num_threads Number of threads to restore with.
+/// @return 0 if successful, 1 otherwise.
+static int load_snapshot_file(const char *path, size_t num_threads){
+  Snapshot_Map map;
+  if (snapshot_map_open(path, &map, num_threads) != 0) return 1;
+
+  if ((map.flags & SNAPSHOT_DELTA) || num_threads == 0) num_threads = 1;
+  if (num_threads > map.num_records) num_threads = map.num_records > 0 ? map.num_records : 1;
+  Restore_Chunk chunks[num_threads];
+  pthread_t threads[num_threads];
+
+  /** Only the lengths are read to find where each chunk starts. */
+  Snapshot_Record record;
+  size_t offset = 0;
+  int error = 0;
+  for (size_t i = 0, n = 0; i < num_threads; i++) {
+    chunks[i].map = &map;
+    chunks[i].start = offset;
+    chunks[i].error = 0;
+    for (size_t last = map.num_records * (i + 1) / num_threads; !error && n < last; n++)
+      error = (offset = snapshot_map_record(&map, offset, &record)) == 0;
+    chunks[i].end = offset;
+  }
+  error = error || offset != map.records_size;
 
-    keyNode = keyNode->next;
+  size_t started = 0;
+  while (!error && started + 1 < num_threads &&
+         pthread_create(&threads[started], NULL, restore_chunk, &chunks[started]) == 0)
+    started++;
+  /** Whatever didn't get its own thread is restored here. */
+  for (size_t i = started; !error && i < num_threads; i++)
+    restore_chunk(&chunks[i]);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  for (size_t i = 0; i < num_threads; i++)
+    error |= chunks[i].error;
+
+  snapshot_map_close(&map);
+  if (error) fprintf(stderr, "Failed to restore snapshot \"%s\"\n", path);
+  return error;
+}
+
+/// Loads a binary snapshot into the KVS, segment by segment if it was
+/// written in segments.
+/// @param path Path of the snapshot or its manifest.
+/// @param num_threads Number of threads to restore with.
+/// @return 0 if successful, 1 otherwise.
+static int load_snapshot(const char *path, size_t num_threads){
+  char segments[SNAPSHOT_MAX_SEGMENTS][SNAPSHOT_PATH_SIZE];
+  size_t count;
+
+  if (snapshot_manifest_read(path, segments, &count) != 0) return load_snapshot_file(path, num_threads);
+  /** Segments don't share keys, deltas included, so their order doesn't matter. */
+  for (size_t i = 0; i < count; i++) {
+    if (load_snapshot_file(segments[i], num_threads) != 0) return 1;
+  }
+  return 0;
+}
+
+/// Finds the binary snapshot of a directory that was taken last.
+/// @param directory Path of the directory.
+/// @param newest Filled with the path of the snapshot.
+/// @param size Size of newest.
+/// @return 0 if one was found, 1 otherwise.
+static int find_newest_snapshot(const char *directory, char *newest, size_t size){
+  DIR *dir = opendir(directory);
+  struct dirent *entry;
+  uint64_t newest_taken = 0;
+  int found = 0;
+
+  if (dir == NULL) return 1;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t length = strlen(entry->d_name);
+    if (length <= 4 || strcmp(entry->d_name + length - 4, ".bck") != 0) continue;
+
+    char path[size];
+    uint64_t flags, taken;
+    if (snprintf(path, size, "%s/%s", directory, entry->d_name) >= (int)size ||
+        snapshot_file_probe(path, &flags, &taken) != 0)
+      continue;
+    if (!found || taken > newest_taken) {
+      newest_taken = taken;
+      strcpy(newest, path);
+      found = 1;
     }
+  }
+  closedir(dir);
+  return !found;
+}
 
+int kvs_restore(const char *directory, size_t num_threads){
+  char newest[2 * MAX_JOB_FILE_NAME_SIZE];
+  /** Room for "-N.bck" after what's before the newest's number. */
+  char path[sizeof(newest) + 32];
+  uint64_t flags = 0, taken;
+
+  if (find_newest_snapshot(directory, newest, sizeof(newest)) != 0) {
+    fprintf(stderr, "No snapshot to restore from in \"%s\"\n", directory);
+    return 0;
+  }
+  snapshot_file_probe(newest, &flags, &taken);
+  if (!(flags & SNAPSHOT_DELTA)) return load_snapshot(newest, num_threads);
+
+  /** A delta "<job>-N.bck" goes on top of the job's last full backup before
+   *  it, and the deltas in between. */
+  char *dash = strrchr(newest, '-');
+  size_t number = dash != NULL ? (size_t)strtoul(dash + 1, NULL, 10) : 0;
+  if (dash != NULL) *dash = '\0';
+  size_t first = number;
+  for (; first > 0; first--) {
+    snprintf(path, sizeof(path), "%s-%zu.bck", newest, first);
+    if (snapshot_file_probe(path, &flags, &taken) != 0) first = 1;
+    else if (!(flags & SNAPSHOT_DELTA)) break;
+  }
+  if (first == 0) {
+    fprintf(stderr, "No full snapshot to apply \"%s-%zu.bck\" to\n", newest, number);
     return 1;
+  }
+  for (size_t i = first; i <= number; i++) {
+    snprintf(path, sizeof(path), "%s-%zu.bck", newest, i);
+    if (load_snapshot(path, num_threads) != 0) return 1;
+  }
+  return 0;
 }
 
-void delete_client_subscriptions(int notif_fd){
-  for(int i = 0; i < TABLE_SIZE; i++){
-    pthread_rwlock_wrlock(&kvs_table->lockTable[i]);
-    KeyNode * keyNode = kvs_table->table[i];
-    while(keyNode != NULL){
-      List *client_list = keyNode->client_list;
-      Node *aux = client_list->head;
-      /** Remove if list isn't empty. */
-      if(aux != NULL){
-        /** Remove head edge case. */
-        if(aux->notif_fd == notif_fd){
-          Node *temp = aux;
-          client_list->head = aux->next;
-          free(temp);
-          continue;
-        }
-        while(aux->next != NULL){
-          if(aux->next->notif_fd == notif_fd){
-            Node *temp = aux->next;
-            aux->next = aux->next->next;
-            free(temp);
-          }
-          aux = aux->next;
-        }
-      }
-      keyNode = keyNode->next;
-    }
-    pthread_rwlock_unlock(&kvs_table->lockTable[i]);
+/// Applies a record of the log to the KVS.
+/// @param record
+/// @param arg Unused.
+/// @return 0 if successful, 1 otherwise.
+static int replay_record(const Snapshot_Record *record, void *arg){
+  (void)arg;
+  return restore_record(record);
+}
+
+int kvs_replay_log(const char *path){
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
+  return wal_replay(path, replay_record, NULL);
 }
 
-void delete_all_subscriptions(){
-  for(int i = 0; i < TABLE_SIZE; i++){
-    pthread_rwlock_wrlock(&kvs_table->lockTable[i]);
-    KeyNode * keyNode = kvs_table->table[i];
-    while(keyNode != NULL){
-      freeClientNodes(keyNode->client_list);
-      keyNode = keyNode->next;
-    }
-    pthread_rwlock_unlock(&kvs_table->lockTable[i]);
+int subscribe_key(const char* key, const int notif_fd, const int conflate){
+  pthread_rwlock_t *lock = stripe_lock(kvs_table, stripe_index(kvs_table, key));
+  int result = 1;
+
+  pthread_rwlock_rdlock(lock);
+  KeyNode* keyNode = find_key(kvs_table, key);
+  if (keyNode != NULL){
+    pthread_rwlock_wrlock(&keyNode->subscribers.lock); 
+    result = addClientId(&keyNode->subscribers, notif_fd, conflate);
+    pthread_rwlock_unlock(&keyNode->subscribers.lock);
+  }
+  pthread_rwlock_unlock(lock);
+  return result;
+}
+
+int unsubscribe_key(const char* key, const int notif_fd){
+  pthread_rwlock_t *lock = stripe_lock(kvs_table, stripe_index(kvs_table, key));
+  int result = 1;
+
+  pthread_rwlock_rdlock(lock);
+  KeyNode* keyNode = find_key(kvs_table, key);
+  if (keyNode != NULL){
+    pthread_rwlock_wrlock(&keyNode->subscribers.lock); 
+    result = removeClientId(&keyNode->subscribers, notif_fd);
+    pthread_rwlock_unlock(&keyNode->subscribers.lock);
+  }
+  pthread_rwlock_unlock(lock);
+  return result;
+}
+
+void delete_client_subscriptions(int notif_fd, char keys[][MAX_STRING_SIZE + 1], size_t num_keys){
+  /** Only the keys the client subscribed to are touched. */
+  for(size_t i = 0; i < num_keys; i++){
+    unsubscribe_key(keys[i], notif_fd);
   }
 }
 
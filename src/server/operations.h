@@ -2,42 +2,33 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <pthread.h>
 
-/// Compares two keys.
+#include "constants.h"
+#include "io.h"
+
+/** Snapshot of the KVS, see kvs.h. */
+struct Snapshot;
+
+/// How backups are written.
+typedef enum Backup_Format{
+  BACKUP_TEXT,
+  /** Binary snapshots, see snapshot_file.h. */
+  BACKUP_BINARY,
+  /** Binary snapshots with their records in compressed blocks. */
+  BACKUP_COMPRESSED
+}Backup_Format;
+
+/// Compares two keys, given by pointers to them.
 /// @param key1 
 /// @param key2 
 /// @return 0 if keys are equal.
 int compare_keys(const void* key1, const void* key2);
 
-/// Merges two arrays.
-/// @param keys
-/// @param values
-/// @param l
-/// @param m
-/// @param r
-void merge(char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t l, size_t m, size_t r);
-
-/// l is for left index and r is right index of the
-/// sub-array of arr to be sorted.
-/// @param keys
-/// @param values
-/// @param l 
-/// @param r
-void mergeSort(char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t l, size_t r);
-
-/// Lock all table entries with a write lock.
-/// @param num_pairs 
-/// @param keys
-void wrlock_table_entries(size_t num_pairs, char keys[][MAX_STRING_SIZE]);
-
-/// Lock all table entries with a read lock.
-/// @param num_pairs 
-/// @param keys
-void rdlock_table_entries(size_t num_pairs, char keys[][MAX_STRING_SIZE]);
-
 /// Initializes the KVS state.
+/// @param num_stripes Number of lock stripes of the hash table (0 for the default).
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(size_t num_stripes);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
@@ -47,26 +38,43 @@ int kvs_terminate();
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
-/// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+/// @return 0 if the pairs were written (and logged, with a log) successfully,
+/// 1 otherwise.
+int kvs_write(size_t num_pairs, char *keys[], char *values[]);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Output buffer of the job.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, char *keys[], Output_Buffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write 
-/// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+/// @param out Output buffer of the job.
+/// @return 0 if the pairs were deleted (and logged, with a log)
+/// successfully, 1 otherwise.
+int kvs_delete(size_t num_pairs, char *keys[], Output_Buffer *out);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fd);
+/// @param out Output buffer to write to.
+void kvs_show(Output_Buffer *out);
+
+/// Writes, in key order and as SHOW does, the pairs with keys between start
+/// and end (both included).
+/// @param start Smallest key, "" for no limit.
+/// @param end Biggest key, "" for no limit.
+/// @param out Output buffer of the job.
+/// @return 0 if successful, 1 otherwise.
+int kvs_scan(const char *start, const char *end, Output_Buffer *out);
+
+/// Writes, in key order and as SHOW does, the pairs with keys starting with
+/// prefix.
+/// @param prefix Prefix of the keys.
+/// @param out Output buffer of the job.
+/// @return 0 if successful, 1 otherwise.
+int kvs_prefix(const char *prefix, Output_Buffer *out);
 
 /// Opens a backup file and returns it's file descriptor.
 /// @param file_name Name of the .job file.
@@ -75,19 +83,59 @@ void kvs_show(int fd);
 int create_backup_file(char file_name[], size_t backup_number);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
+/// backup file. The state is a snapshot taken right away; a background
+/// thread writes it while jobs keep going. If max_backups are already
+/// being written, it's queued and written once one of them finishes,
+/// without holding up the job.
 /// @param file_name File of the .job file that is executing a backup.
 /// @param backups_done pointer to number of backups the file has.
 /// @param backups_left pointer to number of backups left the KVS can do at 
 /// the moment.
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(char file_name[], size_t* backups_done, size_t *backups_left, pthread_mutex_t *backup_mutex);
+/// @param backup_mutex mutex guarding backups_left.
+/// @param base NULL for full backups. Otherwise the job's base for
+/// incremental ones (NULL before its first backup, which is full): only the
+/// pairs written since it are stored, and the keys deleted since it as
+/// (key). It's replaced by this backup's.
+/// @param format Format of the backup file.
+/// @param segments Number of threads writing the backup. With more than
+/// one, each writes its share of the stripes to "<job>-N.bck.<i>" and the
+/// backup file is a manifest listing them.
+/// @return 0 if the backup was started, 1 otherwise.
+int kvs_backup(char file_name[], size_t* backups_done, size_t *backups_left, pthread_mutex_t *backup_mutex,
+               struct Snapshot **base, Backup_Format format, size_t segments);
+
+/// Loads the newest binary snapshot of a directory into the KVS, on top of
+/// the full one before it if it's a delta. Must be called before any job
+/// starts.
+/// @param directory Directory with the .job files and their backups.
+/// @param num_threads Number of threads to build the table with.
+/// @return 0 if successful (or there was no snapshot), 1 otherwise.
+int kvs_restore(const char *directory, size_t num_threads);
+
+/// Applies the writes and deletes of a log (see wal.h) to the KVS, on top
+/// of what was restored. Must be called before any job starts.
+/// @param path Path of the log.
+/// @return 0 if successful (or there was no log), 1 otherwise.
+int kvs_replay_log(const char *path);
+
+/// Stops tracking changes for a job's incremental backups.
+/// @param base Base of the job, may be NULL.
+void kvs_end_backups(struct Snapshot *base);
+
+/// Waits until every backup, written or queued, is done.
+/// @param max_backups Maximum number of backups at once.
+/// @param backups_left pointer to number of backups left the KVS can do at
+/// the moment.
+/// @param backup_mutex mutex guarding backups_left.
+void kvs_wait_backups(size_t max_backups, size_t *backups_left, pthread_mutex_t *backup_mutex);
 
 /// Subscribes a client to the given key.
 /// @param key Key of the pair to be subscribed.
 /// @param notif_fd Fd of the client's notification FIFO.
+/// @param conflate If set, changes the client hasn't received yet are
+/// replaced by newer ones, so it only gets the latest value.
 /// @return 0 if successfull, 1 otherwise.
-int subscribe_key(const char* key, const int notif_fd);
+int subscribe_key(const char* key, const int notif_fd, const int conflate);
 
 /// Unsubscribes a client to the given key.
 /// @param key Key of the pair to be unsubscribed.
@@ -97,10 +145,9 @@ int unsubscribe_key(const char* key, const int notif_fd);
 
 /// Deletes every subscription of a client.
 /// @param notif_fd Fd of the client's notification FIFO.
-void delete_client_subscriptions(int notif_fd);
-
-/// Deletes every subscription on the KVS server.
-void delete_all_subscriptions();
+/// @param keys Keys the client is subscribed to.
+/// @param num_keys Number of keys.
+void delete_client_subscriptions(int notif_fd, char keys[][MAX_STRING_SIZE + 1], size_t num_keys);
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
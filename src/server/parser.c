@@ -6,51 +6,93 @@
 #include <unistd.h>
 
 #include "constants.h"
+#include "tokenizer.h"
+
+/// Reads the next character of the input, refilling the buffer if needed.
+/// @param in Input buffer.
+/// @param ch Set to the character read.
+/// @return 1 if a character was read, 0 at the end of the input.
+static int read_char(Input_Buffer *in, char *ch) {
+  if (in->position == in->length && input_fill(in) <= 0) {
+    return 0;
+  }
+  *ch = in->data[in->position++];
+  return 1;
+}
 
-static int read_string(int fd, char *buffer, size_t max) {
-  ssize_t bytes_read;
-  char ch;
+/// Reads the next characters of the input, as read() would.
+/// @param in Input buffer.
+/// @param buffer Buffer for the characters.
+/// @param count Number of characters wanted.
+/// @return Number of characters read, less than count at the end of the input.
+static size_t read_chars(Input_Buffer *in, char *buffer, size_t count) {
   size_t i = 0;
-  int value = -1;
-
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
-
-    if (bytes_read <= 0) {
-        return -1;
-    }
-
-    if (ch == ' ') {
-      return -1;
-    }
+  while (i < count && read_char(in, buffer + i)) {
+    i++;
+  }
+  return i;
+}
 
-    if (ch == ',') {
-      value = 0;
-      break;
-    }
-    else if (ch == ')') {
-      value = 1;
-      break;
-    }
-    else if (ch == ']') {
-      value = 2;
-      break;
-    }
+/// Argument list of a WRITE, READ or DELETE, tokenized where it sits on
+/// the input buffer.
+typedef struct Arguments {
+  Input_Buffer *in;
+  Tokenizer tokens;
+} Arguments;
+
+/// Makes room for a whole argument list on the input buffer and starts
+/// tokenizing it.
+/// @param args Arguments to initialize.
+/// @param in Input buffer.
+/// @param max_strings Maximum number of keys and values of the list.
+/// @param max_string_size maximum size for keys and values.
+static void start_arguments(Arguments *args, Input_Buffer *in, size_t max_strings, size_t max_string_size) {
+  /** Every string and its delimiter, the brackets and the end of the line. */
+  size_t size = max_strings * (max_string_size + 1) + 3;
+
+  args->in = in;
+  input_window(in, size < INPUT_BUFFER_SIZE ? size : INPUT_BUFFER_SIZE);
+  tokenizer_init(&args->tokens, in->data, in->length);
+}
 
-    buffer[i++] = ch;
+/// Reads a key or value up to the delimiter after it, which is replaced by
+/// a '\0' so it can be used where it is.
+/// @param args Arguments being parsed.
+/// @param string Set to the key or value.
+/// @param max maximum size for the string, with its delimiter.
+/// @return 0 if it ends on ',', 1 on ')', 2 on ']', -1 on a space, if it's
+/// too long or the input ends first.
+static int read_string(Arguments *args, char **string, size_t max) {
+  Input_Buffer *in = args->in;
+  size_t start = in->position;
+  size_t end = tokenizer_next(&args->tokens, start);
+
+  if (end - start >= max) {
+    in->position = start + max;
+    return -1;
+  }
+  if (end == in->length) {
+    in->position = end;
+    return -1;
   }
 
-  buffer[i] = '\0';
+  char ch = in->data[end];
+  in->position = end + 1;
+  if (ch == ' ') {
+    return -1;
+  }
+  in->data[end] = '\0';
+  *string = in->data + start;
 
-  return value;
+  return ch == ',' ? 0 : ch == ')' ? 1 : 2;
 }
 
-static int read_uint(int fd, unsigned int *value, char *next) {
+static int read_uint(Input_Buffer *in, unsigned int *value, char *next) {
   char buf[16];
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (read_char(in, buf + i) == 0) {
       *next = '\0';
       break;
     }
@@ -76,23 +118,28 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+static void cleanup(Input_Buffer *in) {
+  /** Skips to the next line a buffer at a time. */
+  do {
+    char *newline = memchr(in->data + in->position, '\n', in->length - in->position);
+    if (newline != NULL) {
+      in->position = (size_t)(newline - in->data) + 1;
+      return;
+    }
+  } while (input_fill(in) > 0);
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(Input_Buffer *in) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (read_chars(in, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-          cleanup(fd);
+      if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (read_chars(in, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+          cleanup(in);
           return CMD_INVALID;
         }
         return CMD_WRITE;
@@ -101,114 +148,134 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 3) != 3) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (strncmp(buf, "SCAN", 4) == 0) {
+        if (read_chars(in, buf + 4, 1) != 1 || buf[4] != ' ') {
+          cleanup(in);
+          return CMD_INVALID;
+        }
+
+        return CMD_SCAN;
+      }
+
+      if (strncmp(buf, "SHOW", 4) != 0) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      if (read_chars(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-        cleanup(fd);
+      if (read_chars(in, buf + 6, 1) != 0 && buf[6] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_BACKUP;
 
+    case 'P':
+      if (read_chars(in, buf + 1, 6) != 6 || strncmp(buf, "PREFIX ", 7) != 0) {
+        cleanup(in);
+        return CMD_INVALID;
+      }
+
+      return CMD_PREFIX;
+
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (read_chars(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_HELP;
 
     case '#':
-      cleanup(fd);
+      cleanup(in);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      cleanup(in);
       return CMD_INVALID;
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+int parse_pair(Arguments *args, char **key, char **value) {
+  if (read_string(args, key, MAX_STRING_SIZE) != 0) {
+    cleanup(args->in);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  if (read_string(args, value, MAX_STRING_SIZE) != 1) {
+    cleanup(args->in);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(Input_Buffer *in, char *keys[], char *values[], size_t max_pairs, size_t max_string_size) {
+  Arguments args;
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  start_arguments(&args, in, 2 * max_pairs, max_string_size);
+  if (read_char(in, &ch) != 1 || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || ch != '(') {
+    cleanup(in);
     return 0;
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+    if(parse_pair(&args, &keys[num_pairs], &values[num_pairs]) == 0) {
+      cleanup(in);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (read_char(in, &ch) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(in);
       return 0;
     }
 
@@ -218,36 +285,36 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   }
 
   if (num_pairs == max_pairs) {
-    cleanup(fd);
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_read_delete(Input_Buffer *in, char *keys[], size_t max_keys, size_t max_string_size) {
+  Arguments args;
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  start_arguments(&args, in, max_keys, max_string_size);
+  if (read_char(in, &ch) != 1 || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(&args, &keys[num_keys], max_string_size);
     if(output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2){
       break;
@@ -255,34 +322,63 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   if (num_keys == max_keys) {
-    cleanup(fd);
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_scan(Input_Buffer *in, char *start, char *end, size_t max_string_size) {
+  char *keys[3];
+
+  /** Exactly two keys, either of them may be empty. */
+  if (parse_read_delete(in, keys, 3, max_string_size) != 2) {
+    return 1;
+  }
+
+  strcpy(start, keys[0]);
+  strcpy(end, keys[1]);
+  return 0;
+}
+
+int parse_prefix(Input_Buffer *in, char *prefix, size_t max_string_size) {
+  size_t i = 0;
+  char ch;
+
+  while (read_char(in, &ch) == 1 && ch != '\n') {
+    if (ch == ' ' || i == max_string_size - 1) {
+      cleanup(in);
+      return 1;
+    }
+    prefix[i++] = ch;
+  }
+  prefix[i] = '\0';
+
+  return i == 0;
+}
+
+int parse_wait(Input_Buffer *in, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(in, delay, &ch) != 0) {
+    cleanup(in);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(in, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(in);
       return -1;
     }
 
@@ -290,7 +386,7 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(in);
     return -1;
   }
 }
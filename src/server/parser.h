@@ -3,12 +3,15 @@
 
 #include <stddef.h>
 #include "constants.h"
+#include "io.h"
 
 enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SCAN,
+  CMD_PREFIX,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -18,32 +21,49 @@ enum Command {
 };
 
 /// Reads a line and returns the corresponding command.
-/// @param fd File descriptor to read from.
+/// @param in Input buffer of the job to read from.
 /// @return The command read.
-enum Command get_next(int fd);
+enum Command get_next(Input_Buffer *in);
 
-/// Parses a WRITE command.
-/// @param fd File descriptor to read from.
-/// @param keys Array of keys to be written.
-/// @param values Array of values to be written.
+/// Parses a WRITE command. Keys and values are left on the input buffer,
+/// '\0' terminated, and are only valid until it's read again.
+/// @param in Input buffer of the job to read from.
+/// @param keys Set to the keys to be written.
+/// @param values Set to the values to be written.
 /// @param max_pairs number of pairs to be written.
 /// @param max_string_size maximum size for keys and values.
-/// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+/// @return Number of pairs parsed. 0 on failure.
+size_t parse_write(Input_Buffer *in, char *keys[], char *values[], size_t max_pairs, size_t max_string_size);
 
-/// Parses a READ or DELETE command.
-/// @param fd File descriptor to read from.
-/// @param keys Array of keys to be written.
+/// Parses a READ or DELETE command. Keys are left on the input buffer, as
+/// in parse_write.
+/// @param in Input buffer of the job to read from.
+/// @param keys Set to the keys to be read or deleted.
 /// @param max_keys number of keys to be iread or deleted.
 /// @param max_string_size maximum size for keys and values.
 /// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(Input_Buffer *in, char *keys[], size_t max_keys, size_t max_string_size);
+
+/// Parses a SCAN command.
+/// @param in Input buffer of the job to read from.
+/// @param start Set to the first key of the range.
+/// @param end Set to the last key of the range.
+/// @param max_string_size maximum size for keys.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_scan(Input_Buffer *in, char *start, char *end, size_t max_string_size);
+
+/// Parses a PREFIX command.
+/// @param in Input buffer of the job to read from.
+/// @param prefix Set to the prefix.
+/// @param max_string_size maximum size for the prefix.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_prefix(Input_Buffer *in, char *prefix, size_t max_string_size);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param in Input buffer of the job to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(Input_Buffer *in, unsigned int *delay, unsigned int *thread_id);
 
 #endif  // KVS_PARSER_H
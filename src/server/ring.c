@@ -0,0 +1,79 @@
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Wakes whichever side sleeps on the ring.
+/// @param ring
+static void wake(Ring *ring){
+  pthread_mutex_lock(&ring->mutex);
+  pthread_cond_broadcast(&ring->moved);
+  pthread_mutex_unlock(&ring->mutex);
+}
+
+/// Waits while the ring has as many slots pushed as given, spinning a bit
+/// before sleeping.
+/// @param ring
+/// @param waiting Flag of the side that waits, seen by the other side after
+/// it moves (both are sequentially consistent, so one of them sees the other).
+/// @param pushed Number of pushed slots it waits to change from, num_slots
+/// for the producer and 0 for the consumer.
+static void wait_while(Ring *ring, _Atomic int *waiting, size_t pushed){
+  for(int spin = 0; spin < RING_SPINS; spin++){
+    if(atomic_load(&ring->tail) - atomic_load(&ring->head) != pushed) return;
+  }
+  pthread_mutex_lock(&ring->mutex);
+  atomic_store(waiting, 1);
+  while(atomic_load(&ring->tail) - atomic_load(&ring->head) == pushed)
+    pthread_cond_wait(&ring->moved, &ring->mutex);
+  atomic_store(waiting, 0);
+  pthread_mutex_unlock(&ring->mutex);
+}
+
+int ring_init(Ring *ring, size_t num_slots, size_t slot_size){
+  if((ring->slots = malloc(num_slots * slot_size)) == NULL){
+    fprintf(stderr, "Failed to allocate memory for a ring.\n");
+    return 1;
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->consumer_waiting, 0);
+  atomic_init(&ring->producer_waiting, 0);
+  pthread_mutex_init(&ring->mutex, NULL);
+  pthread_cond_init(&ring->moved, NULL);
+  ring->num_slots = num_slots;
+  ring->slot_size = slot_size;
+  return 0;
+}
+
+void ring_destroy(Ring *ring){
+  pthread_cond_destroy(&ring->moved);
+  pthread_mutex_destroy(&ring->mutex);
+  free(ring->slots);
+}
+
+void *ring_reserve(Ring *ring){
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  if(tail - atomic_load(&ring->head) == ring->num_slots)
+    wait_while(ring, &ring->producer_waiting, ring->num_slots);
+  return ring->slots + (tail % ring->num_slots) * ring->slot_size;
+}
+
+void ring_push(Ring *ring){
+  atomic_fetch_add(&ring->tail, 1);
+  if(atomic_load(&ring->consumer_waiting)) wake(ring);
+}
+
+void *ring_peek(Ring *ring){
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  if(atomic_load(&ring->tail) == head)
+    wait_while(ring, &ring->consumer_waiting, 0);
+  return ring->slots + (head % ring->num_slots) * ring->slot_size;
+}
+
+void ring_pop(Ring *ring){
+  atomic_fetch_add(&ring->head, 1);
+  if(atomic_load(&ring->producer_waiting)) wake(ring);
+}
@@ -0,0 +1,59 @@
+#ifndef KVS_RING_H
+#define KVS_RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/** Times a full or empty ring is checked again before sleeping on it. */
+#define RING_SPINS 128
+/** Bytes between what each side writes, so they're on different cache lines. */
+#define RING_PADDING 64
+
+/// Bounded queue of fixed size slots between one producer thread and one
+/// consumer thread. Slots are filled and used in place: head and tail count
+/// the slots taken and pushed, slot number % num_slots is where a slot
+/// lives. Neither side takes a lock unless the ring is full (producer) or
+/// empty (consumer), in which case it sleeps until the other side moves.
+typedef struct Ring{
+  _Atomic size_t head;
+  char head_padding[RING_PADDING];
+  _Atomic size_t tail;
+  char tail_padding[RING_PADDING];
+  _Atomic int consumer_waiting, producer_waiting;
+  pthread_mutex_t mutex;
+  pthread_cond_t moved;
+  size_t num_slots, slot_size;
+  char *slots;
+}Ring;
+
+/// Initializes an empty ring.
+/// @param ring
+/// @param num_slots Number of slots.
+/// @param slot_size Size of each slot.
+/// @return 0 if successful, 1 otherwise.
+int ring_init(Ring *ring, size_t num_slots, size_t slot_size);
+
+/// Frees a ring's slots.
+/// @param ring
+void ring_destroy(Ring *ring);
+
+/// Waits for a free slot, for the producer to fill.
+/// @param ring
+/// @return The slot, it's only seen by the consumer once ring_push is called.
+void *ring_reserve(Ring *ring);
+
+/// Hands the slot given by ring_reserve to the consumer.
+/// @param ring
+void ring_push(Ring *ring);
+
+/// Waits for a pushed slot, for the consumer to use.
+/// @param ring
+/// @return The oldest pushed slot, it stays the consumer's until ring_pop.
+void *ring_peek(Ring *ring);
+
+/// Gives the slot given by ring_peek back to the producer.
+/// @param ring
+void ring_pop(Ring *ring);
+
+#endif // KVS_RING_H
@@ -17,6 +17,8 @@
 #include "constants.h"
 #include "server-client.h"
 #include "operations.h"
+#include "notifier.h"
+#include "kvs.h"
 
 int _SIGSUSR1_received = 0;
 
@@ -66,15 +68,132 @@ Server_data *new_server_data(){
 /// @param head Head of the list.
 /// @param resp_fd Fd of the client's response FIFO.
 /// @param notif_fd Fd of the client's notification FIFO.
-void add_client(Client_Node **head, int resp_fd, int notif_fd){
+/// @param kick_fd Fd the session's thread is told to end the session on.
+/// @param subscriptions Keys the client is subscribed to.
+void add_client(Client_Node **head, int resp_fd, int notif_fd, int kick_fd, Subscriptions *subscriptions){
   Client_Node *node = (Client_Node*)malloc(sizeof(Client_Node));
 
   node->resp_fd = resp_fd;
   node->notif_fd = notif_fd;
+  node->kick_fd = kick_fd;
+  node->subscriptions = subscriptions;
   node->next = *head;
   *head = node;
 }
 
+/// Initializes an empty Subscriptions struct.
+/// @param subscriptions
+/// @return 0 if successful, 1 otherwise.
+int init_subscriptions(Subscriptions *subscriptions){
+  subscriptions->count = 0;
+  subscriptions->capacity = 0;
+  subscriptions->keys = NULL;
+  subscriptions->slots = NULL;
+  subscriptions->num_slots = 0;
+  return pthread_mutex_init(&subscriptions->mutex, NULL) != 0;
+}
+
+/// Destroys a Subscriptions struct.
+/// @param subscriptions
+void destroy_subscriptions(Subscriptions *subscriptions){
+  free(subscriptions->keys);
+  free(subscriptions->slots);
+  pthread_mutex_destroy(&subscriptions->mutex);
+}
+
+/// Finds the slot of a key, or the free slot it would take.
+/// @param subscriptions Client's subscriptions, with at least a slot.
+/// @param key Key, at most MAX_STRING_SIZE characters.
+/// @return Index of the slot.
+static size_t find_slot(Subscriptions *subscriptions, const char *key){
+  size_t mask = subscriptions->num_slots - 1, slot = hash(key) & mask;
+
+  while(subscriptions->slots[slot] != 0 && strcmp(subscriptions->keys[subscriptions->slots[slot] - 1], key) != 0)
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+/// Doubles the room for keys, rebuilding the slots.
+/// @param subscriptions Client's subscriptions.
+/// @return 0 if successful, 1 otherwise.
+static int grow_subscriptions(Subscriptions *subscriptions){
+  size_t capacity = subscriptions->capacity == 0 ? 8 : subscriptions->capacity * 2;
+  size_t *slots = calloc(2 * capacity, sizeof(size_t));
+  char (*keys)[MAX_STRING_SIZE + 1] = realloc(subscriptions->keys, capacity * sizeof(*keys));
+
+  if(keys != NULL) subscriptions->keys = keys;
+  if(slots == NULL || keys == NULL){
+    free(slots);
+    return 1;
+  }
+  free(subscriptions->slots);
+  subscriptions->slots = slots;
+  subscriptions->num_slots = 2 * capacity;
+  subscriptions->capacity = capacity;
+  for(size_t i = 0; i < subscriptions->count; i++)
+    subscriptions->slots[find_slot(subscriptions, subscriptions->keys[i])] = i + 1;
+  return 0;
+}
+
+/// Adds a key to a client's subscriptions. Caller must hold the mutex.
+/// @param subscriptions Client's subscriptions.
+/// @param key Key the client subscribed to.
+/// @return 0 if successful, 1 otherwise.
+int add_subscription(Subscriptions *subscriptions, const char *key){
+  char copy[MAX_STRING_SIZE + 1];
+  strncpy(copy, key, MAX_STRING_SIZE);
+  copy[MAX_STRING_SIZE] = '\0';
+
+  if(subscriptions->count == subscriptions->capacity && grow_subscriptions(subscriptions) != 0) return 1;
+  size_t slot = find_slot(subscriptions, copy);
+  /** Subscribing twice to the same key is only one subscription. */
+  if(subscriptions->slots[slot] != 0) return 0;
+  memcpy(subscriptions->keys[subscriptions->count], copy, MAX_STRING_SIZE + 1);
+  subscriptions->slots[slot] = ++subscriptions->count;
+  return 0;
+}
+
+/// Removes a key from a client's subscriptions. Caller must hold the mutex.
+/// @param subscriptions Client's subscriptions.
+/// @param key Key the client unsubscribed from.
+void remove_subscription(Subscriptions *subscriptions, const char *key){
+  char copy[MAX_STRING_SIZE + 1];
+  strncpy(copy, key, MAX_STRING_SIZE);
+  copy[MAX_STRING_SIZE] = '\0';
+
+  if(subscriptions->count == 0) return;
+  size_t mask = subscriptions->num_slots - 1, hole = find_slot(subscriptions, copy);
+  size_t position = subscriptions->slots[hole];
+  if(position-- == 0) return;
+
+  /** Order doesn't matter, move the last key to its place. */
+  subscriptions->count--;
+  if(position != subscriptions->count){
+    subscriptions->slots[find_slot(subscriptions, subscriptions->keys[subscriptions->count])] = position + 1;
+    memcpy(subscriptions->keys[position], subscriptions->keys[subscriptions->count], MAX_STRING_SIZE + 1);
+  }
+  /** Pull back the keys after the hole that probed past it, so none is lost behind a free slot. */
+  for(size_t slot = (hole + 1) & mask; subscriptions->slots[slot] != 0; slot = (slot + 1) & mask){
+    size_t home = hash(subscriptions->keys[subscriptions->slots[slot] - 1]) & mask;
+    if(((slot - home) & mask) >= ((slot - hole) & mask)){
+      subscriptions->slots[hole] = subscriptions->slots[slot];
+      hole = slot;
+    }
+  }
+  subscriptions->slots[hole] = 0;
+}
+
+/// Removes every subscription of a client from the KVS.
+/// @param subscriptions Client's subscriptions.
+/// @param notif_fd Fd of the client's notification FIFO.
+void clear_subscriptions(Subscriptions *subscriptions, int notif_fd){
+  pthread_mutex_lock(&subscriptions->mutex);
+  delete_client_subscriptions(notif_fd, subscriptions->keys, subscriptions->count);
+  subscriptions->count = 0;
+  if(subscriptions->slots != NULL) memset(subscriptions->slots, 0, subscriptions->num_slots * sizeof(size_t));
+  pthread_mutex_unlock(&subscriptions->mutex);
+}
+
 /// Checks if the fd's on a Client_Node are equal to the given.
 /// @param node CLient_Node.
 /// @param resp_fd Fd.
@@ -115,15 +234,14 @@ void remove_client(Client_Node **head, int resp_fd, int notif_fd){
   }
 }
 
-/// Closes every clients fd's.
+/// Tells the thread of every session to disconnect its client. Each one
+/// removes its client itself, so its fd's aren't closed while it still
+/// uses them. Caller must hold the client list's mutex.
 /// @param head Head of the connected clients list.
-void close_all_clients(Client_Node *head){
-  while(head != NULL){
-    Client_Node *temp = head->next;
-    close(head->resp_fd);
-    close(head->notif_fd);
-    free(head);
-    head = temp;
+void kick_all_clients(Client_Node *head){
+  for(; head != NULL; head = head->next){
+    if(write_all(head->kick_fd, "k", 1) == -1)
+      fprintf(stderr, "Failure to disconnect client of fd %d.\n", head->resp_fd);
   }
 }
 
@@ -215,31 +333,65 @@ int open_pipes(int *req_fd, int *resp_fd, int *notif_fd,
 /// @param req_fd Fd of the client's request FIFO.
 /// @param resp_fd Fd of the client's response FIFO.
 /// @param notif_fd Fd of the client's notification FIFO.
+/// @param kick Pipe the session is told to end on.
+/// @param subscriptions Keys the client is subscribed to.
 /// @param server_data Server data.
 /// @param connected Pointer to int that represents the client's connection status.
-void client_disconnect(int req_fd, int resp_fd, int notif_fd, Server_data *server_data, int *connected){
+void client_disconnect(int req_fd, int resp_fd, int notif_fd, int kick[2], Subscriptions *subscriptions,
+                       Server_data *server_data, int *connected){
+  /** Leave the list while the fd's still identify this client, nobody kicks it after. */
+  pthread_mutex_lock(&server_data->client_mutex);
+  remove_client(&server_data->client_head, resp_fd, notif_fd);
+  pthread_mutex_unlock(&server_data->client_mutex);
+  clear_subscriptions(subscriptions, notif_fd);
+  /** No delivery thread may be writing to notif_fd once it's closed. */
+  notifier_remove_subscriber(notif_fd);
   close(req_fd);
   close(resp_fd);
   close(notif_fd);
+  close(kick[0]);
+  close(kick[1]);
   sem_post(&server_data->active_sessions);
-  pthread_mutex_lock(&server_data->client_mutex);
-  remove_client(&server_data->client_head, resp_fd, notif_fd);
-  pthread_mutex_unlock(&server_data->client_mutex);
   *connected = 0;
 }
 
+/// Waits for the client's next request, or for the session to be ended by
+/// the server.
+/// @param req_fd Fd of the client's request FIFO.
+/// @param kick_fd Read end of the pipe the session is told to end on.
+/// @return 1 if there's a request to read, 0 if the session must end.
+static int wait_request(int req_fd, int kick_fd){
+  fd_set fds;
+  int max_fd = req_fd > kick_fd ? req_fd : kick_fd;
+
+  while(1){
+    FD_ZERO(&fds);
+    FD_SET(req_fd, &fds);
+    FD_SET(kick_fd, &fds);
+    if(select(max_fd + 1, &fds, NULL, NULL, NULL) == -1){
+      if(errno == EINTR) continue;
+      fprintf(stderr, "Failure waiting for a request.\n");
+      return 0;
+    }
+    return !FD_ISSET(kick_fd, &fds);
+  }
+}
+
 void* managing_thread_fn(void *arg){
   Server_data *server_data = (Server_data*) arg;
-  int req_fd, resp_fd, notif_fd, error = 0, connected = 0;
+  int req_fd, resp_fd, notif_fd, kick[2], error = 0, connected = 0;
   char *connect_message;
   char req_pipe[MAX_PIPE_PATH_LENGTH];
   char resp_pipe[MAX_PIPE_PATH_LENGTH];
   char notif_pipe[MAX_PIPE_PATH_LENGTH];
-  sigset_t mask;
+  Subscriptions subscriptions;
 
-  sigemptyset (&mask);
-  sigaddset (&mask, SIGUSR1);
-  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  block_SIGUSR1();
+
+  if(init_subscriptions(&subscriptions)){
+    fprintf(stderr, "Failure to initialize subscriptions mutex.\n");
+    return NULL;
+  }
 
   while(error == 0){
     error = 0;
@@ -251,25 +403,42 @@ void* managing_thread_fn(void *arg){
     free(connect_message);
     connected = 1;
 
-    if(open_pipes(&req_fd, &resp_fd, &notif_fd, req_pipe, resp_pipe, notif_pipe)) return NULL;
+    if(open_pipes(&req_fd, &resp_fd, &notif_fd, req_pipe, resp_pipe, notif_pipe)){
+      destroy_subscriptions(&subscriptions);
+      return NULL;
+    }
+    if(pipe(kick) == -1){
+      fprintf(stderr, "Failure to create the session's pipe.\n");
+      close(req_fd);
+      close(resp_fd);
+      close(notif_fd);
+      destroy_subscriptions(&subscriptions);
+      return NULL;
+    }
+    if(notifier_add_subscriber(notif_fd))
+      fprintf(stderr, "Client won't receive notifications.\n");
 
     /** Add client to current clients list. */
     pthread_mutex_lock(&server_data->client_mutex);
-    add_client(&server_data->client_head, resp_fd, notif_fd);
+    add_client(&server_data->client_head, resp_fd, notif_fd, kick[1], &subscriptions);
     pthread_mutex_unlock(&server_data->client_mutex);
 
     while(error == 0 && connected){
       char request_message[MAX_REGISTER_MSG]; 
+      /** Server got SIGUSR1. */
+      if(!wait_request(req_fd, kick[0])){
+        client_disconnect(req_fd, resp_fd, notif_fd, kick, &subscriptions, server_data, &connected);
+        break;
+      }
       /** Read OP CODE. */
       ssize_t ret = read_all(req_fd, request_message, 1, NULL);
       /** Client sudden disconnect. */
       if(ret == 0 && errno == 0){
-        client_disconnect(req_fd, resp_fd, notif_fd, server_data, &connected);
+        client_disconnect(req_fd, resp_fd, notif_fd, kick, &subscriptions, server_data, &connected);
         break;
       }
       switch (request_message[0]) {
         case OP_CODE_DISCONNECT:
-          delete_client_subscriptions(notif_fd);
           if(write_all(resp_fd, "20", 2) == -1){
             if(errno != EBADF){
               fprintf(stderr, "Failure to write disconnect mensage (success)\n");
@@ -277,17 +446,29 @@ void* managing_thread_fn(void *arg){
             }
             break;
           }
-          client_disconnect(req_fd, resp_fd, notif_fd, server_data, &connected);
+          client_disconnect(req_fd, resp_fd, notif_fd, kick, &subscriptions, server_data, &connected);
           break;
 
         case OP_CODE_SUBSCRIBE:
+        case OP_CODE_SUBSCRIBE_LATEST:{
+          /** Response starts with the request's OP CODE. */
+          char response[2] = {request_message[0], '1'};
           if(read_all(req_fd, request_message + 1, MAX_STRING_SIZE + 1, NULL) == -1){
             fprintf(stderr, "Failure to read subsribe request.\n");
             error = 1;
           }
-          if(subscribe_key(request_message + 1, notif_fd)){
+          pthread_mutex_lock(&subscriptions.mutex);
+          int failed = subscribe_key(request_message + 1, notif_fd, request_message[0] == OP_CODE_SUBSCRIBE_LATEST);
+          /** Keep track of the key so disconnecting only touches it. */
+          if(!failed && add_subscription(&subscriptions, request_message + 1)){
+            unsubscribe_key(request_message + 1, notif_fd);
+            failed = 1;
+          }
+          pthread_mutex_unlock(&subscriptions.mutex);
+          if(failed){
             /** Key was not found. */
-            if(write_all(resp_fd, "30", 2) == -1){
+            response[1] = '0';
+            if(write_all(resp_fd, response, 2) == -1){
               if(errno != EBADF){
                 fprintf(stderr, "Failure to write subscribe (Key not found).\n");
                 error = 1;
@@ -295,7 +476,7 @@ void* managing_thread_fn(void *arg){
             }
           }
           else{
-            if(write_all(resp_fd, "31", 2) == -1){
+            if(write_all(resp_fd, response, 2) == -1){
               if(errno != EBADF){
                 fprintf(stderr, "Failure to write subscribe (success).\n");
                 error = 1;
@@ -303,13 +484,18 @@ void* managing_thread_fn(void *arg){
             }
           }
           break;
+        }
 
         case OP_CODE_UNSUBSCRIBE:
           if(read_all(req_fd, request_message + 1, MAX_STRING_SIZE + 1, NULL) == -1){
             fprintf(stderr, "Failure to read subsribe request.\n");
             error = 1;
           }
-          if(unsubscribe_key(request_message + 1, notif_fd)){
+          pthread_mutex_lock(&subscriptions.mutex);
+          int failed = unsubscribe_key(request_message + 1, notif_fd);
+          remove_subscription(&subscriptions, request_message + 1);
+          pthread_mutex_unlock(&subscriptions.mutex);
+          if(failed){
             if(write_all(resp_fd, "41", 2) == -1){
               if(errno != EBADF){
                 fprintf(stderr, "Failure to write unsubscribe (subscription not found)\n");
@@ -334,10 +520,19 @@ void* managing_thread_fn(void *arg){
     }
   }
 
-  client_disconnect(req_fd, resp_fd, notif_fd, server_data, &connected);
+  if(connected) client_disconnect(req_fd, resp_fd, notif_fd, kick, &subscriptions, server_data, &connected);
+  destroy_subscriptions(&subscriptions);
   return NULL;
 }
 
+void block_SIGUSR1(){
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
 void handle_SIGUSR1(int signum){
   (void)signum; /** To supress warning. */
   _SIGSUSR1_received = 1;
@@ -366,9 +561,8 @@ void* host_thread_fn(void* arg){
     }
 
     if(_SIGSUSR1_received){
-      delete_all_subscriptions();
       pthread_mutex_lock(&host_thread->server_data->client_mutex);
-      close_all_clients(host_thread->server_data->client_head);
+      kick_all_clients(host_thread->server_data->client_head);
       pthread_mutex_unlock(&host_thread->server_data->client_mutex);
       _SIGSUSR1_received = 0;
     }
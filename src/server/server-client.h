@@ -1,12 +1,32 @@
 #ifndef __SERVER_CLIENT__H__
 #define __SERVER_CLIENT__H__
 
+#include <pthread.h>
+#include <semaphore.h>
+
 #include "src/common/constants.h"
+#include "constants.h"
 
 #define BUFFER_SIZE 10
 
+/// Keys a client is subscribed to, so its subscriptions can be removed
+/// without going through the whole KVS. keys holds them in no particular
+/// order; slots is a linear probing table (num_slots a power of 2, twice
+/// capacity) of their position + 1, 0 for a free slot, so a key is found
+/// without going through the others.
+typedef struct Subscriptions{
+  pthread_mutex_t mutex;
+  size_t count, capacity;
+  char (*keys)[MAX_STRING_SIZE + 1];
+  size_t *slots;
+  size_t num_slots;
+}Subscriptions;
+
 typedef struct Client_Node{
   int resp_fd, notif_fd;
+  /** Write end of the pipe that tells the session's thread to end it. */
+  int kick_fd;
+  Subscriptions *subscriptions;
   struct Client_Node *next; 
 }Client_Node;
 
@@ -36,6 +56,10 @@ Server_data *new_server_data();
 /// @param server_data 
 void destroy_server_data(Server_data *server_data);
 
+/// Blocks SIGUSR1 on the calling thread. Every thread the server starts
+/// calls it, so the signal is only handled by the host thread.
+void block_SIGUSR1();
+
 /// Handles a SIGUSR1 signal.
 /// @param signum 
 void handle_SIGUSR1(int signum);
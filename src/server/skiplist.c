@@ -0,0 +1,119 @@
+#include "skiplist.h"
+
+#include <string.h>
+
+/// Returns the size of an entry.
+/// @param height Number of levels it's linked on.
+/// @return Number of bytes of the entry.
+static size_t node_size(size_t height) {
+  return sizeof(Skip_Node) + height * sizeof(Skip_Node *);
+}
+
+/// Allocates an entry from the skiplist's arena. Entries use the string size
+/// classes, so all but the tallest (and the head) come from a slab.
+/// @param list Skiplist.
+/// @param height Number of levels it's linked on.
+/// @return New entry, NULL on failure.
+static Skip_Node *new_node(Skiplist *list, size_t height) {
+  size_t capacity;
+  Skip_Node *node = (Skip_Node *)(void *)arena_alloc_string(list->arena, node_size(height), &capacity);
+  if (node == NULL) return NULL;
+
+  node->height = height;
+  for (size_t i = 0; i < height; i++) node->next[i] = NULL;
+  return node;
+}
+
+/// Gives an entry back to the skiplist's arena.
+/// @param list Skiplist.
+/// @param node Entry to free.
+static void free_node(Skiplist *list, Skip_Node *node) {
+  arena_free_string(list->arena, (char *)node, node_size(node->height));
+}
+
+/// Picks the height of an entry, each level a quarter as likely as the one
+/// below.
+/// @param seed Random bits.
+/// @return Height between 1 and SKIPLIST_MAX_LEVEL.
+static size_t random_height(size_t seed) {
+  size_t height = 1;
+
+  /** Low bits of a hash already pick the bucket, use the high ones. */
+  seed >>= sizeof(size_t) * 4;
+  while (height < SKIPLIST_MAX_LEVEL && (seed & 3) == 0) {
+    height++;
+    seed >>= 2;
+  }
+  return height;
+}
+
+/// Finds, on every level, the last entry with a key below the given one.
+/// @param list Skiplist.
+/// @param key Key to look for.
+/// @param update Filled with the entry found on each level.
+/// @return Entry after update[0] on the lowest level.
+static Skip_Node *find_predecessors(Skiplist *list, const char *key, Skip_Node *update[]) {
+  Skip_Node *node = list->head;
+
+  for (size_t level = list->level; level-- > 0;) {
+    while (node->next[level] != NULL && strcmp(node->next[level]->key, key) < 0)
+      node = node->next[level];
+    if (update != NULL) update[level] = node;
+  }
+  return node->next[0];
+}
+
+int skiplist_init(Skiplist *list, Arena *arena) {
+  list->arena = arena;
+  if ((list->head = new_node(list, SKIPLIST_MAX_LEVEL)) == NULL) return 1;
+  list->level = 1;
+  return 0;
+}
+
+void skiplist_destroy(Skiplist *list) {
+  Skip_Node *node = list->head;
+
+  while (node != NULL) {
+    Skip_Node *next = node->next[0];
+    free_node(list, node);
+    node = next;
+  }
+}
+
+int skiplist_insert(Skiplist *list, const char *key, size_t seed, void *value) {
+  Skip_Node *update[SKIPLIST_MAX_LEVEL];
+  size_t height = random_height(seed);
+  Skip_Node *node = new_node(list, height);
+
+  if (node == NULL) return 1;
+  node->key = key;
+  node->value = value;
+
+  find_predecessors(list, key, update);
+  /** New levels start at the head. */
+  for (size_t level = list->level; level < height; level++) update[level] = list->head;
+  if (height > list->level) list->level = height;
+
+  for (size_t level = 0; level < height; level++) {
+    node->next[level] = update[level]->next[level];
+    update[level]->next[level] = node;
+  }
+  return 0;
+}
+
+void skiplist_remove(Skiplist *list, const char *key) {
+  Skip_Node *update[SKIPLIST_MAX_LEVEL];
+  Skip_Node *node = find_predecessors(list, key, update);
+
+  if (node == NULL || strcmp(node->key, key) != 0) return;
+
+  for (size_t level = 0; level < node->height; level++)
+    update[level]->next[level] = node->next[level];
+  /** Drop levels left empty. */
+  while (list->level > 1 && list->head->next[list->level - 1] == NULL) list->level--;
+  free_node(list, node);
+}
+
+Skip_Node *skiplist_seek(Skiplist *list, const char *start) {
+  return find_predecessors(list, start, NULL);
+}
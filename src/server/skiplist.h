@@ -0,0 +1,59 @@
+#ifndef KVS_SKIPLIST_H
+#define KVS_SKIPLIST_H
+
+#include <stddef.h>
+
+#include "slab.h"
+
+/** Maximum number of levels of a skiplist (enough for 4^16 keys). */
+#define SKIPLIST_MAX_LEVEL 16
+
+/// Entry of a skiplist, linked on its height lowest levels.
+typedef struct Skip_Node {
+  const char *key;
+  void *value;
+  size_t height;
+  struct Skip_Node *next[];
+} Skip_Node;
+
+/// Keys in increasing order (strcmp), with entries allocated from arena.
+/// The skiplist takes no locks: the caller keeps inserts and removes apart
+/// from each other and from anyone going through it.
+typedef struct Skiplist {
+  Arena *arena;
+  size_t level;
+  Skip_Node *head;
+} Skiplist;
+
+/// Initializes an empty skiplist.
+/// @param list Skiplist to initialize.
+/// @param arena Arena its entries are allocated from.
+/// @return 0 if successful, 1 otherwise.
+int skiplist_init(Skiplist *list, Arena *arena);
+
+/// Frees every entry of the skiplist (not their keys or values).
+/// @param list Skiplist to destroy.
+void skiplist_destroy(Skiplist *list);
+
+/// Inserts a key that isn't on the skiplist yet. The key isn't copied, it
+/// must stay around until it's removed.
+/// @param list Skiplist.
+/// @param key Key of the entry.
+/// @param seed Random bits (the key's hash) the entry's height comes from.
+/// @param value Value of the entry.
+/// @return 0 if successful, 1 otherwise.
+int skiplist_insert(Skiplist *list, const char *key, size_t seed, void *value);
+
+/// Removes a key from the skiplist.
+/// @param list Skiplist.
+/// @param key Key to remove.
+void skiplist_remove(Skiplist *list, const char *key);
+
+/// Finds the first entry with a key not below start. The entries after it,
+/// in order, are reached through next[0].
+/// @param list Skiplist.
+/// @param start Smallest key to look for.
+/// @return The entry, NULL if every key is below start.
+Skip_Node *skiplist_seek(Skiplist *list, const char *start);
+
+#endif // KVS_SKIPLIST_H
@@ -0,0 +1,134 @@
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+/** Alignment of every object carved out of a chunk. */
+#define SLAB_ALIGN alignof(max_align_t)
+
+/// Rounds a size up to the slab alignment.
+/// @param size
+/// @return Aligned size.
+static size_t align_size(size_t size) {
+  return (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+}
+
+/// Returns the size class of a string, NUM_SIZE_CLASSES if it has none.
+/// @param size Number of bytes of the string.
+/// @return Index of the size class.
+static size_t size_class(size_t size) {
+  size_t class_size = MIN_CLASS_SIZE;
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++, class_size *= 2) {
+    if (size <= class_size) return i;
+  }
+  return NUM_SIZE_CLASSES;
+}
+
+int arena_init(Arena *arena, size_t object_size) {
+  if (pthread_mutex_init(&arena->mutex, NULL) != 0) return 1;
+
+  arena->chunks = NULL;
+  arena->objects = (Slab_Pool){align_size(object_size), NULL, NULL, NULL};
+  size_t class_size = MIN_CLASS_SIZE;
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++, class_size *= 2) {
+    arena->strings[i] = (Slab_Pool){class_size, NULL, NULL, NULL};
+  }
+  return 0;
+}
+
+void arena_destroy(Arena *arena) {
+  Slab_Chunk *chunk = arena->chunks;
+  while (chunk != NULL) {
+    Slab_Chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  pthread_mutex_destroy(&arena->mutex);
+}
+
+/// Takes an object out of a pool. Caller must hold the arena's mutex.
+/// @param arena Arena that owns the pool.
+/// @param pool Pool to allocate from.
+/// @return Pointer to the object, NULL on failure.
+static void *pool_alloc(Arena *arena, Slab_Pool *pool) {
+  /** Reuse a freed object. */
+  if (pool->free_list != NULL) {
+    void *object = pool->free_list;
+    pool->free_list = *(void **)object;
+    return object;
+  }
+
+  /** Current chunk is full, get a new one. */
+  if (pool->next_free == NULL || pool->next_free + pool->object_size > pool->chunk_end) {
+    Slab_Chunk *chunk = malloc(SLAB_CHUNK_SIZE);
+    if (chunk == NULL) return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    pool->next_free = (char *)chunk + align_size(sizeof(Slab_Chunk));
+    pool->chunk_end = (char *)chunk + SLAB_CHUNK_SIZE;
+  }
+
+  void *object = pool->next_free;
+  pool->next_free += pool->object_size;
+  return object;
+}
+
+/// Puts an object back on its pool. Caller must hold the arena's mutex.
+/// @param pool Pool the object came from.
+/// @param object Object to free.
+static void pool_free(Slab_Pool *pool, void *object) {
+  *(void **)object = pool->free_list;
+  pool->free_list = object;
+}
+
+void *arena_alloc_object(Arena *arena) {
+  pthread_mutex_lock(&arena->mutex);
+  void *object = pool_alloc(arena, &arena->objects);
+  pthread_mutex_unlock(&arena->mutex);
+  return object;
+}
+
+void arena_free_object(Arena *arena, void *object) {
+  pthread_mutex_lock(&arena->mutex);
+  pool_free(&arena->objects, object);
+  pthread_mutex_unlock(&arena->mutex);
+}
+
+char *arena_alloc_string(Arena *arena, size_t size, size_t *capacity) {
+  size_t class = size_class(size);
+
+  /** Too big for any size class. */
+  if (class == NUM_SIZE_CLASSES) {
+    *capacity = size;
+    return malloc(size);
+  }
+
+  pthread_mutex_lock(&arena->mutex);
+  char *string = pool_alloc(arena, &arena->strings[class]);
+  pthread_mutex_unlock(&arena->mutex);
+  *capacity = arena->strings[class].object_size;
+  return string;
+}
+
+void arena_free_string(Arena *arena, char *string, size_t capacity) {
+  size_t class = size_class(capacity);
+
+  if (class == NUM_SIZE_CLASSES) {
+    free(string);
+    return;
+  }
+
+  pthread_mutex_lock(&arena->mutex);
+  pool_free(&arena->strings[class], string);
+  pthread_mutex_unlock(&arena->mutex);
+}
+
+char *arena_strdup(Arena *arena, const char *string, size_t *capacity) {
+  size_t size = strlen(string) + 1;
+  char *copy = arena_alloc_string(arena, size, capacity);
+
+  if (copy != NULL) memcpy(copy, string, size);
+  return copy;
+}
@@ -0,0 +1,78 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/** Size of each chunk of memory an arena asks malloc for. */
+#define SLAB_CHUNK_SIZE (16 * 1024)
+/** Number of size classes for strings (8, 16, 32 and 64 bytes). */
+#define NUM_SIZE_CLASSES 4
+/** Smallest size class. */
+#define MIN_CLASS_SIZE 8
+
+/// Chunk of memory owned by an arena. Objects are carved out of it and only
+/// given back to malloc when the arena is destroyed.
+typedef struct Slab_Chunk {
+  struct Slab_Chunk *next;
+} Slab_Chunk;
+
+/// Pool of objects with the same size. Freed objects are kept on free_list
+/// and reused before carving new ones out of the current chunk.
+typedef struct Slab_Pool {
+  size_t object_size;
+  void *free_list;
+  char *next_free, *chunk_end;
+} Slab_Pool;
+
+/// Arena with a pool for fixed size objects (the table's nodes) and a pool
+/// per string size class.
+typedef struct Arena {
+  pthread_mutex_t mutex;
+  Slab_Pool objects;
+  Slab_Pool strings[NUM_SIZE_CLASSES];
+  Slab_Chunk *chunks;
+} Arena;
+
+/// Initializes an arena.
+/// @param arena Arena to initialize.
+/// @param object_size Size of the objects of the fixed size pool.
+/// @return 0 if successful, 1 otherwise.
+int arena_init(Arena *arena, size_t object_size);
+
+/// Gives every chunk of the arena back to malloc at once.
+/// @param arena Arena to destroy.
+void arena_destroy(Arena *arena);
+
+/// Allocates an object from the fixed size pool.
+/// @param arena Arena to allocate from.
+/// @return Pointer to the object, NULL on failure.
+void *arena_alloc_object(Arena *arena);
+
+/// Returns an object to the fixed size pool.
+/// @param arena Arena the object came from.
+/// @param object Object to free.
+void arena_free_object(Arena *arena, void *object);
+
+/// Allocates room for a string of the given size (including the '\0').
+/// Strings bigger than the biggest size class go to malloc.
+/// @param arena Arena to allocate from.
+/// @param size Number of bytes needed.
+/// @param capacity Set to the number of bytes actually reserved.
+/// @return Pointer to the string, NULL on failure.
+char *arena_alloc_string(Arena *arena, size_t size, size_t *capacity);
+
+/// Returns a string to its size class.
+/// @param arena Arena the string came from.
+/// @param string String to free.
+/// @param capacity Capacity returned when the string was allocated.
+void arena_free_string(Arena *arena, char *string, size_t capacity);
+
+/// Copies a string into memory from the arena.
+/// @param arena Arena to allocate from.
+/// @param string String to copy.
+/// @param capacity Set to the number of bytes reserved.
+/// @return Copy of the string, NULL on failure.
+char *arena_strdup(Arena *arena, const char *string, size_t *capacity);
+
+#endif // KVS_SLAB_H
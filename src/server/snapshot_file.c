@@ -0,0 +1,357 @@
+#include "snapshot_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lz.h"
+
+/** FNV-1a, 64 bits. */
+#define CHECKSUM_PRIME 1099511628211ULL
+
+uint64_t snapshot_checksum(uint64_t checksum, const unsigned char *data, size_t size){
+  for (size_t i = 0; i < size; i++){
+    checksum ^= data[i];
+    checksum *= CHECKSUM_PRIME;
+  }
+  return checksum;
+}
+
+void snapshot_store_le(unsigned char *buffer, uint64_t value, size_t size){
+  for (size_t i = 0; i < size; i++){
+    buffer[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+uint64_t snapshot_load_le(const unsigned char *buffer, size_t size){
+  uint64_t value = 0;
+  for (size_t i = size; i-- > 0;){
+    value = (value << 8) | buffer[i];
+  }
+  return value;
+}
+
+void snapshot_writer_init(Snapshot_Writer *writer, Output_Buffer *out, uint64_t flags, uint64_t taken){
+  writer->out = out;
+  writer->flags = flags;
+  writer->taken = taken;
+  writer->num_records = 0;
+  writer->data_size = 0;
+  writer->checksum = SNAPSHOT_CHECKSUM_SEED;
+  writer->block_length = 0;
+
+  /** Filled in by snapshot_writer_finish, the buffer is empty so it fits. */
+  char *header = output_reserve(out, SNAPSHOT_HEADER_SIZE);
+  memset(header, 0, SNAPSHOT_HEADER_SIZE);
+  output_commit(out, SNAPSHOT_HEADER_SIZE);
+}
+
+size_t snapshot_record_size(const char *key, const char *value){
+  return 4 + strlen(key) + (value != NULL ? strlen(value) : 0);
+}
+
+size_t snapshot_record_encode(unsigned char *buffer, const char *key, const char *value){
+  size_t key_length = strlen(key);
+  size_t value_length = value != NULL ? strlen(value) : 0;
+
+  snapshot_store_le(buffer, key_length, 2);
+  snapshot_store_le(buffer + 2, value != NULL ? value_length : SNAPSHOT_DELETED, 2);
+  memcpy(buffer + 4, key, key_length);
+  if (value != NULL) memcpy(buffer + 4 + key_length, value, value_length);
+  return 4 + key_length + value_length;
+}
+
+size_t snapshot_record_decode(const unsigned char *records, size_t size, size_t offset, Snapshot_Record *record){
+  if (offset + 4 > size) return 0;
+  const unsigned char *data = records + offset;
+  size_t key_length = (size_t)snapshot_load_le(data, 2);
+  size_t value_length = (size_t)snapshot_load_le(data + 2, 2);
+  int deleted = value_length == SNAPSHOT_DELETED;
+
+  if (deleted) value_length = 0;
+  if (offset + 4 + key_length + value_length > size) return 0;
+  record->key = (const char *)data + 4;
+  record->key_length = key_length;
+  record->value = deleted ? NULL : (const char *)data + 4 + key_length;
+  record->value_length = value_length;
+  return offset + 4 + key_length + value_length;
+}
+
+/// Adds bytes to the records of a snapshot as they go to the file.
+/// @param writer
+/// @param data Bytes, already committed to the output buffer.
+/// @param size Number of bytes.
+static void writer_count(Snapshot_Writer *writer, const unsigned char *data, size_t size){
+  writer->checksum = snapshot_checksum(writer->checksum, data, size);
+  writer->data_size += size;
+}
+
+/// Compresses the records gathered in the writer's block into the output
+/// buffer, or stores them as they are if that's no smaller.
+/// @param writer
+/// @return 0 if successful, -1 otherwise.
+static int writer_flush_block(Snapshot_Writer *writer){
+  size_t raw_size = writer->block_length;
+  if (raw_size == 0) return 0;
+
+  unsigned char *block = (unsigned char *)output_reserve(writer->out, SNAPSHOT_BLOCK_HEADER_SIZE + raw_size);
+  if (block == NULL) return -1;
+  size_t size = lz_compress(writer->block, raw_size, block + SNAPSHOT_BLOCK_HEADER_SIZE, raw_size - 1);
+  if (size == 0) {
+    memcpy(block + SNAPSHOT_BLOCK_HEADER_SIZE, writer->block, raw_size);
+    size = raw_size;
+  }
+  snapshot_store_le(block, raw_size, 4);
+  snapshot_store_le(block + 4, size, 4);
+  output_commit(writer->out, SNAPSHOT_BLOCK_HEADER_SIZE + size);
+  writer_count(writer, block, SNAPSHOT_BLOCK_HEADER_SIZE + size);
+  writer->block_length = 0;
+  return 0;
+}
+
+int snapshot_writer_add(Snapshot_Writer *writer, const char *key, const char *value){
+  size_t size = snapshot_record_size(key, value);
+
+  if (writer->flags & SNAPSHOT_COMPRESSED) {
+    if (writer->block_length + size > SNAPSHOT_BLOCK_SIZE && writer_flush_block(writer) != 0) return -1;
+    writer->block_length += snapshot_record_encode(writer->block + writer->block_length, key, value);
+    writer->num_records++;
+    return 0;
+  }
+  unsigned char *record = (unsigned char *)output_reserve(writer->out, size);
+  if (record == NULL) return -1;
+  snapshot_record_encode(record, key, value);
+  output_commit(writer->out, size);
+  writer_count(writer, record, size);
+  writer->num_records++;
+  return 0;
+}
+
+int snapshot_writer_finish(Snapshot_Writer *writer){
+  unsigned char header[SNAPSHOT_HEADER_SIZE];
+
+  if (writer_flush_block(writer) != 0 || output_flush(writer->out) != 0) return -1;
+  memcpy(header, SNAPSHOT_MAGIC, 8);
+  snapshot_store_le(header + 8, writer->flags, 8);
+  snapshot_store_le(header + 16, writer->taken, 8);
+  snapshot_store_le(header + 24, writer->num_records, 8);
+  snapshot_store_le(header + 32, writer->data_size, 8);
+  snapshot_store_le(header + 40, writer->checksum, 8);
+  if (pwrite(writer->out->fd, header, SNAPSHOT_HEADER_SIZE, 0) != SNAPSHOT_HEADER_SIZE) return -1;
+  return 0;
+}
+
+int snapshot_file_sync(int fd, const char *path){
+  char directory[SNAPSHOT_PATH_SIZE];
+  const char *slash = strrchr(path, '/');
+
+  if (fsync(fd) != 0) return -1;
+  if (slash == NULL) strcpy(directory, ".");
+  else if (snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path + 1), path) >= (int)sizeof(directory))
+    return -1;
+  int directory_fd = open(directory, O_RDONLY);
+  if (directory_fd < 0) return -1;
+  int error = fsync(directory_fd) != 0 ? -1 : 0;
+  close(directory_fd);
+  return error;
+}
+
+int snapshot_manifest_write(int fd, const char *const segments[], size_t count){
+  if (dprintf(fd, "%s\n", SNAPSHOT_MANIFEST_MAGIC) < 0) return -1;
+  for (size_t i = 0; i < count; i++){
+    if (dprintf(fd, "%s\n", segments[i]) < 0) return -1;
+  }
+  return 0;
+}
+
+int snapshot_manifest_read(const char *path, char segments[][SNAPSHOT_PATH_SIZE], size_t *count){
+  FILE *file = fopen(path, "r");
+  char line[SNAPSHOT_PATH_SIZE];
+
+  if (file == NULL) return 1;
+  if (fgets(line, sizeof(line), file) == NULL || strcmp(line, SNAPSHOT_MANIFEST_MAGIC "\n") != 0){
+    fclose(file);
+    return 1;
+  }
+  /** Segments are next to the manifest. */
+  const char *slash = strrchr(path, '/');
+  int directory = slash != NULL ? (int)(slash - path + 1) : 0;
+  *count = 0;
+  int error = 0;
+  while (!error && fgets(line, sizeof(line), file) != NULL){
+    line[strcspn(line, "\n")] = '\0';
+    error = *count == SNAPSHOT_MAX_SEGMENTS || strchr(line, '/') != NULL ||
+            snprintf(segments[*count], SNAPSHOT_PATH_SIZE, "%.*s%s", directory, path, line) >= SNAPSHOT_PATH_SIZE;
+    (*count)++;
+  }
+  fclose(file);
+  return error || *count == 0;
+}
+
+/// Reads the header of a binary snapshot.
+/// @param path Path of the file.
+/// @param flags Filled with the snapshot's flags.
+/// @param taken Filled with when the snapshot was taken.
+/// @return 0 if it's a binary snapshot, 1 otherwise.
+static int probe_header(const char *path, uint64_t *flags, uint64_t *taken){
+  unsigned char header[SNAPSHOT_HEADER_SIZE];
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return 1;
+  ssize_t length = read(fd, header, SNAPSHOT_HEADER_SIZE);
+  close(fd);
+  if (length != SNAPSHOT_HEADER_SIZE || memcmp(header, SNAPSHOT_MAGIC, 8) != 0) return 1;
+  *flags = snapshot_load_le(header + 8, 8);
+  *taken = snapshot_load_le(header + 16, 8);
+  return 0;
+}
+
+int snapshot_file_probe(const char *path, uint64_t *flags, uint64_t *taken){
+  if (probe_header(path, flags, taken) == 0) return 0;
+
+  char segments[SNAPSHOT_MAX_SEGMENTS][SNAPSHOT_PATH_SIZE];
+  size_t count;
+  if (snapshot_manifest_read(path, segments, &count) != 0) return 1;
+  return probe_header(segments[0], flags, taken);
+}
+
+/// Block of a compressed snapshot, with where its records go.
+typedef struct Snapshot_Block {
+  const unsigned char *data;
+  size_t size, raw_size, raw_offset;
+} Snapshot_Block;
+
+/// Blocks decompressed by one thread: every num_threads-th from first.
+typedef struct Inflate_Task {
+  const Snapshot_Block *blocks;
+  size_t num_blocks, first, num_threads;
+  unsigned char *inflated;
+  int error;
+} Inflate_Task;
+
+/// Decompresses the blocks of a task.
+/// @param arg Pointer to the Inflate_Task.
+/// @return NULL.
+static void *inflate_blocks(void *arg){
+  Inflate_Task *task = (Inflate_Task *)arg;
+
+  for (size_t i = task->first; i < task->num_blocks && !task->error; i += task->num_threads){
+    const Snapshot_Block *block = &task->blocks[i];
+    unsigned char *raw = task->inflated + block->raw_offset;
+    if (block->size == block->raw_size) memcpy(raw, block->data, block->size);
+    else task->error = lz_decompress(block->data, block->size, raw, block->raw_size) != 0;
+  }
+  return NULL;
+}
+
+/// Decompresses the records of a compressed snapshot. Blocks are found one
+/// after the other, only their headers are read, and then decompressed in
+/// parallel.
+/// @param map Mapped snapshot, records end up in inflated.
+/// @param num_threads Number of threads to decompress with.
+/// @return 0 if successful, 1 otherwise.
+static int inflate_records(Snapshot_Map *map, size_t num_threads){
+  size_t num_blocks = 0, raw_size = 0;
+
+  for (size_t offset = 0; offset < map->records_size; num_blocks++){
+    if (map->records_size - offset < SNAPSHOT_BLOCK_HEADER_SIZE) return 1;
+    size_t size = (size_t)snapshot_load_le(map->records + offset + 4, 4);
+    if (size > map->records_size - offset - SNAPSHOT_BLOCK_HEADER_SIZE) return 1;
+    raw_size += (size_t)snapshot_load_le(map->records + offset, 4);
+    offset += SNAPSHOT_BLOCK_HEADER_SIZE + size;
+  }
+  Snapshot_Block *blocks = malloc((num_blocks > 0 ? num_blocks : 1) * sizeof(Snapshot_Block));
+  if (blocks == NULL || (map->inflated = malloc(raw_size > 0 ? raw_size : 1)) == NULL){
+    free(blocks);
+    return 1;
+  }
+  for (size_t i = 0, offset = 0, raw_offset = 0; i < num_blocks; i++){
+    blocks[i].raw_size = (size_t)snapshot_load_le(map->records + offset, 4);
+    blocks[i].size = (size_t)snapshot_load_le(map->records + offset + 4, 4);
+    blocks[i].data = map->records + offset + SNAPSHOT_BLOCK_HEADER_SIZE;
+    blocks[i].raw_offset = raw_offset;
+    offset += SNAPSHOT_BLOCK_HEADER_SIZE + blocks[i].size;
+    raw_offset += blocks[i].raw_size;
+  }
+
+  if (num_threads > num_blocks) num_threads = num_blocks;
+  if (num_threads == 0) num_threads = 1;
+  Inflate_Task tasks[num_threads];
+  pthread_t threads[num_threads];
+  size_t started = 0;
+  for (size_t i = 0; i < num_threads; i++){
+    tasks[i] = (Inflate_Task){blocks, num_blocks, i, num_threads, map->inflated, 0};
+  }
+  while (started + 1 < num_threads && pthread_create(&threads[started], NULL, inflate_blocks, &tasks[started]) == 0)
+    started++;
+  /** Whatever didn't get its own thread is decompressed here. */
+  for (size_t i = started; i < num_threads; i++)
+    inflate_blocks(&tasks[i]);
+  int error = 0;
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  for (size_t i = 0; i < num_threads; i++)
+    error |= tasks[i].error;
+  free(blocks);
+
+  map->records = map->inflated;
+  map->records_size = raw_size;
+  return error;
+}
+
+int snapshot_map_open(const char *path, Snapshot_Map *map, size_t num_threads){
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0){
+    fprintf(stderr, "Failed to open snapshot \"%s\"\n", path);
+    return 1;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < SNAPSHOT_HEADER_SIZE){
+    fprintf(stderr, "Snapshot \"%s\" is too short\n", path);
+    close(fd);
+    return 1;
+  }
+  map->size = (size_t)st.st_size;
+  map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map->data == MAP_FAILED){
+    fprintf(stderr, "Failed to map snapshot \"%s\"\n", path);
+    return 1;
+  }
+  /** Records are read once, front to back. */
+  posix_madvise(map->data, map->size, POSIX_MADV_SEQUENTIAL);
+
+  const unsigned char *header = map->data;
+  map->flags = snapshot_load_le(header + 8, 8);
+  map->num_records = snapshot_load_le(header + 24, 8);
+  map->records = header + SNAPSHOT_HEADER_SIZE;
+  map->records_size = map->size - SNAPSHOT_HEADER_SIZE;
+  map->inflated = NULL;
+  if (memcmp(header, SNAPSHOT_MAGIC, 8) != 0 || snapshot_load_le(header + 32, 8) != map->records_size ||
+      snapshot_checksum(SNAPSHOT_CHECKSUM_SEED, map->records, map->records_size) != snapshot_load_le(header + 40, 8)){
+    fprintf(stderr, "Snapshot \"%s\" is corrupted\n", path);
+    snapshot_map_close(map);
+    return 1;
+  }
+  if ((map->flags & SNAPSHOT_COMPRESSED) && inflate_records(map, num_threads) != 0){
+    fprintf(stderr, "Failed to decompress snapshot \"%s\"\n", path);
+    snapshot_map_close(map);
+    return 1;
+  }
+  return 0;
+}
+
+void snapshot_map_close(Snapshot_Map *map){
+  munmap(map->data, map->size);
+  free(map->inflated);
+}
+
+size_t snapshot_map_record(const Snapshot_Map *map, size_t offset, Snapshot_Record *record){
+  return snapshot_record_decode(map->records, map->records_size, offset, record);
+}
@@ -0,0 +1,183 @@
+#ifndef KVS_SNAPSHOT_FILE_H
+#define KVS_SNAPSHOT_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+
+/** First bytes of every binary snapshot. */
+#define SNAPSHOT_MAGIC "KVSSNAP1"
+/** Size of the header: magic, flags, when the snapshot was taken (in
+ *  nanoseconds since the epoch), number of records, size of the records and
+ *  their checksum, all but the magic as little endian 64 bits. */
+#define SNAPSHOT_HEADER_SIZE 48
+/** Flag of snapshots that only hold the changes since the previous one. */
+#define SNAPSHOT_DELTA 1
+/** Flag of snapshots whose records are split in compressed blocks. */
+#define SNAPSHOT_COMPRESSED 2
+/** Size of the header of a block: size of its records and size of the
+ *  block, little endian 32 bits. A block as big as its records is stored
+ *  as is, otherwise it's compressed with lz_compress (see lz.h). */
+#define SNAPSHOT_BLOCK_HEADER_SIZE 8
+/** Maximum size of the records of a block, so a block fits in the output
+ *  buffer. Records aren't split between blocks. */
+#define SNAPSHOT_BLOCK_SIZE (OUTPUT_BUFFER_SIZE - SNAPSHOT_BLOCK_HEADER_SIZE)
+/** Value length of a record for a deleted key (it has no value). */
+#define SNAPSHOT_DELETED 0xFFFF
+/** First line of the manifest of a backup written in segments. */
+#define SNAPSHOT_MANIFEST_MAGIC "KVSMANIFEST"
+/** Maximum number of segments of a backup. */
+#define SNAPSHOT_MAX_SEGMENTS 64
+/** Room for the path of a segment. */
+#define SNAPSHOT_PATH_SIZE 1024
+/** Starting value of a checksum (FNV-1a offset basis). */
+#define SNAPSHOT_CHECKSUM_SEED 14695981039346656037ULL
+
+/// Binary snapshot being written. Each record is the key's length and the
+/// value's length (16 bits, little endian), followed by the key and the
+/// value, without '\0'. The header is written last, over the room left for
+/// it at the start of the file. With SNAPSHOT_COMPRESSED, records gather in
+/// block until it's full, and the size and checksum are the blocks'.
+typedef struct Snapshot_Writer {
+  Output_Buffer *out;
+  uint64_t flags;
+  uint64_t taken;
+  uint64_t num_records;
+  uint64_t data_size;
+  uint64_t checksum;
+  size_t block_length;
+  unsigned char block[SNAPSHOT_BLOCK_SIZE];
+} Snapshot_Writer;
+
+/// Binary snapshot mapped in memory, already checked. The records of a
+/// compressed one are decompressed into inflated.
+typedef struct Snapshot_Map {
+  void *data;
+  size_t size;
+  uint64_t flags;
+  uint64_t num_records;
+  const unsigned char *records;
+  size_t records_size;
+  unsigned char *inflated;
+} Snapshot_Map;
+
+/// Record of a mapped snapshot. Key and value point into the mapping and
+/// aren't '\0' terminated; value is NULL for a deleted key.
+typedef struct Snapshot_Record {
+  const char *key;
+  size_t key_length;
+  const char *value;
+  size_t value_length;
+} Snapshot_Record;
+
+/// Folds bytes into a checksum.
+/// @param checksum Checksum so far, SNAPSHOT_CHECKSUM_SEED at first.
+/// @param data
+/// @param size Number of bytes.
+/// @return New checksum.
+uint64_t snapshot_checksum(uint64_t checksum, const unsigned char *data, size_t size);
+
+/// Stores a little endian integer.
+/// @param buffer Room for size bytes.
+/// @param value
+/// @param size Number of bytes.
+void snapshot_store_le(unsigned char *buffer, uint64_t value, size_t size);
+
+/// Loads a little endian integer.
+/// @param buffer
+/// @param size Number of bytes.
+/// @return Value.
+uint64_t snapshot_load_le(const unsigned char *buffer, size_t size);
+
+/// Size of the record of a pair.
+/// @param key Key of the record.
+/// @param value Value of the record, NULL for a deleted key.
+/// @return Number of bytes.
+size_t snapshot_record_size(const char *key, const char *value);
+
+/// Encodes a record.
+/// @param buffer Room for snapshot_record_size bytes.
+/// @param key Key of the record.
+/// @param value Value of the record, NULL for a deleted key.
+/// @return Number of bytes written.
+size_t snapshot_record_encode(unsigned char *buffer, const char *key, const char *value);
+
+/// Decodes the record at an offset of a run of records.
+/// @param records First record.
+/// @param size Size of the records.
+/// @param offset Offset of the record.
+/// @param record Filled with the record, pointing into records.
+/// @return Offset of the next record, 0 if the record is malformed.
+size_t snapshot_record_decode(const unsigned char *records, size_t size, size_t offset, Snapshot_Record *record);
+
+/// Starts a binary snapshot, leaving room for the header.
+/// @param writer Writer to initialize.
+/// @param out Output buffer of the snapshot's file, which must be empty.
+/// @param flags SNAPSHOT_DELTA and SNAPSHOT_COMPRESSED, or 0.
+/// @param taken When the snapshot was taken, in nanoseconds since the epoch.
+void snapshot_writer_init(Snapshot_Writer *writer, Output_Buffer *out, uint64_t flags, uint64_t taken);
+
+/// Appends a record.
+/// @param writer
+/// @param key Key of the record.
+/// @param value Value of the record, NULL for a deleted key.
+/// @return 0 if successful, -1 otherwise.
+int snapshot_writer_add(Snapshot_Writer *writer, const char *key, const char *value);
+
+/// Writes what's left of the snapshot and its header.
+/// @param writer
+/// @return 0 if successful, -1 otherwise.
+int snapshot_writer_finish(Snapshot_Writer *writer);
+
+/// Reads the header of a file, to tell if it's a binary snapshot. A
+/// manifest is one if its first segment is.
+/// @param path Path of the file.
+/// @param flags Filled with the snapshot's flags.
+/// @param taken Filled with when the snapshot was taken.
+/// @return 0 if it's a binary snapshot, 1 otherwise.
+int snapshot_file_probe(const char *path, uint64_t *flags, uint64_t *taken);
+
+/// Makes a written file durable: syncs its data and then the directory that
+/// holds it, so a crash can't lose the file or its name.
+/// @param fd File descriptor of the file.
+/// @param path Path of the file.
+/// @return 0 if successful, -1 otherwise.
+int snapshot_file_sync(int fd, const char *path);
+
+/// Writes the manifest of a backup split in segments: the magic line, then
+/// the name of every segment (in the manifest's directory), one per line.
+/// Segments hold disjoint sets of keys, in the same format.
+/// @param fd File descriptor of the manifest.
+/// @param segments Names of the segments.
+/// @param count Number of segments.
+/// @return 0 if successful, -1 otherwise.
+int snapshot_manifest_write(int fd, const char *const segments[], size_t count);
+
+/// Reads the manifest of a backup split in segments.
+/// @param path Path of the manifest.
+/// @param segments Filled with the paths of the segments.
+/// @param count Filled with the number of segments.
+/// @return 0 if it's a manifest, 1 otherwise.
+int snapshot_manifest_read(const char *path, char segments[][SNAPSHOT_PATH_SIZE], size_t *count);
+
+/// Maps a binary snapshot and checks its header and checksum. The blocks of
+/// a compressed one are decompressed in parallel.
+/// @param path Path of the snapshot.
+/// @param map Filled with the mapping.
+/// @param num_threads Number of threads to decompress with.
+/// @return 0 if successful, 1 otherwise.
+int snapshot_map_open(const char *path, Snapshot_Map *map, size_t num_threads);
+
+/// Unmaps a snapshot and frees its decompressed records.
+/// @param map
+void snapshot_map_close(Snapshot_Map *map);
+
+/// Decodes the record at an offset of the records.
+/// @param map
+/// @param offset Offset of the record.
+/// @param record Filled with the record.
+/// @return Offset of the next record, 0 if the record is malformed.
+size_t snapshot_map_record(const Snapshot_Map *map, size_t offset, Snapshot_Record *record);
+
+#endif // KVS_SNAPSHOT_FILE_H
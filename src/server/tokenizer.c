@@ -0,0 +1,76 @@
+#include "tokenizer.h"
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/// Classifies a chunk of bytes.
+/// @param chunk TOKENIZER_CHUNK bytes.
+/// @return Mask with bit i set if byte i is a delimiter.
+static uint64_t classify(const char *chunk){
+  uint64_t mask = 0;
+
+#if defined(__AVX2__)
+  const __m256i comma = _mm256_set1_epi8(','), parenthesis = _mm256_set1_epi8(')');
+  const __m256i bracket = _mm256_set1_epi8(']'), space = _mm256_set1_epi8(' ');
+  for (size_t i = 0; i < TOKENIZER_CHUNK; i += 32){
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)(const void *)(chunk + i));
+    __m256i found = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, comma), _mm256_cmpeq_epi8(bytes, parenthesis)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(bytes, bracket), _mm256_cmpeq_epi8(bytes, space)));
+    mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(found) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128i comma = _mm_set1_epi8(','), parenthesis = _mm_set1_epi8(')');
+  const __m128i bracket = _mm_set1_epi8(']'), space = _mm_set1_epi8(' ');
+  for (size_t i = 0; i < TOKENIZER_CHUNK; i += 16){
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(const void *)(chunk + i));
+    __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, parenthesis)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(bytes, bracket), _mm_cmpeq_epi8(bytes, space)));
+    mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(found) << i;
+  }
+#else
+  for (size_t i = 0; i < TOKENIZER_CHUNK; i++){
+    char byte = chunk[i];
+    if (byte == ',' || byte == ')' || byte == ']' || byte == ' ') mask |= (uint64_t)1 << i;
+  }
+#endif
+  return mask;
+}
+
+/// Classifies the chunk starting at an offset of the buffer.
+/// @param tokens
+/// @param chunk Offset of the chunk, a multiple of TOKENIZER_CHUNK.
+static void load_chunk(Tokenizer *tokens, size_t chunk){
+  tokens->chunk = chunk;
+  if (tokens->length - chunk >= TOKENIZER_CHUNK){
+    tokens->mask = classify(tokens->data + chunk);
+    return;
+  }
+  /** The last bytes are padded with '\0', which isn't a delimiter. */
+  char last[TOKENIZER_CHUNK] = {0};
+  memcpy(last, tokens->data + chunk, tokens->length - chunk);
+  tokens->mask = classify(last);
+}
+
+void tokenizer_init(Tokenizer *tokens, const char *data, size_t length){
+  tokens->data = data;
+  tokens->length = length;
+  tokens->chunk = SIZE_MAX;
+  tokens->mask = 0;
+}
+
+size_t tokenizer_next(Tokenizer *tokens, size_t from){
+  for (size_t chunk = from - from % TOKENIZER_CHUNK; chunk < tokens->length; chunk += TOKENIZER_CHUNK){
+    if (tokens->chunk != chunk) load_chunk(tokens, chunk);
+    uint64_t mask = tokens->mask;
+    /** Delimiters before from were already used. */
+    if (from > chunk) mask &= ~(uint64_t)0 << (from - chunk);
+    if (mask != 0){
+      size_t position = chunk + (size_t)__builtin_ctzll(mask);
+      return position < tokens->length ? position : tokens->length;
+    }
+  }
+  return tokens->length;
+}
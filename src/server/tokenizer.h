@@ -0,0 +1,34 @@
+#ifndef KVS_TOKENIZER_H
+#define KVS_TOKENIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Number of bytes classified at once. */
+#define TOKENIZER_CHUNK 64
+
+/// Finds the delimiters of WRITE, READ and DELETE argument lists (',', ')',
+/// ']' and ' ') in a buffer. Bytes are classified a chunk at a time into a
+/// bitmask (with SSE2 or AVX2 when compiled for them), and the mask of the
+/// last chunk is kept for the next lookup.
+typedef struct Tokenizer {
+  const char *data;
+  size_t length;
+  size_t chunk;
+  uint64_t mask;
+} Tokenizer;
+
+/// Starts tokenizing a buffer.
+/// @param tokens Tokenizer to initialize.
+/// @param data Buffer.
+/// @param length Size of the buffer.
+void tokenizer_init(Tokenizer *tokens, const char *data, size_t length);
+
+/// Finds the next delimiter.
+/// @param tokens
+/// @param from Offset to start looking at.
+/// @return Offset of the first delimiter at or after from, the buffer's
+/// length if there's none.
+size_t tokenizer_next(Tokenizer *tokens, size_t from);
+
+#endif // KVS_TOKENIZER_H
@@ -0,0 +1,371 @@
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "src/common/io.h"
+#include "server-client.h"
+
+/// Records waiting to be written, after room for their batch's header.
+typedef struct Wal_Buffer{
+  unsigned char *data;
+  size_t length, capacity;
+}Wal_Buffer;
+
+/// Append-only log of the writes and deletes. Commands append to pending
+/// under the mutex. Whoever flushes (the leader) takes pending whole, swaps
+/// in the other buffer so appends go on, and writes it as one batch without
+/// the mutex. Appends are numbered: durable is the last one in a finished
+/// flush. Offsets count from the start of the log, including what was cut
+/// off it: the file begins at start, and end is past the last batch handed
+/// to a flush. marks are the ones on the pending batch, in order. flushing
+/// also keeps flushes out while the log is being cut.
+typedef struct Wal{
+  int fd;
+  char *path;
+  Wal_Sync sync;
+  unsigned int interval_ms;
+  pthread_mutex_t mutex;
+  pthread_cond_t flushed, wake;
+  Wal_Buffer pending, spare;
+  uint64_t appended, durable;
+  uint64_t start, end;
+  Wal_Mark *marks, *last_mark;
+  int flushing, error, stop;
+  pthread_t flusher;
+}Wal;
+
+static Wal wal = {.fd = -1};
+
+/// Writes records as one batch, with its header in the bytes before them.
+/// @param batch Room for the header, followed by the records.
+/// @param size Size of the records.
+/// @return 0 if successful, 1 otherwise.
+static int write_batch(unsigned char *batch, size_t size){
+  snapshot_store_le(batch, size, 8);
+  snapshot_store_le(batch + 8, snapshot_checksum(SNAPSHOT_CHECKSUM_SEED, batch + WAL_BATCH_HEADER_SIZE, size), 8);
+  return write_all(wal.fd, batch, WAL_BATCH_HEADER_SIZE + size) != 1;
+}
+
+/// Writes (and syncs, unless the policy is WAL_SYNC_NONE) everything
+/// appended so far, as one batch or one per stretch between its marks.
+/// Caller must hold the mutex, with no other flush going on; it's released
+/// during the write.
+static void flush_locked(){
+  Wal_Buffer batch = wal.pending;
+  uint64_t last = wal.appended;
+  Wal_Mark *marks = wal.marks;
+
+  /** Marks learn their offset now, each stretch is a batch of its own. */
+  size_t from = WAL_BATCH_HEADER_SIZE;
+  for (Wal_Mark *mark = marks; mark != NULL; mark = mark->next){
+    if (mark->split > from){
+      wal.end += WAL_BATCH_HEADER_SIZE + mark->split - from;
+      from = mark->split;
+    }
+    mark->offset = wal.end;
+  }
+  if (batch.length > from) wal.end += WAL_BATCH_HEADER_SIZE + batch.length - from;
+
+  wal.flushing = 1;
+  wal.marks = wal.last_mark = NULL;
+  wal.pending = wal.spare;
+  wal.pending.length = WAL_BATCH_HEADER_SIZE;
+  pthread_mutex_unlock(&wal.mutex);
+
+  int error = 0;
+  from = WAL_BATCH_HEADER_SIZE;
+  for (Wal_Mark *mark = marks;; mark = mark->next){
+    size_t to = mark != NULL ? mark->split : batch.length;
+    /** The stretch's header goes over the end of the one before, already written. */
+    if (to > from){
+      if (!error) error = write_batch(batch.data + from - WAL_BATCH_HEADER_SIZE, to - from);
+      from = to;
+    }
+    if (mark == NULL) break;
+  }
+  if (!error && batch.length > WAL_BATCH_HEADER_SIZE && wal.sync != WAL_SYNC_NONE)
+    error = fdatasync(wal.fd) != 0;
+
+  pthread_mutex_lock(&wal.mutex);
+  if (error && !wal.error){
+    fprintf(stderr, "Failed to write the log, writes are no longer durable\n");
+    wal.error = 1;
+  }
+  for (Wal_Mark *mark = marks; mark != NULL; mark = mark->next) mark->written = 1;
+  wal.spare = batch;
+  wal.durable = last;
+  wal.flushing = 0;
+  pthread_cond_broadcast(&wal.flushed);
+}
+
+/// Flushes the log every interval_ms, for WAL_SYNC_INTERVAL.
+/// @param arg Unused.
+/// @return NULL.
+static void *flusher_fn(void *arg){
+  (void)arg;
+  block_SIGUSR1();
+
+  pthread_mutex_lock(&wal.mutex);
+  while (!wal.stop){
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wal.interval_ms / 1000;
+    deadline.tv_nsec += (long)(wal.interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000){
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&wal.wake, &wal.mutex, &deadline);
+    if (!wal.flushing && wal.pending.length > WAL_BATCH_HEADER_SIZE) flush_locked();
+  }
+  pthread_mutex_unlock(&wal.mutex);
+  return NULL;
+}
+
+int wal_replay(const char *path, int (*apply)(const Snapshot_Record *record, void *arg), void *arg){
+  struct stat st;
+  int fd = open(path, O_RDWR);
+
+  if (fd < 0) return errno == ENOENT ? 0 : 1;
+  if (fstat(fd, &st) != 0){
+    close(fd);
+    return 1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size == 0){
+    close(fd);
+    return 0;
+  }
+  unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED){
+    fprintf(stderr, "Failed to map log \"%s\"\n", path);
+    close(fd);
+    return 1;
+  }
+  /** The log is read once, front to back. */
+  posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+  size_t offset = 0;
+  int error = 0;
+  while (!error && offset + WAL_BATCH_HEADER_SIZE <= size){
+    size_t batch_size = (size_t)snapshot_load_le(data + offset, 8);
+    const unsigned char *records = data + offset + WAL_BATCH_HEADER_SIZE;
+
+    /** Cut short or half written, nothing after it was acknowledged. */
+    if (batch_size > size - offset - WAL_BATCH_HEADER_SIZE ||
+        snapshot_checksum(SNAPSHOT_CHECKSUM_SEED, records, batch_size) != snapshot_load_le(data + offset + 8, 8))
+      break;
+    Snapshot_Record record;
+    for (size_t next = 0; !error && next < batch_size;){
+      next = snapshot_record_decode(records, batch_size, next, &record);
+      error = next == 0 || apply(&record, arg) != 0;
+    }
+    offset += WAL_BATCH_HEADER_SIZE + batch_size;
+  }
+  munmap(data, size);
+
+  if (!error && offset < size){
+    fprintf(stderr, "Dropping %zu bytes of torn log at the end of \"%s\"\n", size - offset, path);
+    error = ftruncate(fd, (off_t)offset) != 0;
+  }
+  close(fd);
+  if (error) fprintf(stderr, "Failed to replay log \"%s\"\n", path);
+  return error;
+}
+
+int wal_open(const char *path, Wal_Sync sync, unsigned int interval_ms){
+  if (wal.fd >= 0){
+    fprintf(stderr, "The log is already open\n");
+    return 1;
+  }
+  struct stat st;
+  if ((wal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0 || fstat(wal.fd, &st) != 0 ||
+      (wal.path = strdup(path)) == NULL){
+    fprintf(stderr, "Failed to open log \"%s\"\n", path);
+    if (wal.fd >= 0) close(wal.fd);
+    wal.fd = -1;
+    return 1;
+  }
+  wal.sync = sync;
+  wal.interval_ms = interval_ms > 0 ? interval_ms : 1;
+  wal.appended = wal.durable = 0;
+  wal.start = 0;
+  wal.end = (uint64_t)st.st_size;
+  wal.marks = wal.last_mark = NULL;
+  wal.flushing = wal.error = wal.stop = 0;
+  wal.pending = (Wal_Buffer){NULL, WAL_BATCH_HEADER_SIZE, 0};
+  wal.spare = (Wal_Buffer){NULL, WAL_BATCH_HEADER_SIZE, 0};
+  pthread_mutex_init(&wal.mutex, NULL);
+  pthread_cond_init(&wal.flushed, NULL);
+  pthread_cond_init(&wal.wake, NULL);
+
+  if (sync == WAL_SYNC_INTERVAL && pthread_create(&wal.flusher, NULL, flusher_fn, NULL) != 0){
+    fprintf(stderr, "Failed to start the log's flusher\n");
+    wal_close();
+    return 1;
+  }
+  return 0;
+}
+
+void wal_close(){
+  if (wal.fd < 0) return;
+
+  pthread_mutex_lock(&wal.mutex);
+  wal.stop = 1;
+  pthread_cond_signal(&wal.wake);
+  pthread_mutex_unlock(&wal.mutex);
+  if (wal.sync == WAL_SYNC_INTERVAL) pthread_join(wal.flusher, NULL);
+
+  /** Whatever is left goes in a last batch, synced even with WAL_SYNC_NONE. */
+  pthread_mutex_lock(&wal.mutex);
+  while (wal.flushing) pthread_cond_wait(&wal.flushed, &wal.mutex);
+  flush_locked();
+  pthread_mutex_unlock(&wal.mutex);
+  fdatasync(wal.fd);
+
+  close(wal.fd);
+  wal.fd = -1;
+  free(wal.path);
+  free(wal.pending.data);
+  free(wal.spare.data);
+  pthread_cond_destroy(&wal.wake);
+  pthread_cond_destroy(&wal.flushed);
+  pthread_mutex_destroy(&wal.mutex);
+}
+
+int wal_enabled(){
+  return wal.fd >= 0;
+}
+
+int wal_append(size_t count, const char *const keys[], const char *const values[], uint64_t *lsn){
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++){
+    size += snapshot_record_size(keys[i], values != NULL ? values[i] : NULL);
+  }
+
+  pthread_mutex_lock(&wal.mutex);
+  Wal_Buffer *buffer = &wal.pending;
+  if (buffer->length + size > buffer->capacity){
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 4096;
+    while (capacity < buffer->length + size) capacity *= 2;
+    unsigned char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL){
+      pthread_mutex_unlock(&wal.mutex);
+      fprintf(stderr, "Failed to allocate memory for the log\n");
+      return 1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  for (size_t i = 0; i < count; i++){
+    buffer->length += snapshot_record_encode(buffer->data + buffer->length, keys[i], values != NULL ? values[i] : NULL);
+  }
+  *lsn = ++wal.appended;
+  pthread_mutex_unlock(&wal.mutex);
+  return 0;
+}
+
+int wal_commit(uint64_t lsn){
+  pthread_mutex_lock(&wal.mutex);
+  /** The flusher gets to it, unless too much is piling up. */
+  if (wal.sync == WAL_SYNC_INTERVAL && wal.pending.length < WAL_FLUSH_SIZE) lsn = 0;
+
+  while (wal.durable < lsn && !wal.error){
+    /** Someone else is writing, the next batch will take this one along. */
+    if (wal.flushing) pthread_cond_wait(&wal.flushed, &wal.mutex);
+    else flush_locked();
+  }
+  int error = wal.error;
+  pthread_mutex_unlock(&wal.mutex);
+  return error;
+}
+
+void wal_mark(Wal_Mark *mark){
+  mark->next = NULL;
+  if (wal.fd < 0){
+    mark->written = 1;
+    return;
+  }
+
+  pthread_mutex_lock(&wal.mutex);
+  mark->lsn = wal.appended;
+  mark->split = wal.pending.length;
+  mark->written = 0;
+  if (wal.last_mark != NULL) wal.last_mark->next = mark;
+  else wal.marks = mark;
+  wal.last_mark = mark;
+  pthread_mutex_unlock(&wal.mutex);
+}
+
+/// Copies the log from an offset of its file on to a new file, which then
+/// takes the log's path and fd. Caller must have the log to itself
+/// (flushing set by it), without holding the mutex.
+/// @param from Offset of the file the copy starts at, a batch's start.
+/// @param size Size of the file.
+/// @return 0 if successful, 1 otherwise.
+static int cut_log(size_t from, size_t size){
+  size_t length = strlen(wal.path);
+  char temporary[length + 5];
+  unsigned char *buffer = malloc(WAL_COPY_SIZE);
+  int in = open(wal.path, O_RDONLY), error = buffer == NULL || in < 0;
+
+  snprintf(temporary, sizeof(temporary), "%s.tmp", wal.path);
+  int out = error ? -1 : open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+  error |= out < 0;
+  while (!error && from < size){
+    size_t count = size - from < WAL_COPY_SIZE ? size - from : WAL_COPY_SIZE;
+    ssize_t got = pread(in, buffer, count, (off_t)from);
+    if (got < 0 && errno == EINTR) continue;
+    error = got <= 0 || write_all(out, buffer, (size_t)got) != 1;
+    if (got > 0) from += (size_t)got;
+  }
+  /** The copy is the log once it's renamed, so it's made as durable as the log first. */
+  error = error || (wal.sync != WAL_SYNC_NONE && fdatasync(out) != 0) || rename(temporary, wal.path) != 0 ||
+          (wal.sync != WAL_SYNC_NONE && snapshot_file_sync(out, wal.path) != 0);
+  /** The fd stays the same, the copy takes its place. */
+  if (!error) error = dup2(out, wal.fd) < 0;
+  else if (out >= 0) unlink(temporary);
+
+  if (out >= 0) close(out);
+  if (in >= 0) close(in);
+  free(buffer);
+  return error;
+}
+
+int wal_release(Wal_Mark *mark, int cut){
+  if (wal.fd < 0) return 0;
+
+  pthread_mutex_lock(&wal.mutex);
+  while (!mark->written){
+    if (wal.flushing) pthread_cond_wait(&wal.flushed, &wal.mutex);
+    else flush_locked();
+  }
+  while (cut && wal.flushing) pthread_cond_wait(&wal.flushed, &wal.mutex);
+  /** A later mark may have cut past it already. */
+  if (!cut || wal.error || mark->offset <= wal.start){
+    pthread_mutex_unlock(&wal.mutex);
+    return 0;
+  }
+  wal.flushing = 1;
+  uint64_t start = wal.start, end = wal.end;
+  pthread_mutex_unlock(&wal.mutex);
+
+  int error = cut_log((size_t)(mark->offset - start), (size_t)(end - start));
+
+  pthread_mutex_lock(&wal.mutex);
+  if (error) fprintf(stderr, "Failed to cut the log down to what came after a backup\n");
+  else wal.start = mark->offset;
+  wal.flushing = 0;
+  pthread_cond_broadcast(&wal.flushed);
+  pthread_mutex_unlock(&wal.mutex);
+  return error;
+}
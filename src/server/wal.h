@@ -0,0 +1,99 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "snapshot_file.h"
+
+/** Size of the header of each batch of the log: size of its records and
+ *  their checksum, little endian 64 bits. */
+#define WAL_BATCH_HEADER_SIZE 16
+/** Bytes waiting to be written after which an interval log flushes without
+ *  waiting for its flusher. */
+#define WAL_FLUSH_SIZE (1 << 20)
+/** Size of the buffer the log is copied through when it's cut. */
+#define WAL_COPY_SIZE (64 * 1024)
+
+/// When the log reaches the disk.
+typedef enum Wal_Sync{
+  /** Every command waits for its records to be synced. Commands of
+   *  different jobs arriving together share one write and fdatasync. */
+  WAL_SYNC_ALWAYS,
+  /** A flusher thread writes and syncs every few milliseconds, commands
+   *  don't wait (a crash loses at most that interval). */
+  WAL_SYNC_INTERVAL,
+  /** Records are written as in WAL_SYNC_ALWAYS but never synced, they
+   *  survive the server crashing but not the machine. */
+  WAL_SYNC_NONE
+}Wal_Sync;
+
+/// Point of the log a snapshot was taken at: records up to lsn were applied
+/// before it, the rest after. The records after it start a batch, at
+/// offset (counted from the start of the log, including whatever was cut).
+/// It's the caller's, registered on the log from wal_mark to wal_release.
+typedef struct Wal_Mark{
+  uint64_t lsn;
+  /** Bytes of the pending batch before the mark, until it's written. */
+  size_t split;
+  uint64_t offset;
+  int written;
+  struct Wal_Mark *next;
+}Wal_Mark;
+
+/// Applies every whole batch of a log, in order. A torn batch at the end
+/// (the server died while writing it) is cut off the file.
+/// @param path Path of the log, which may not exist yet.
+/// @param apply Called for every record (same format as snapshot records).
+/// @param arg Argument passed to apply.
+/// @return 0 if successful, 1 otherwise.
+int wal_replay(const char *path, int (*apply)(const Snapshot_Record *record, void *arg), void *arg);
+
+/// Opens the log for appending, starting its flusher if needed.
+/// @param path Path of the log.
+/// @param sync Sync policy.
+/// @param interval_ms Milliseconds between flushes, for WAL_SYNC_INTERVAL.
+/// @return 0 if successful, 1 otherwise.
+int wal_open(const char *path, Wal_Sync sync, unsigned int interval_ms);
+
+/// Flushes and closes the log. Does nothing if it isn't open. Every mark
+/// must have been released.
+void wal_close();
+
+/// Whether the log is open.
+/// @return 1 if it is, 0 otherwise.
+int wal_enabled();
+
+/// Adds the records of a command to the log, to be written in the same
+/// batch. Records of a key must be appended in the order they're applied
+/// (holding the key's stripe).
+/// @param count Number of records.
+/// @param keys Keys of the records.
+/// @param values Values of the records, NULL if they're all deletes.
+/// @param lsn Filled with the number to wait for with wal_commit.
+/// @return 0 if successful, 1 otherwise.
+int wal_append(size_t count, const char *const keys[], const char *const values[], uint64_t *lsn);
+
+/// Waits, as the sync policy says, until the records appended up to lsn
+/// are in the log. Call it without holding any stripe, so other commands
+/// can join the same batch.
+/// @param lsn Number given by wal_append.
+/// @return 0 if successful, 1 if the log can't be written.
+int wal_commit(uint64_t lsn);
+
+/// Notes where the log stands. Call it while holding every stripe, so the
+/// records before the mark are the ones a snapshot taken then sees. Does
+/// nothing but fill the mark if the log isn't open.
+/// @param mark Mark to register.
+void wal_mark(Wal_Mark *mark);
+
+/// Waits for a mark to be written and unregisters it. With cut set, for
+/// when the snapshot taken with it is durable, the log is then cut down to
+/// the records after the mark: they're copied to a new file that replaces
+/// the log. Appends go on meanwhile, commands wait for it to be done.
+/// @param mark Mark given to wal_mark.
+/// @param cut Whether the records before the mark can go.
+/// @return 0 if successful, 1 otherwise.
+int wal_release(Wal_Mark *mark, int cut);
+
+#endif // KVS_WAL_H